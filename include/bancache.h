@@ -21,7 +21,7 @@
 #pragma once
 
 /** Stores a cached ban entry.
- * Each ban has one of these hashed in a hash_map to make for faster removal
+ * Each ban has one of these stored by IP address in a CIDRTree to make for faster removal
  * of already-banned users in the case that they try to reconnect. As no wildcard
  * matching is done on these IPs, the speed of the system is improved. These cache
  * entries expire every few hours, which is a reasonable expiry for any reasonable
@@ -48,17 +48,16 @@ class CoreExport BanCacheHit
 	bool IsPositive() const { return (!Reason.empty()); }
 };
 
-/* A container of ban cache items.
+/* A container of ban cache items, keyed by full length masks of the IPs.
  * must be defined after class BanCacheHit.
  */
-typedef TR1NS::unordered_map<std::string, BanCacheHit*, TR1NS::hash<std::string> > BanCacheHash;
+typedef CIDRTree<BanCacheHit*> BanCacheTree;
 
 /** A manager for ban cache, which allocates and deallocates and checks cached bans.
  */
 class CoreExport BanCacheManager
 {
-	BanCacheHash* BanHash;
-	bool RemoveIfExpired(BanCacheHash::iterator& it);
+	BanCacheTree BanTree;
 
  public:
 
@@ -68,8 +67,8 @@ class CoreExport BanCacheManager
 	 * @param reason The reason for the ban. Left .empty() if it's a negative match.
 	 * @param seconds Number of seconds before nuking the bancache entry, the default is a day. This might seem long, but entries will be removed as glines/etc expire.
 	 */
-	BanCacheHit *AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds = 0);
-	BanCacheHit *GetHit(const std::string &ip);
+	BanCacheHit *AddHit(const irc::sockets::sockaddrs& ip, const std::string &type, const std::string &reason, time_t seconds = 0);
+	BanCacheHit *GetHit(const irc::sockets::sockaddrs& ip);
 
 	/** Removes all entries of a given type, either positive or negative. Returns the number of hits removed.
 	 * @param type The type of bancache entries to remove (e.g. 'G')
@@ -77,9 +76,5 @@ class CoreExport BanCacheManager
 	 */
 	void RemoveEntries(const std::string& type, bool positive);
 
-	BanCacheManager()
-	{
-		this->BanHash = new BanCacheHash();
-	}
 	~BanCacheManager();
 };
@@ -26,6 +26,36 @@
 #include "mode.h"
 #include "parammode.h"
 
+/** A nick!ident@host mask prepared for matching against many users, see Channel::CheckBan()
+ */
+class CoreExport BanMask : public refcountbase
+{
+ public:
+	/** The mask as it is in the list */
+	const std::string mask;
+
+	/** False for extbans and masks without an '@', which never match as a hostmask */
+	bool valid;
+
+	/** True if the nick!ident part has exactly one '!', the nick and ident are matched on their own then */
+	bool split;
+
+	/** Compiled nick and ident parts of the mask, used if split is true */
+	WildcardMask nick;
+	WildcardMask ident;
+
+	/** Compiled nick!ident part of the mask, used if split is false */
+	WildcardMask nickident;
+
+	/** Compiled host part of the mask, matched against the real host, the displayed host and the IP */
+	WildcardMask host;
+
+	/** True if the host part may be a CIDR range, it is then also tried as one against the IP */
+	bool cidr;
+
+	BanMask(const std::string& mask);
+};
+
 /** Holds an entry for a ban list, exemption list, or invite list.
  * This class contains a single element in a channel list, such as a banlist.
  */
@@ -36,6 +66,24 @@
  */
 class CoreExport Channel : public Extensible, public InviteBase<Channel>
 {
+ public:
+	/** A local member of the channel, kept in a dense array so broadcasts
+	 * can walk the local recipients without touching remote users
+	 */
+	struct LocalMember
+	{
+		LocalUser* user;
+		Membership* memb;
+		LocalMember(LocalUser* u, Membership* m) : user(u), memb(m) { }
+	};
+	typedef std::vector<LocalMember> LocalMemberList;
+
+ private:
+	/** Local members of the channel in no particular order.
+	 * Membership::localpos is the index of a local membership in this array.
+	 */
+	LocalMemberList localmembers;
+
 	/** Set default modes for the channel on creation
 	 */
 	void SetDefaultModes();
@@ -55,6 +103,23 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	void DelUser(const UserMembIter& membiter);
 
+	/** Incremented whenever a list mode changes on the channel, see InvalidateBanCache()
+	 */
+	unsigned int bangeneration;
+
+	/** Get the membership of a user with its cached ban verdicts, discarding them if they are stale
+	 * @param user The user to look up
+	 * @return The membership or NULL if the user is not on the channel
+	 */
+	Membership* GetBanCache(User* user);
+
+	/** Check a user against the ban list, without asking OnCheckChannelBan
+	 * @param user The user to check
+	 * @param memb The membership of the user to cache the result in, or NULL
+	 * @return True if an entry on the ban list matches the user
+	 */
+	bool MatchBanList(User* user, Membership* memb);
+
  public:
 	/** Creates a channel record and initialises it with default values
 	 * @param name The name of the channel
@@ -168,6 +233,13 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	const UserMembList* GetUsers() const { return &userlist; }
 
+	/** Get the local members of the channel.
+	 * This is a subset of GetUsers() stored contiguously, use it when only
+	 * local users are of interest, such as when sending a message.
+	 * @return The local members of the channel
+	 */
+	const LocalMemberList& GetLocalMembers() const { return localmembers; }
+
 	/** Returns true if the user given is on the given channel.
 	 * @param user The user to look for
 	 * @return True if the user is on this channel
@@ -279,6 +351,8 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	void WriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string& text);
 	/** Write a line of text that already includes the source */
 	void RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string& text);
+	/** Write a line built by LocalUser::PrepareLine() or a MessageBuilder, which already includes the source */
+	void RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const reference<SendBuffer>& message);
 
 	/** Return the channel's modes with parameters.
 	 * @param showkey If this is set to true, the actual key is shown,
@@ -306,16 +380,32 @@ class CoreExport Channel : public Extensible, public InviteBase<Channel>
 	 */
 	unsigned int GetPrefixValue(User* user);
 
-	/** Check if a user is banned on this channel
+	/** Check if a user is banned on this channel.
+	 * The result is cached on the membership of the user (if any) until
+	 * InvalidateBanCache() is called on the channel or the user.
 	 * @param user A user to check against the banlist
 	 * @returns True if the user given is banned
 	 */
 	bool IsBanned(User* user);
 
+	/** Discard the ban verdicts cached for the members of this channel, see IsBanned().
+	 * Done by ListModeBase on every list change and on all channels when a module
+	 * is loaded or unloaded or the server is rehashed.
+	 */
+	void InvalidateBanCache() { bangeneration++; }
+
+	/** Discard the ban verdicts cached on every channel
+	 */
+	static void InvalidateAllBanCaches();
+
 	/** Check a single ban for match
 	 */
 	bool CheckBan(User* user, const std::string& banmask);
 
+	/** Check a single ban for match, using a mask which was prepared before
+	 */
+	bool CheckBan(User* user, const BanMask& banmask);
+
 	/** Get the status of an "action" type extban
 	 */
 	ModResult GetExtBanStatus(User *u, char type);
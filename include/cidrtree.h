@@ -0,0 +1,335 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Map from CIDR ranges to values, stored as a path compressed binary trie
+ * (a radix tree) with one tree per address family. Finding every range
+ * which contains an address takes at most one step per stored prefix
+ * length on the path to it, no matter how many ranges are stored.
+ * Iterating visits IPv4 ranges before IPv6 ones, and a range before the
+ * ranges it contains.
+ */
+template <typename T>
+class CIDRTree
+{
+	typedef std::pair<const irc::sockets::cidr_mask, T> Entry;
+
+	struct Node
+	{
+		/** The range of this node and its value, the first length bits of the range are shared by every node below it */
+		Entry entry;
+
+		/** True if the range was inserted, false for nodes which only join two subtrees */
+		bool used;
+
+		Node* child[2];
+
+		Node(const irc::sockets::cidr_mask& r, bool u)
+			: entry(r, T()), used(u)
+		{
+			child[0] = child[1] = NULL;
+		}
+
+		~Node()
+		{
+			delete child[0];
+			delete child[1];
+		}
+	};
+
+	/** Roots for IPv4 and IPv6 */
+	Node* roots[2];
+
+	/** Number of used nodes */
+	size_t count;
+
+	static unsigned int Bit(const irc::sockets::cidr_mask& mask, unsigned int pos)
+	{
+		return (mask.bits[pos / 8] >> (7 - (pos % 8))) & 1;
+	}
+
+	/** Get the number of leading bits two masks share, up to limit */
+	static unsigned int CommonBits(const irc::sockets::cidr_mask& a, const irc::sockets::cidr_mask& b, unsigned int limit)
+	{
+		unsigned int pos = 0;
+		while ((pos + 8 <= limit) && (a.bits[pos / 8] == b.bits[pos / 8]))
+			pos += 8;
+		while ((pos < limit) && (Bit(a, pos) == Bit(b, pos)))
+			pos++;
+		return pos;
+	}
+
+	/** Get the first length bits of a mask */
+	static irc::sockets::cidr_mask Truncate(const irc::sockets::cidr_mask& mask, unsigned int length)
+	{
+		irc::sockets::cidr_mask ret = mask;
+		ret.length = length;
+		for (unsigned int i = 0; i < sizeof(ret.bits); i++)
+		{
+			if (i * 8 >= length)
+				ret.bits[i] = 0;
+			else if ((i + 1) * 8 > length)
+				ret.bits[i] &= (0xFF00 >> (length % 8)) & 0xFF;
+		}
+		return ret;
+	}
+
+	Node** Root(const irc::sockets::cidr_mask& mask)
+	{
+		if (mask.type == AF_INET)
+			return &roots[0];
+		if (mask.type == AF_INET6)
+			return &roots[1];
+		return NULL;
+	}
+
+	Node* const* Root(const irc::sockets::cidr_mask& mask) const
+	{
+		return const_cast<CIDRTree*>(this)->Root(mask);
+	}
+
+	/** Find the link to the node with exactly the given range
+	 * @param path If not NULL, receives the links walked through before the node
+	 * @return The link or NULL if there is no such node
+	 */
+	Node** FindLink(const irc::sockets::cidr_mask& mask, std::vector<Node**>* path)
+	{
+		Node** link = Root(mask);
+		if (!link)
+			return NULL;
+
+		while (*link)
+		{
+			Node* node = *link;
+			if ((node->entry.first.length > mask.length) || (CommonBits(node->entry.first, mask, node->entry.first.length) < node->entry.first.length))
+				return NULL;
+			if (node->entry.first.length == mask.length)
+				return link;
+			if (path)
+				path->push_back(link);
+			link = &node->child[Bit(mask, node->entry.first.length)];
+		}
+		return NULL;
+	}
+
+	/** Remove a node which is not used if it has less than two children */
+	static void Collapse(Node** link)
+	{
+		Node* node = *link;
+		if ((node->used) || (node->child[0] && node->child[1]))
+			return;
+
+		*link = (node->child[0] ? node->child[0] : node->child[1]);
+		node->child[0] = node->child[1] = NULL;
+		delete node;
+	}
+
+	// Uncopyable
+	CIDRTree(const CIDRTree&);
+	void operator=(const CIDRTree&);
+
+ public:
+	/** Iterator over the ranges in the tree and their values, which stay valid while the tree is not changed */
+	class const_iterator
+	{
+		/** Nodes left to visit, the current one is at the back */
+		std::vector<const Node*> pending;
+
+		/** Move to the next node in pre-order */
+		void Step()
+		{
+			const Node* node = pending.back();
+			pending.pop_back();
+			for (unsigned int i = 2; i-- > 0; )
+				if (node->child[i])
+					pending.push_back(node->child[i]);
+		}
+
+		/** Skip nodes which only join two subtrees */
+		void SkipUnused()
+		{
+			while (!pending.empty() && !pending.back()->used)
+				Step();
+		}
+
+		friend class CIDRTree;
+
+	 public:
+		const Entry& operator*() const { return pending.back()->entry; }
+		const Entry* operator->() const { return &pending.back()->entry; }
+
+		const_iterator& operator++()
+		{
+			Step();
+			SkipUnused();
+			return *this;
+		}
+
+		bool operator==(const const_iterator& other) const
+		{
+			if (pending.empty() || other.pending.empty())
+				return (pending.empty() == other.pending.empty());
+			return (pending.back() == other.pending.back());
+		}
+
+		bool operator!=(const const_iterator& other) const { return !(*this == other); }
+	};
+
+	CIDRTree()
+		: count(0)
+	{
+		roots[0] = roots[1] = NULL;
+	}
+
+	~CIDRTree()
+	{
+		clear();
+	}
+
+	/** Get the value of a range, inserting a default constructed one if the range is not in the tree
+	 * @param mask The range, its bits past the length must be zero as they are in any cidr_mask
+	 * @return The value, or NULL if the mask has an unknown address family
+	 */
+	T* Insert(const irc::sockets::cidr_mask& mask)
+	{
+		Node** link = Root(mask);
+		if (!link)
+			return NULL;
+
+		while (*link)
+		{
+			Node* node = *link;
+			const unsigned int common = CommonBits(node->entry.first, mask, std::min(node->entry.first.length, mask.length));
+			if (common < node->entry.first.length)
+			{
+				// The new range splits the path to this node
+				Node* newnode = new Node(mask, true);
+				count++;
+				if (common == mask.length)
+				{
+					newnode->child[Bit(node->entry.first, common)] = node;
+					*link = newnode;
+				}
+				else
+				{
+					Node* branch = new Node(Truncate(mask, common), false);
+					branch->child[Bit(mask, common)] = newnode;
+					branch->child[Bit(node->entry.first, common)] = node;
+					*link = branch;
+				}
+				return &newnode->entry.second;
+			}
+
+			if (node->entry.first.length == mask.length)
+			{
+				if (!node->used)
+				{
+					node->used = true;
+					count++;
+				}
+				return &node->entry.second;
+			}
+			link = &node->child[Bit(mask, node->entry.first.length)];
+		}
+
+		*link = new Node(mask, true);
+		count++;
+		return &(*link)->entry.second;
+	}
+
+	/** Get the value of a range
+	 * @return The value or NULL if the range is not in the tree
+	 */
+	T* Find(const irc::sockets::cidr_mask& mask)
+	{
+		Node** link = FindLink(mask, NULL);
+		return ((link && (*link)->used) ? &(*link)->entry.second : NULL);
+	}
+
+	const T* Find(const irc::sockets::cidr_mask& mask) const
+	{
+		return const_cast<CIDRTree*>(this)->Find(mask);
+	}
+
+	/** Remove a range from the tree
+	 * @return True if the range was in the tree
+	 */
+	bool Erase(const irc::sockets::cidr_mask& mask)
+	{
+		std::vector<Node**> path;
+		Node** link = FindLink(mask, &path);
+		if (!link || !(*link)->used)
+			return false;
+
+		(*link)->used = false;
+		(*link)->entry.second = T();
+		count--;
+
+		Collapse(link);
+		if (!path.empty())
+			Collapse(path.back());
+		return true;
+	}
+
+	/** Get the values of all ranges which contain an address, shortest range first
+	 * @param addr The address, a cidr_mask of the full address length
+	 * @param out Receives the values
+	 */
+	void FindAll(const irc::sockets::cidr_mask& addr, std::vector<T*>& out) const
+	{
+		Node* const* link = Root(addr);
+		if (!link)
+			return;
+
+		for (Node* node = *link; node; )
+		{
+			if ((node->entry.first.length > addr.length) || (CommonBits(node->entry.first, addr, node->entry.first.length) < node->entry.first.length))
+				break;
+			if (node->used)
+				out.push_back(&node->entry.second);
+			if (node->entry.first.length == addr.length)
+				break;
+			node = node->child[Bit(addr, node->entry.first.length)];
+		}
+	}
+
+	const_iterator begin() const
+	{
+		const_iterator it;
+		for (unsigned int i = 2; i-- > 0; )
+			if (roots[i])
+				it.pending.push_back(roots[i]);
+		it.SkipUnused();
+		return it;
+	}
+
+	const_iterator end() const { return const_iterator(); }
+
+	/** Get the number of ranges in the tree */
+	size_t size() const { return count; }
+
+	bool empty() const { return (count == 0); }
+
+	void clear()
+	{
+		delete roots[0];
+		delete roots[1];
+		roots[0] = roots[1] = NULL;
+		count = 0;
+	}
+};
@@ -23,20 +23,149 @@
 
 #include "modules.h"
 
-/* Forward ref for typedefs */
-class WhoWasGroup;
-
-/** A group of users related by nickname
+/** Packed storage of WHOWAS records.
+ * Records are kept oldest first in one ring buffer of bytes, so dropping the
+ * oldest record only moves the start of the ring. Hosts and server names are
+ * interned because most of them repeat, and the records of a nick are linked
+ * to each other from a hash of nicks. The ring, the interned strings and the
+ * hash together are kept within a byte budget.
  */
-typedef std::deque<WhoWasGroup*> whowas_set;
+class WhoWasStore
+{
+	/** Interned strings and the number of records using them */
+	typedef TR1NS::unordered_map<std::string, unsigned int> InternMap;
+	typedef const InternMap::value_type* Interned;
 
-/** Sets of users in the whowas system
- */
-typedef std::map<irc::string,whowas_set*> whowas_users;
+ public:
+	/** Offset used for "no record" */
+	static const uint32_t NONE = 0xFFFFFFFF;
 
-/** Sets of time and users in whowas list
- */
-typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
+	/** Header of a record in the ring, followed by the nick, ident and real name
+	 */
+	struct Record
+	{
+		/** Size of the record including this header and padding */
+		uint32_t size;
+
+		/** Offsets of the next newer and next older record of the same nick, or NONE */
+		uint32_t newer;
+		uint32_t older;
+
+		/** Lengths of the nick, ident and real name */
+		uint16_t nicklen;
+		uint16_t identlen;
+		uint16_t gecoslen;
+
+		/** Signon time */
+		time_t signon;
+
+		/** Time the user quit or changed nick */
+		time_t quit;
+
+		/** Real host, displayed host and server name, all NULL if the record was dropped */
+		Interned host;
+		Interned dhost;
+		Interned server;
+
+		const char* GetNick() const { return reinterpret_cast<const char*>(this + 1); }
+		const char* GetIdent() const { return GetNick() + nicklen; }
+		const char* GetGecos() const { return GetIdent() + identlen; }
+		const std::string& GetHost() const { return host->first; }
+		const std::string& GetDisplayedHost() const { return dhost->first; }
+		const std::string& GetServer() const { return server->first; }
+	};
+
+ private:
+	/** Records of a nick */
+	struct Nick
+	{
+		uint32_t newest;
+		uint32_t oldest;
+		unsigned int count;
+	};
+
+	typedef TR1NS::unordered_map<std::string, Nick, irc::insensitive, irc::StrHashComp> NickMap;
+
+	/** The ring of records */
+	std::vector<char> ring;
+
+	/** Offset of the oldest record and of the end of the newest one */
+	uint32_t tail;
+	uint32_t head;
+
+	/** True if the records continue from the start of the ring after wrapend */
+	bool wrapped;
+	uint32_t wrapend;
+
+	/** Number of bytes the ring may use */
+	size_t budget;
+
+	/** Bytes used by records in the ring, including dropped ones not yet reclaimed */
+	size_t used;
+
+	/** Estimated bytes used by the interned strings and the nick hash */
+	size_t overhead;
+
+	/** Number of records which were not dropped */
+	size_t count;
+
+	InternMap interned;
+	NickMap nicks;
+
+	Record* At(uint32_t pos) { return reinterpret_cast<Record*>(&ring[pos]); }
+
+	Interned Intern(const std::string& str);
+	void Release(Interned str);
+
+	/** Find free space for a record, without making any
+	 * @return Offset of the space or NONE if the ring is too full
+	 */
+	uint32_t Allocate(uint32_t size);
+
+	/** Remove a record from the records of its nick and release its strings */
+	void Drop(uint32_t pos);
+
+	/** Free the space of the oldest record in the ring */
+	void EvictOldest();
+
+	/** Add a record at the end of the ring, evicting old ones as needed
+	 * @return Offset of the new record or NONE if it does not fit
+	 */
+	uint32_t Place(uint32_t size);
+
+	/** Link a record in as the newest one of its nick */
+	void Link(uint32_t pos, unsigned int groupsize);
+
+ public:
+	WhoWasStore();
+
+	/** Add a record for a user
+	 * @param user The user
+	 * @param groupsize Maximum number of records to keep for the nick of the user
+	 */
+	void Add(User* user, unsigned int groupsize);
+
+	/** Get the records of a nick
+	 * @param nick The nick
+	 * @param out Receives the records, oldest first
+	 */
+	void Find(const std::string& nick, std::vector<const Record*>& out);
+
+	/** Remove records that were added before a given time */
+	void Expire(time_t before);
+
+	/** Change the limits, dropping records that do not fit them anymore
+	 * @param newbudget The number of bytes the store may use, 0 to remove all records
+	 * @param groupsize Maximum number of records to keep per nick
+	 */
+	void SetLimits(size_t newbudget, unsigned int groupsize);
+
+	/** Get the number of records */
+	size_t GetCount() const { return count; }
+
+	/** Get the number of bytes in use */
+	size_t GetUsage() const { return used + overhead; }
+};
 
 /** Handle /WHOWAS. These command handlers can be reloaded by the core,
  * and handle basic RFC1459 commands. Commands within modules work
@@ -46,23 +175,19 @@ typedef std::deque<std::pair<time_t,irc::string> > whowas_users_fifo;
 class CommandWhowas : public Command
 {
   private:
-	/** Primary container, links nicknames tracked by WHOWAS to a list of records
+	/** Records of the nicks tracked by WHOWAS
 	 */
-	whowas_users whowas;
-
-	/** List of nicknames in the order they were inserted into the map
-	 */
-	whowas_users_fifo whowas_fifo;
+	WhoWasStore store;
 
   public:
 	/** Max number of WhoWas entries per user.
 	 */
 	unsigned int GroupSize;
 
-	/** Max number of cumulative user-entries in WhoWas.
+	/** Max number of bytes used by WhoWas.
 	 *  When max reached and added to, push out oldest entry FIFO style.
 	 */
-	unsigned int MaxGroups;
+	unsigned int MaxSize;
 
 	/** Max seconds a user is kept in WhoWas before being pruned.
 	 */
@@ -80,34 +205,4 @@ class CommandWhowas : public Command
 	std::string GetStats();
 	void Prune();
 	void Maintain();
-	~CommandWhowas();
-};
-
-/** Used to hold WHOWAS information
- */
-class WhoWasGroup
-{
- public:
-	/** Real host
-	 */
-	std::string host;
-	/** Displayed host
-	 */
-	std::string dhost;
-	/** Ident
-	 */
-	std::string ident;
-	/** Server name
-	 */
-	std::string server;
-	/** Fullname (GECOS)
-	 */
-	std::string gecos;
-	/** Signon time
-	 */
-	time_t signon;
-
-	/** Initialize this WhoWasFroup with a user
-	 */
-	WhoWasGroup(User* user);
 };
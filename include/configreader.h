@@ -345,6 +345,12 @@ class CoreExport ServerConfig
 	 */
 	int NetBufferSize;
 
+	/** The maximum size of the buffer which small writes to a socket
+	 * are merged into before being sent, to save system calls and
+	 * SSL records.
+	 */
+	unsigned int WriteBufferSize;
+
 	/** The value to be used for listen() backlogs
 	 * as default.
 	 */
@@ -357,6 +363,10 @@ class CoreExport ServerConfig
 	 */
 	bool CCOnConnect;
 
+	/** If true, the calls modules get to their hooks are counted and timed, see HookTimer
+	 */
+	bool HookProfiling;
+
 	/** The soft limit value assigned to the irc server.
 	 * The IRC server will not allow more than this
 	 * number of local users.
@@ -45,8 +45,10 @@
 
 #include "intrusive_list.h"
 #include "compat.h"
+#include "smallset.h"
 #include "typedefs.h"
 #include "stdalgo.h"
+#include "wildcard.h"
 
 CoreExport extern InspIRCd* ServerInstance;
 
@@ -60,13 +62,14 @@ CoreExport extern InspIRCd* ServerInstance;
 #include "numerics.h"
 #include "uid.h"
 #include "server.h"
+#include "timer.h"
 #include "users.h"
 #include "channels.h"
-#include "timer.h"
 #include "hashcomp.h"
 #include "logger.h"
-#include "usermanager.h"
 #include "socket.h"
+#include "cidrtree.h"
+#include "usermanager.h"
 #include "ctables.h"
 #include "command_parse.h"
 #include "mode.h"
@@ -678,3 +681,8 @@ inline void stdalgo::culldeleter::operator()(classbase* item)
 	if (item)
 		ServerInstance->GlobalCulls.AddItem(item);
 }
+
+inline HookTimer::HookTimer(Module* m, Implementation i)
+	: mod(m), hook(i), start(ServerInstance->Config->HookProfiling ? ModuleManager::GetCycles() : 0)
+{
+}
@@ -97,6 +97,47 @@ class CoreExport SocketTimeout : public Timer
 	virtual bool Tick(time_t now);
 };
 
+/** A reference counted block of data waiting to be sent.
+ * The same buffer may be queued on the sendq of any number of sockets at
+ * once, so a message going to many recipients only has to be built once.
+ * The data is never modified while more than one reference to it exists.
+ */
+class CoreExport SendBuffer : public refcountbase
+{
+	/** The data held by this buffer */
+	std::string data;
+
+	/** StreamSocket appends small writes to buffers which only it references */
+	friend class StreamSocket;
+
+	/** MessageBuilder assembles a line directly in a new buffer */
+	friend class MessageBuilder;
+
+	SendBuffer() { }
+
+ public:
+	/** Create a new buffer holding a copy of the given data
+	 * @param text The data to send
+	 */
+	SendBuffer(const std::string& text) : data(text) { }
+
+	/** Create a new buffer holding two strings joined together
+	 * @param text The data to send
+	 * @param suffix Data to append after text, e.g. a line terminator
+	 */
+	SendBuffer(const std::string& text, const std::string& suffix)
+	{
+		data.reserve(text.length() + suffix.length());
+		data.append(text).append(suffix);
+	}
+
+	/** Get the data held by this buffer */
+	const std::string& GetData() const { return data; }
+
+	/** Get the length, in bytes, of the data held by this buffer */
+	size_t length() const { return data.length(); }
+};
+
 /**
  * StreamSocket is a class that wraps a TCP socket and handles send
  * and receive queues, including passing them to IO hooks
@@ -106,17 +147,42 @@ class CoreExport StreamSocket : public EventHandler
 	/** The IOHook that handles raw I/O for this socket, or NULL */
 	IOHook* iohook;
 
-	/** Private send queue. Note that individual strings may be shared
+	/** Private send queue. Buffers may be shared with the sendqs of other sockets,
+	 * so they are never modified once queued.
 	 */
-	std::deque<std::string> sendq;
+	std::deque<reference<SendBuffer> > sendq;
+	/** Number of bytes of the first buffer in the sendq which have already been sent */
+	size_t sendq_head;
 	/** Length, in bytes, of the sendq */
 	size_t sendq_len;
 	/** Error - if nonempty, the socket is dead, and this is the reason. */
 	std::string error;
  protected:
+	/** Data which has been read from the socket but not yet processed */
 	std::string recvq;
+	/** Number of bytes at the start of the recvq which have already been consumed.
+	 * Consumed data is removed in one go by CompactRecvQ() rather than after every
+	 * line, so extracting many lines from one read does not move the buffer each time.
+	 */
+	std::string::size_type recvq_head;
+
+	/** Remove the consumed data from the start of the recvq */
+	void CompactRecvQ();
+
+	/** Try to append data to the last buffer in the sendq instead of queueing a new one.
+	 * This is only possible if no other socket references that buffer and the result
+	 * is no larger than \<performance:writebuffersize>.
+	 * @param data The data to append
+	 * @return True if the data was appended, false if it must be queued separately
+	 */
+	bool CoalesceWrite(const std::string& data);
+
+	/** Put data which was taken off the front of the sendq back there without copying it
+	 * @param data The data, its storage is taken over and it is left empty
+	 */
+	void RequeueFront(std::string& data);
  public:
-	StreamSocket() : iohook(NULL), sendq_len(0) {}
+	StreamSocket() : iohook(NULL), sendq_head(0), sendq_len(0), recvq_head(0) {}
 	IOHook* GetIOHook() const;
 	void AddIOHook(IOHook* hook);
 	void DelIOHook();
@@ -140,10 +206,20 @@ class CoreExport StreamSocket : public EventHandler
 	/** Called when the socket gets an error from socket engine or IO hook */
 	virtual void OnError(BufferedSocketError e) = 0;
 
-	/** Send the given data out the socket, either now or when writes unblock
+	/** Send the given data out the socket, either now or when writes unblock.
+	 * Small writes are merged into one contiguous buffer of up to
+	 * \<performance:writebuffersize> bytes.
 	 */
 	void WriteData(const std::string& data);
-	/** Convenience function: read a line from the socket
+	/** Send the given buffer out the socket, either now or when writes unblock.
+	 * The buffer is queued without being copied and may be queued on other sockets too.
+	 * Only a buffer no other socket holds is merged into the buffer small writes are
+	 * currently being merged into, if it fits.
+	 */
+	void WriteData(const reference<SendBuffer>& data);
+	/** Convenience function: read a line from the socket.
+	 * Call this in a loop until it returns false; the recvq is only compacted
+	 * once no complete line is left in it.
 	 * @param line The line read
 	 * @param delim The line delimiter
 	 * @return true if a line was read
@@ -59,8 +59,14 @@ class IOHook : public classbase
 	 */
 	IOHookProvider* const prov;
 
+	/** Set by the hook once the data written to the socket no longer has to pass
+	 * through OnStreamSocketWrite(), e.g. because the kernel took over encrypting it.
+	 * The socket then writes its sendq itself like an unhooked socket does.
+	 */
+	bool passthroughwrite;
+
 	IOHook(IOHookProvider* provider)
-		: prov(provider) { }
+		: prov(provider), passthroughwrite(false) { }
 
 	/**
 	 * Called when a hooked stream has data to write, or when the socket
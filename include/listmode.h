@@ -33,6 +33,17 @@ class CoreExport ListModeBase : public ModeHandler
 		time_t time;
 		ListItem(const std::string& Mask, const std::string& Setter, time_t Time)
 			: setter(Setter), mask(Mask), time(Time) { }
+
+		/** Get the mask prepared for Channel::CheckBan(), it is created on first use */
+		const BanMask& GetBanMask() const
+		{
+			if (!banmask)
+				banmask = new BanMask(mask);
+			return *banmask;
+		}
+
+	 private:
+		mutable reference<BanMask> banmask;
 	};
 
 	/** Items stored in the channel's list
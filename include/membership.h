@@ -27,7 +27,22 @@ class CoreExport Membership : public Extensible, public intrusive_list_node<Memb
 	Channel* const chan;
 	// mode list, sorted by prefix rank, higest first
 	std::string modes;
-	Membership(User* u, Channel* c) : user(u), chan(c) {}
+	/** Index of this membership in the local member array of the channel,
+	 * only meaningful if the user is local
+	 */
+	size_t localpos;
+	/** Generations of the channel and the user the cached ban verdicts below were computed at,
+	 * the verdicts are stale when either differs, see Channel::IsBanned()
+	 */
+	unsigned int banchangen;
+	unsigned int banusergen;
+	/** Cached result of Channel::IsBanned(), -1 if unknown
+	 */
+	signed char banned;
+	/** Cached result of matching the user against the ban list alone, -1 if unknown
+	 */
+	signed char banlistmatch;
+	Membership(User* u, Channel* c) : user(u), chan(c), localpos(0), banchangen(0), banusergen(0), banned(-1), banlistmatch(-1) {}
 	inline bool hasMode(char m) const
 	{
 		return modes.find(m) != std::string::npos;
@@ -126,6 +126,7 @@ struct ModResult {
 	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
+		HookTimer _timer(*_i, I_ ## y); \
 		try \
 		{ \
 			(*_i)->y x ; \
@@ -149,6 +150,7 @@ do { \
 	for (IntModuleList::const_reverse_iterator _i = _handlers.rbegin(), _next; _i != _handlers.rend(); _i = _next) \
 	{ \
 		_next = _i+1; \
+		HookTimer _timer(*_i, I_ ## n); \
 		try \
 		{ \
 			v = (*_i)->n args;
@@ -266,9 +268,27 @@ enum Implementation
 	I_OnWhoisLine, I_OnBuildNeighborList, I_OnGarbageCollect, I_OnSetConnectClass,
 	I_OnText, I_OnPassCompare, I_OnNamesListItem, I_OnNumeric,
 	I_OnPreRehash, I_OnModuleRehash, I_OnSendWhoLine, I_OnChangeIdent, I_OnSetUserIP,
+	I_OnSendQDrained, I_OnChangeRealHost,
 	I_END
 };
 
+/** Calls of a module to one of its hooks, counted while <performance:hookprofiling> is enabled.
+ * Cycles are CPU timestamp counter ticks where available and nanoseconds elsewhere.
+ */
+struct HookProfile
+{
+	/** Number of calls */
+	unsigned long calls;
+
+	/** Time spent in all calls together, including hooks called by them */
+	unsigned long long cycles;
+
+	/** Time spent in the longest call */
+	unsigned long long maxcycles;
+
+	HookProfile() : calls(0), cycles(0), maxcycles(0) { }
+};
+
 /** Base class for all InspIRCd modules
  *  This class is the base class for InspIRCd modules. All modules must inherit from this class,
  *  its methods will be called when irc server events occur. class inherited from module must be
@@ -294,6 +314,10 @@ class CoreExport Module : public classbase, public usecountbase
 	 */
 	bool dying;
 
+	/** Profiles of the hooks of this module indexed by Implementation, NULL until hook profiling records a call
+	 */
+	HookProfile* HookProfiles;
+
 	/** Default constructor.
 	 * Creates a module class. Don't do any type of hook registration or checks
 	 * for other modules here; do that in init().
@@ -556,7 +580,7 @@ class CoreExport Module : public classbase, public usecountbase
 	 *
 	 * Set exceptions[user] = true to include, exceptions[user] = false to exclude
 	 */
-	virtual void OnBuildNeighborList(User* source, IncludeChanList& include_c, std::map<User*, bool>& exceptions);
+	virtual void OnBuildNeighborList(User* source, IncludeChanList& include_c, NeighborExceptions& exceptions);
 
 	/** Called before any nickchange, local or remote. This can be used to implement Q-lines etc.
 	 * Please note that although you can see remote nickchanges through this function, you should
@@ -823,6 +847,8 @@ class CoreExport Module : public classbase, public usecountbase
 	 * Note that the registration timeout for a user overrides these checks, if the registration
 	 * timeout is reached, the user is disconnected even if modules report that the user is
 	 * not ready to connect.
+	 * Users who are held back are checked again once a second; call UserManager::CheckReady()
+	 * when the reason for holding a user back goes away to let it connect right away.
 	 * @param user The user to check
 	 * @return true to indicate readiness, false if otherwise
 	 */
@@ -890,6 +916,10 @@ class CoreExport Module : public classbase, public usecountbase
 	 * @param chan The channel to check in
 	 * @return MOD_RES_DENY to mark as banned, MOD_RES_ALLOW to skip the
 	 * ban check, or MOD_RES_PASSTHRU to check bans normally
+	 * The result is cached for channel members, if it depends on anything but the
+	 * user's hostmask, IP, gecos, oper status, channels and the list modes of the
+	 * channel, call User::InvalidateBanCache() or Channel::InvalidateBanCache()
+	 * when that changes.
 	 */
 	virtual ModResult OnCheckChannelBan(User* user, Channel* chan);
 
@@ -900,6 +930,7 @@ class CoreExport Module : public classbase, public usecountbase
 	 * @param mask The mask being checked
 	 * @return MOD_RES_DENY to mark as banned, MOD_RES_ALLOW to skip the
 	 * ban check, or MOD_RES_PASSTHRU to check bans normally
+	 * The result is cached like that of OnCheckChannelBan().
 	 */
 	virtual ModResult OnCheckBan(User* user, Channel* chan, const std::string& mask);
 
@@ -1068,6 +1099,19 @@ class CoreExport Module : public classbase, public usecountbase
 	 * @param user The user whose IP is being set
 	 */
 	virtual void OnSetUserIP(LocalUser* user);
+
+	/** Called after a write leaves the sendq of a local user below the soft sendq limit,
+	 * if UserIOHandler::NotifyOnDrain() was called for that user since the last call.
+	 * @param user The user whose sendq has drained
+	 */
+	virtual void OnSendQDrained(LocalUser* user);
+
+	/** Called whenever the real hostname of a user is changed.
+	 * This event triggers after the host (and the displayed host, if it was reset) has been set.
+	 * @param user The user whose real host was changed
+	 * @param newhost The new real hostname
+	 */
+	virtual void OnChangeRealHost(User* user, const std::string& newhost);
 };
 
 /** A list of modules
@@ -1281,6 +1325,43 @@ class CoreExport ModuleManager
 	 * @return A ModuleMap containing all loaded modules
 	 */
 	const ModuleMap& GetModules() const { return Modules; }
+
+	/** Read the counter hook calls are timed with
+	 * @return The CPU timestamp counter on x86, a monotonic clock in nanoseconds elsewhere
+	 */
+	static unsigned long long GetCycles();
+
+	/** Add a timed call to the profile of a hook
+	 * @param mod The module which was called
+	 * @param i The hook
+	 * @param cycles Time the call took as measured by GetCycles()
+	 */
+	static void RecordHook(Module* mod, Implementation i, unsigned long long cycles);
+
+	/** Get the name of a hook
+	 * @param i The hook
+	 * @return The name of the Module method, e.g. "OnUserPreMessage"
+	 */
+	static const char* GetHookName(Implementation i);
+};
+
+/** Times one call to a hook if hook profiling is enabled, otherwise only a flag is checked.
+ * Used by FOREACH_MOD and friends.
+ */
+class HookTimer
+{
+	Module* const mod;
+	const Implementation hook;
+	const unsigned long long start;
+
+ public:
+	inline HookTimer(Module* m, Implementation i);
+
+	~HookTimer()
+	{
+		if (start)
+			ModuleManager::RecordHook(mod, hook, ModuleManager::GetCycles() - start);
+	}
 };
 
 /** Do not mess with these functions unless you know the C preprocessor
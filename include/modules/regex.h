@@ -41,6 +41,260 @@ public:
 	{
 		return regex_string;
 	}
+
+	/** Get a string which is contained in every text this regex matches. It is
+	 * compared case insensitively using the national case map and is used to skip
+	 * the regex for texts which do not contain it.
+	 * @return The string or an empty string if no such string is known
+	 */
+	virtual std::string GetLiteral()
+	{
+		return std::string();
+	}
+
+	/** Find the longest string which every text matched by a POSIX or Perl style
+	 * regex contains. Patterns with alternation, inline options or an escaped letter
+	 * or digit (which may be a character code, a class or a backreference) yield
+	 * nothing; escaped punctuation is taken literally, classes and groups end a
+	 * literal run and a quantifier drops the character before it.
+	 * @param rx The regex
+	 * @param basic True if the regex is a POSIX basic regex, in which groups and
+	 * bounds are written as \\( \\) \\{ \\} and the unescaped characters are literal
+	 * @return The literal, or an empty string if none was found
+	 */
+	static std::string ExtractLiteral(const std::string& rx, bool basic = false)
+	{
+		if ((rx.find_first_of("|\n") != std::string::npos) || (rx.find("(?") != std::string::npos))
+			return std::string();
+
+		std::string best;
+		std::string run;
+		unsigned int depth = 0;
+		for (std::string::size_type i = 0; i < rx.length(); i++)
+		{
+			unsigned char c = rx[i];
+			bool meta = (strchr("\\[]().^$*+?{}", c) != NULL);
+			if (basic)
+			{
+				// Swap the meaning of escaped and unescaped group, bound and GNU quantifier characters
+				if (strchr("(){}+?", c))
+					meta = false;
+				else if ((c == '\\') && (i + 1 < rx.length()) && (strchr("(){}+?", rx[i + 1])))
+					c = rx[++i];
+			}
+
+			if ((meta) && (c == '\\'))
+			{
+				if (i + 1 >= rx.length())
+					return std::string();
+
+				// Only escaped punctuation stands for itself, the meaning of anything else
+				// depends on the engine and may span several characters of the pattern
+				c = rx[++i];
+				if (((c >= '0') && (c <= '9')) || ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')))
+					return std::string();
+				meta = false;
+			}
+
+			if ((depth == 0) && (!meta))
+			{
+				run.push_back(c);
+				continue;
+			}
+
+			if (!meta)
+				continue;
+
+			if ((c == '*') || (c == '?') || (c == '{'))
+			{
+				// The quantified character is optional, drop it along with the rest of its UTF-8 sequence
+				while ((!run.empty()) && ((run[run.length() - 1] & 0xC0) == 0x80))
+					run.erase(run.length() - 1);
+				if (!run.empty())
+					run.erase(run.length() - 1);
+			}
+
+			if (run.length() > best.length())
+				best.swap(run);
+			run.clear();
+
+			if (c == '(')
+			{
+				depth++;
+			}
+			else if ((c == ')') && (depth))
+			{
+				depth--;
+			}
+			else if (c == '{')
+			{
+				const std::string::size_type end = rx.find(basic ? "\\}" : "}", i);
+				i = (end == std::string::npos ? end : end + (basic ? 1 : 0));
+			}
+			else if (c == '[')
+			{
+				// Skip the bracket expression, a ']' right at the start is part of it
+				i++;
+				if ((i < rx.length()) && (rx[i] == '^'))
+					i++;
+				if ((i < rx.length()) && (rx[i] == ']'))
+					i++;
+				while ((i < rx.length()) && (rx[i] != ']'))
+				{
+					if ((rx[i] == '[') && (i + 1 < rx.length()) && (strchr(":.=", rx[i + 1])))
+						i = std::min(rx.find(std::string(1, rx[i + 1]) + "]", i + 2), rx.length()) + 1;
+					else if (rx[i] == '\\')
+						i++;
+					i++;
+				}
+			}
+
+			if (i >= rx.length())
+				break;
+		}
+
+		if (run.length() > best.length())
+			best.swap(run);
+		return best;
+	}
+};
+
+/** A group of regexes which is matched against a text in one go, see RegexFactory::CreateSet() */
+class RegexSet : public classbase
+{
+ public:
+	virtual ~RegexSet() { }
+
+	/** Find the regexes which match a text
+	 * @param text The text to match
+	 * @param out Receives the positions of the matching regexes in the list the set was created from, in ascending order
+	 */
+	virtual void Match(const std::string& text, std::vector<size_t>& out) = 0;
+};
+
+/** Set which runs the regexes one after another, but only those whose literal (see
+ * Regex::GetLiteral()) occurs in the text. All literals are searched for at once with
+ * an Aho-Corasick automaton, so the text is scanned once no matter how many there are.
+ */
+class LiteralRegexSet : public RegexSet
+{
+	struct Node
+	{
+		/** Next node by folded character */
+		std::map<unsigned char, size_t> next;
+
+		/** Node of the longest proper suffix of this node which is in the automaton */
+		size_t fail;
+
+		/** Regexes whose literal ends at this node, including those of suffixes */
+		std::vector<size_t> found;
+
+		Node() : fail(0) { }
+	};
+
+	/** The regexes, owned by the creator of the set */
+	std::vector<Regex*> regexes;
+
+	/** Literals of the regexes, an empty one means the regex is always run */
+	std::vector<std::string> literals;
+
+	/** The automaton, the root is the first node */
+	std::vector<Node> nodes;
+
+	/** The case map the automaton was built with */
+	unsigned const char* map;
+
+	/** Regexes whose literal was found by the last Match() */
+	std::vector<bool> candidates;
+
+	size_t Next(size_t node, unsigned char c) const
+	{
+		for (;;)
+		{
+			std::map<unsigned char, size_t>::const_iterator it = nodes[node].next.find(c);
+			if (it != nodes[node].next.end())
+				return it->second;
+			if (node == 0)
+				return 0;
+			node = nodes[node].fail;
+		}
+	}
+
+	void Build()
+	{
+		map = national_case_insensitive_map;
+		nodes.assign(1, Node());
+		for (size_t i = 0; i < literals.size(); i++)
+		{
+			if (literals[i].empty())
+				continue;
+
+			size_t node = 0;
+			for (std::string::const_iterator c = literals[i].begin(); c != literals[i].end(); ++c)
+			{
+				const unsigned char folded = map[static_cast<unsigned char>(*c)];
+				std::map<unsigned char, size_t>::iterator it = nodes[node].next.find(folded);
+				if (it == nodes[node].next.end())
+				{
+					nodes.push_back(Node());
+					it = nodes[node].next.insert(std::make_pair(folded, nodes.size() - 1)).first;
+				}
+				node = it->second;
+			}
+			nodes[node].found.push_back(i);
+		}
+
+		// Nodes are visited in order of depth, so the fail node of a node is complete before the node
+		std::deque<size_t> queue(1, 0);
+		while (!queue.empty())
+		{
+			const size_t node = queue.front();
+			queue.pop_front();
+			for (std::map<unsigned char, size_t>::const_iterator it = nodes[node].next.begin(); it != nodes[node].next.end(); ++it)
+			{
+				Node& child = nodes[it->second];
+				child.fail = (node == 0 ? 0 : Next(nodes[node].fail, it->first));
+				const std::vector<size_t>& inherited = nodes[child.fail].found;
+				child.found.insert(child.found.end(), inherited.begin(), inherited.end());
+				queue.push_back(it->second);
+			}
+		}
+	}
+
+ public:
+	/** Create a set
+	 * @param rxs The regexes, which have to exist for as long as the set does
+	 */
+	LiteralRegexSet(const std::vector<Regex*>& rxs)
+		: regexes(rxs), candidates(rxs.size())
+	{
+		for (std::vector<Regex*>::const_iterator i = regexes.begin(); i != regexes.end(); ++i)
+			literals.push_back((*i)->GetLiteral());
+		Build();
+	}
+
+	void Match(const std::string& text, std::vector<size_t>& out) CXX11_OVERRIDE
+	{
+		// The case map can be changed by m_nationalchars
+		if (map != national_case_insensitive_map)
+			Build();
+
+		candidates.assign(regexes.size(), false);
+		size_t node = 0;
+		for (std::string::const_iterator c = text.begin(); c != text.end(); ++c)
+		{
+			node = Next(node, map[static_cast<unsigned char>(*c)]);
+			const std::vector<size_t>& found = nodes[node].found;
+			for (std::vector<size_t>::const_iterator i = found.begin(); i != found.end(); ++i)
+				candidates[*i] = true;
+		}
+
+		for (size_t i = 0; i < regexes.size(); i++)
+		{
+			if (((candidates[i]) || (literals[i].empty())) && (regexes[i]->Matches(text)))
+				out.push_back(i);
+		}
+	}
 };
 
 class RegexFactory : public DataProvider
@@ -49,6 +303,15 @@ class RegexFactory : public DataProvider
 	RegexFactory(Module* Creator, const std::string& Name) : DataProvider(Creator, Name) { }
 
 	virtual Regex* Create(const std::string& expr) = 0;
+
+	/** Create a set for matching a text against several regexes at once
+	 * @param regexes Regexes made by Create(), which have to exist for as long as the set does
+	 * @return The set, which the caller has to delete before this factory goes away
+	 */
+	virtual RegexSet* CreateSet(const std::vector<Regex*>& regexes)
+	{
+		return new LiteralRegexSet(regexes);
+	}
 };
 
 class RegexException : public ModuleException
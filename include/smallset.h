@@ -0,0 +1,216 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** Unordered container which keeps its first N elements inside the object, so
+ * instances on the stack do not allocate as long as they stay small.
+ * Lookups are a linear scan up to N elements; above that a hash index is built.
+ * Erasing moves the last element into the hole, invalidating iterators to it.
+ * Use SmallSet or SmallMap rather than this class directly.
+ */
+template <typename Elem, typename Key, typename KeyOf, size_t N>
+class SmallContainer
+{
+ public:
+	typedef Elem* iterator;
+	typedef const Elem* const_iterator;
+
+ private:
+	typedef TR1NS::unordered_map<Key, size_t> Index;
+
+	/** Storage for the first N elements */
+	Elem fixed[N];
+
+	/** Either fixed or a heap array of capacity elements */
+	Elem* elems;
+
+	/** Number of elements */
+	size_t used;
+
+	/** Number of elements elems can hold */
+	size_t capacity;
+
+	/** Position of every element by key, only exists while there are more than N elements */
+	Index* index;
+
+	size_t Position(const Key& key) const
+	{
+		if (index)
+		{
+			typename Index::const_iterator it = index->find(key);
+			return (it != index->end() ? it->second : used);
+		}
+
+		size_t pos = 0;
+		while (pos < used && !(KeyOf::Get(elems[pos]) == key))
+			pos++;
+		return pos;
+	}
+
+	void Grow()
+	{
+		capacity *= 2;
+		Elem* newelems = new Elem[capacity];
+		std::copy(elems, elems + used, newelems);
+		if (elems != fixed)
+			delete[] elems;
+		elems = newelems;
+	}
+
+ protected:
+	/** Add an element whose key is not in the container yet
+	 * @param elem Element to add
+	 * @return Iterator to the new element
+	 */
+	iterator Append(const Elem& elem)
+	{
+		if (used == capacity)
+			Grow();
+
+		elems[used] = elem;
+		if (index)
+		{
+			(*index)[KeyOf::Get(elem)] = used;
+		}
+		else if (used == N)
+		{
+			index = new Index;
+			for (size_t i = 0; i <= used; i++)
+				(*index)[KeyOf::Get(elems[i])] = i;
+		}
+		return elems + used++;
+	}
+
+ public:
+	SmallContainer() : elems(fixed), used(0), capacity(N), index(NULL) { }
+
+	SmallContainer(const SmallContainer& other) : elems(fixed), used(0), capacity(N), index(NULL)
+	{
+		for (const_iterator i = other.begin(); i != other.end(); ++i)
+			Append(*i);
+	}
+
+	SmallContainer& operator=(const SmallContainer& other)
+	{
+		if (this != &other)
+		{
+			clear();
+			for (const_iterator i = other.begin(); i != other.end(); ++i)
+				Append(*i);
+		}
+		return *this;
+	}
+
+	~SmallContainer()
+	{
+		if (elems != fixed)
+			delete[] elems;
+		delete index;
+	}
+
+	iterator begin() { return elems; }
+	iterator end() { return elems + used; }
+	const_iterator begin() const { return elems; }
+	const_iterator end() const { return elems + used; }
+
+	size_t size() const { return used; }
+	bool empty() const { return (used == 0); }
+
+	iterator find(const Key& key) { return elems + Position(key); }
+	const_iterator find(const Key& key) const { return elems + Position(key); }
+	size_t count(const Key& key) const { return (Position(key) != used ? 1 : 0); }
+
+	/** Remove the element with the given key
+	 * @param key Key of the element to remove
+	 * @return Number of elements removed, 0 or 1
+	 */
+	size_t erase(const Key& key)
+	{
+		const size_t pos = Position(key);
+		if (pos == used)
+			return 0;
+
+		used--;
+		if (index)
+			index->erase(key);
+		if (pos != used)
+		{
+			elems[pos] = elems[used];
+			if (index)
+				(*index)[KeyOf::Get(elems[pos])] = pos;
+		}
+		return 1;
+	}
+
+	/** Remove all elements, heap storage is kept for reuse */
+	void clear()
+	{
+		used = 0;
+		delete index;
+		index = NULL;
+	}
+};
+
+template <typename T>
+struct SmallSetKey
+{
+	static const T& Get(const T& elem) { return elem; }
+};
+
+/** Set with inline storage for N elements, see SmallContainer */
+template <typename T, size_t N>
+class SmallSet : public SmallContainer<T, T, SmallSetKey<T>, N>
+{
+	typedef SmallContainer<T, T, SmallSetKey<T>, N> Base;
+
+ public:
+	std::pair<typename Base::iterator, bool> insert(const T& value)
+	{
+		typename Base::iterator it = this->find(value);
+		if (it != this->end())
+			return std::make_pair(it, false);
+		return std::make_pair(this->Append(value), true);
+	}
+};
+
+template <typename K, typename V>
+struct SmallMapKey
+{
+	static const K& Get(const std::pair<K, V>& elem) { return elem.first; }
+};
+
+/** Map with inline storage for N elements, see SmallContainer */
+template <typename K, typename V, size_t N>
+class SmallMap : public SmallContainer<std::pair<K, V>, K, SmallMapKey<K, V>, N>
+{
+	typedef SmallContainer<std::pair<K, V>, K, SmallMapKey<K, V>, N> Base;
+
+ public:
+	std::pair<typename Base::iterator, bool> insert(const std::pair<K, V>& value)
+	{
+		typename Base::iterator it = this->find(value.first);
+		if (it != this->end())
+			return std::make_pair(it, false);
+		return std::make_pair(this->Append(value), true);
+	}
+
+	V& operator[](const K& key)
+	{
+		return insert(std::make_pair(key, V())).first->second;
+	}
+};
@@ -250,7 +250,7 @@ class CoreExport SocketEngine
 		/** Constructor, initializes member vars except indata and outdata because those are set to 0
 		 * in CheckFlush() the first time Update() or GetBandwidth() is called.
 		 */
-		Statistics() : lastempty(0), TotalEvents(0), ReadEvents(0), WriteEvents(0), ErrorEvents(0) { }
+		Statistics() : lastempty(0), TotalEvents(0), ReadEvents(0), WriteEvents(0), ErrorEvents(0), Dispatches(0), MaxBatch(0), BatchSize(0) { }
 
 		/** Increase the counters for bytes sent/received in this second.
 		 * @param len_in Bytes received, 0 if updating number of bytes written.
@@ -265,10 +265,29 @@ class CoreExport SocketEngine
 		 */
 		void CoreExport GetBandwidth(float& kbitpersec_in, float& kbitpersec_out, float& kbitpersec_total) const;
 
+		/** Update the counters after waiting for events once.
+		 * @param events Number of events returned by the wait, negative on error.
+		 */
+		void Dispatched(int events)
+		{
+			Dispatches++;
+			if (events <= 0)
+				return;
+			TotalEvents += events;
+			if ((unsigned long)events > MaxBatch)
+				MaxBatch = events;
+		}
+
 		unsigned long TotalEvents;
 		unsigned long ReadEvents;
 		unsigned long WriteEvents;
 		unsigned long ErrorEvents;
+		/** Number of times the socket engine waited for events */
+		unsigned long Dispatches;
+		/** Largest number of events returned by a single wait */
+		unsigned long MaxBatch;
+		/** Number of events a single wait can currently return, 0 if not limited by the socket engine */
+		unsigned long BatchSize;
 	};
 
  private:
@@ -280,9 +299,10 @@ class CoreExport SocketEngine
 	/** Current number of descriptors in the engine
 	 */
 	static size_t CurrentSetSize;
-	/** List of handlers that want a trial read/write
+	/** List of handlers that want a trial read/write. A handler is only added
+	 * when it did not already have a trial pending, so this does not need to be a set.
 	 */
-	static std::set<int> trials;
+	static std::vector<int> trials;
 
 	static int MAX_DESCRIPTORS;
 
@@ -390,8 +410,16 @@ public:
 	 */
 	static int DispatchEvents();
 
+	/** Get the number of milliseconds DispatchEvents() may wait for events.
+	 * This is the time until the start of the next second, when the once per
+	 * second housekeeping runs, or until the next timer is due if it is sooner.
+	 */
+	static int GetWaitTimeout();
+
 	/** Dispatch trial reads and writes. This causes the actual socket I/O
-	 * to happen when writes have been pre-buffered.
+	 * to happen when writes have been pre-buffered. Every socket written to
+	 * since the last call is flushed exactly once, no matter how many
+	 * writes were queued on it.
 	 */
 	static void DispatchTrialWrites();
 
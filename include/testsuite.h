@@ -31,6 +31,13 @@ class TestSuite
 	bool DoCommaSepStreamTests();
 	bool DoSpaceSepStreamTests();
 	bool DoGenerateUIDTests();
+	bool DoTimerBenchmark();
+	bool DoChannelBenchmark();
+	bool DoSmallContainerTests();
+	bool DoWildcardMaskTests();
+	bool DoCIDRTreeTests();
+	bool DoBanCacheTests();
+	bool DoRegexLiteralTests();
 };
 
 #endif
@@ -23,30 +23,37 @@
 
 class Module;
 
-/** Timer class for one-second resolution timers
+/** Timer class for one-second or millisecond resolution timers
  * Timer provides a facility which allows module
  * developers to create one-shot timers. The timer
  * can be made to trigger at any time up to a one-second
- * resolution. To use Timer, inherit a class from
+ * resolution, or a one-millisecond resolution if
+ * SetIntervalMS() is used. To use Timer, inherit a class from
  * Timer, then insert your inherited class into the
  * queue using Server::AddTimer(). The Tick() method of
  * your object (which you have to override) will be called
  * at the given time.
  */
-class CoreExport Timer
+class CoreExport Timer : public intrusive_list_node<Timer>
 {
-	/** The triggering time
+	/** The triggering time, in milliseconds since the epoch
 	 */
-	time_t trigger;
+	uint64_t trigger;
 
-	/** Number of seconds between triggers
+	/** Number of milliseconds between triggers
 	 */
-	unsigned int secs;
+	unsigned long interval;
 
 	/** True if this is a repeating timer
 	 */
 	bool repeat;
 
+	/** The slot of the timer wheel this timer is in, or NULL if it is not scheduled
+	 */
+	intrusive_list<Timer>* slot;
+
+	friend class TimerManager;
+
  public:
 	/** Default constructor, initializes the triggering time
 	 * @param secs_from_now The number of seconds from now to trigger the timer
@@ -55,9 +62,10 @@ class CoreExport Timer
 	 */
 	Timer(unsigned int secs_from_now, time_t now, bool repeating = false)
 	{
-		trigger = now + secs_from_now;
-		secs = secs_from_now;
+		trigger = (uint64_t)(now + secs_from_now) * 1000;
+		interval = secs_from_now * 1000UL;
 		repeat = repeating;
+		slot = NULL;
 	}
 
 	/** Default destructor, removes the timer from the timer manager
@@ -67,6 +75,13 @@ class CoreExport Timer
 	/** Retrieve the current triggering time
 	 */
 	time_t GetTrigger() const
+	{
+		return trigger / 1000;
+	}
+
+	/** Retrieve the current triggering time in milliseconds since the epoch
+	 */
+	uint64_t GetTriggerMS() const
 	{
 		return trigger;
 	}
@@ -77,13 +92,18 @@ class CoreExport Timer
 	 */
 	void SetTrigger(time_t nexttrigger)
 	{
-		trigger = nexttrigger;
+		trigger = (uint64_t)nexttrigger * 1000;
 	}
 
 	/** Sets the interval between two ticks.
 	 */
 	void SetInterval(time_t interval);
 
+	/** Sets the interval between two ticks in milliseconds. The timer will
+	 * next trigger the given number of milliseconds from now.
+	 */
+	void SetIntervalMS(unsigned long interval);
+
 	/** Called when the timer ticks.
 	 * You should override this method with some useful code to
 	 * handle the tick event.
@@ -104,7 +124,15 @@ class CoreExport Timer
 	 */
 	unsigned int GetInterval() const
 	{
-		return secs;
+		return interval / 1000;
+	}
+
+	/** Returns the interval (number of milliseconds between ticks)
+	 * of this timer object.
+	 */
+	unsigned long GetIntervalMS() const
+	{
+		return interval;
 	}
 
 	/** Cancels the repeat state of a repeating timer.
@@ -117,23 +145,75 @@ class CoreExport Timer
 	}
 };
 
-typedef std::multimap<time_t, Timer*> TimerMap;
-
 /** This class manages sets of Timers, and triggers them at their defined times.
  * This will ensure timers are not missed, as well as removing timers that have
  * expired and allowing the addition of new ones.
+ *
+ * Timers are kept in a hierarchical timing wheel with a resolution of one
+ * millisecond: adding and removing a timer takes constant time no matter how
+ * many timers exist, and each millisecond tick only looks at the timers which
+ * are due in it. Timers further away are kept in coarser wheels and are moved
+ * down a level whenever the finer wheel below them wraps around.
  */
 class CoreExport TimerManager
 {
-	/** A list of all pending timers
+	/** Number of bits of the expiry time used to index each wheel */
+	static const unsigned int WHEEL_BITS = 8;
+
+	/** Number of slots in each wheel */
+	static const unsigned int WHEEL_SIZE = 1 << WHEEL_BITS;
+
+	/** Number of wheels; timers up to 2^(WHEEL_BITS * WHEEL_COUNT) ms in the future are placed exactly */
+	static const unsigned int WHEEL_COUNT = 4;
+
+	typedef intrusive_list<Timer> TimerList;
+
+	/** The slots of all wheels, from finest to coarsest; slot i of wheel w is at w * WHEEL_SIZE + i
 	 */
-	TimerMap Timers;
+	TimerList slots[WHEEL_COUNT * WHEEL_SIZE];
+
+	/** Number of timers in each wheel
+	 */
+	size_t wheelcount[WHEEL_COUNT];
+
+	/** The next millisecond which has not been processed yet
+	 */
+	uint64_t next;
+
+	/** Number of scheduled timers
+	 */
+	size_t count;
+
+	/** Put a timer in the right slot for its triggering time
+	 */
+	void Schedule(Timer* t);
+
+	/** Remove a timer from the slot it is in
+	 */
+	void Unlink(Timer* t);
+
+	/** Move every timer in the current slot of a coarse wheel to the finer wheels
+	 * @return The index of the slot
+	 */
+	unsigned int Cascade(unsigned int wheel);
+
+	/** Place every timer again after the clock went back to a time before next,
+	 * so timers added since then are not held back until it catches up
+	 * @param now The current time in milliseconds since the epoch
+	 */
+	void Rebase(uint64_t now);
 
  public:
+	/** Get the current time in milliseconds since the epoch
+	 */
+	static uint64_t Now();
+
+	TimerManager();
+
 	/** Tick all pending Timers
-	 * @param TIME the current system time
+	 * @param now The current time in milliseconds since the epoch, usually Now()
 	 */
-	void TickTimers(time_t TIME);
+	void TickTimers(uint64_t now);
 
 	/** Add an Timer
 	 * @param T an Timer derived class to add
@@ -144,4 +224,15 @@ class CoreExport TimerManager
 	 * @param T an Timer derived class to remove
 	 */
 	void DelTimer(Timer* T);
+
+	/** Get the number of milliseconds which can pass before a timer may need to be ticked.
+	 * This may be earlier than the trigger time of the first timer, but is never later.
+	 * @param now The current time in milliseconds since the epoch
+	 * @param max The value to return if no timer is due sooner
+	 */
+	unsigned long GetTimeout(uint64_t now, unsigned long max) const;
+
+	/** Get the number of scheduled timers
+	 */
+	size_t GetTimerCount() const { return count; }
 };
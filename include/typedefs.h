@@ -58,6 +58,14 @@ typedef TR1NS::unordered_map<std::string, Channel*, irc::insensitive, irc::StrHa
  */
 typedef intrusive_list<LocalUser> LocalUserList;
 
+/** Tag of the list links used by UserManager::fakelag_users
+ */
+struct fakelag_list_tag { };
+
+/** A list holding local users whose input is throttled, this is the type of UserManager::fakelag_users
+ */
+typedef intrusive_list<LocalUser, fakelag_list_tag> FakeLagUserList;
+
 /** A list of failed port bindings, used for informational purposes on startup */
 typedef std::vector<std::pair<std::string, std::string> > FailedPortList;
 
@@ -77,6 +85,10 @@ typedef UserChanList::iterator UCListIter;
  */
 typedef std::vector<Membership*> IncludeChanList;
 
+/** Users whose inclusion in a neighbor list is overridden, true to include and false to exclude
+ */
+typedef std::map<User*, bool> NeighborExceptions;
+
 /** A cached text file stored with its contents as lines
  */
 typedef std::vector<std::string> file_cache;
@@ -105,7 +117,7 @@ typedef std::map<std::string, file_cache> ConfigFileCache;
 typedef TR1NS::unordered_map<std::string, Command*> Commandtable;
 
 /** Membership list of a channel */
-typedef std::map<User*, Membership*> UserMembList;
+typedef TR1NS::unordered_map<User*, Membership*> UserMembList;
 /** Iterator of UserMembList */
 typedef UserMembList::iterator UserMembIter;
 /** const Iterator of UserMembList */
@@ -33,7 +33,7 @@ class CoreExport UserManager
 
 	/** Container that maps IP addresses to clone counts
 	 */
-	typedef std::map<irc::sockets::cidr_mask, CloneCounts> CloneMap;
+	typedef CIDRTree<CloneCounts> CloneMap;
 
 	/** Sequence container in which each element is a User*
 	 */
@@ -70,6 +70,12 @@ class CoreExport UserManager
 	 */
 	LocalUserList local_users;
 
+	/** Local users who had command flood penalty or data in their sendq when their input was last
+	 * processed. Their penalty is decreased and their input is processed again every second, the
+	 * other users are not looked at until they send something.
+	 */
+	FakeLagUserList fakelag_users;
+
 	/** Oper list, a vector containing all local and remote opered users
 	 */
 	OperList all_opers;
@@ -85,10 +91,37 @@ class CoreExport UserManager
      */
 	void GarbageCollect();
 
-	/** Perform background user events such as PING checks
+	/** Decrease the penalty of the users in fakelag_users and process their input again, called once a second
 	 */
 	void DoBackgroundUserStuff();
 
+	/** Add a user to fakelag_users if it has command flood penalty or data in its sendq,
+	 * called by UserIOHandler::OnDataReady()
+	 * @param user The user to check
+	 */
+	void CheckFakeLag(LocalUser* user);
+
+	/** Complete the registration of a user, time it out or check its ping, whatever is due.
+	 * This is called by the housekeeping timer of the user, which is then scheduled again.
+	 * @param user The user to check
+	 */
+	void DoHousekeeping(LocalUser* user);
+
+	/** Set the housekeeping timer of a user to tick when the next check is due: at the ping
+	 * time of registered users, every second for users who sent NICK and USER but are held
+	 * back by a module, and at the registration timeout of other unregistered users.
+	 * @param user The user to schedule
+	 */
+	void ScheduleHousekeeping(LocalUser* user);
+
+	/** Check whether a user who sent NICK and USER can complete registration, as soon as
+	 * possible but outside of the current call stack. Modules which hold back registration
+	 * in OnCheckReady() should call this when they stop doing so; if they do not the user
+	 * is only connected on its next once a second check.
+	 * @param user The user to check
+	 */
+	void CheckReady(LocalUser* user);
+
 	/** Returns true when all modules have done pre-registration checks on a user
 	 * @param user The user to verify
 	 * @return True if all modules have finished checking this user
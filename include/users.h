@@ -211,6 +211,57 @@ struct CoreExport ConnectClass : public refcountbase
 	}
 };
 
+/** Assembles an outgoing line directly in a SendBuffer which is sized for
+ * a full line up front, so building a message does not create temporaries.
+ * Tokens added with Add() are separated by spaces. A builder makes one line;
+ * once Finish() has been called it must not be used again.
+ */
+class CoreExport MessageBuilder
+{
+	/** The buffer the line is built in */
+	reference<SendBuffer> buffer;
+
+	/** True if the next token has to be preceded by a space */
+	bool needspace;
+
+	/** Append a space if a token has been added since the prefix */
+	void Separate();
+
+ public:
+	MessageBuilder();
+
+	/** Add a preformatted prefix such as User::GetMessagePrefix(), which ends with a space
+	 * @param prefix The prefix to add
+	 */
+	MessageBuilder& Prefix(const std::string& prefix);
+
+	/** Add a ":source " prefix
+	 * @param source Name of the server or user the message comes from
+	 */
+	MessageBuilder& Source(const std::string& source);
+
+	/** Add a command, a parameter or preformatted text
+	 * @param token The text to add
+	 */
+	MessageBuilder& Add(const std::string& token);
+	MessageBuilder& Add(const char* token);
+
+	/** Add a numeric as a three digit command
+	 * @param numeric The numeric to add, must be below 1000
+	 */
+	MessageBuilder& AddNumeric(unsigned int numeric);
+
+	/** Add the last parameter, which may contain spaces
+	 * @param text The text of the parameter, without the leading ':'
+	 */
+	MessageBuilder& AddTrailing(const std::string& text);
+
+	/** Terminate the line with CR/LF, cropping it to the maximum line length if necessary
+	 * @return The finished line, ready for LocalUser::Write(const reference<SendBuffer>&)
+	 */
+	reference<SendBuffer> Finish();
+};
+
 /** Holds all information about a user
  * This class stores all information about a user connected to the irc server. Everything about a
  * connection is stored here primarily, from the user's socket ID (file descriptor) through to the
@@ -235,10 +286,18 @@ class CoreExport User : public Extensible
 	 */
 	std::string cached_fullrealhost;
 
+	/** Cached ":nick!ident@dhost " prefix of messages from this user
+	 */
+	std::string cached_prefix;
+
 	/** Set by GetIPString() to avoid constantly re-grabbing IP via sockets voodoo.
 	 */
 	std::string cachedip;
 
+	/** Incremented whenever something a ban could match on changes, see InvalidateBanCache()
+	 */
+	unsigned int bangeneration;
+
 	/** The user's mode list.
 	 * Much love to the STL for giving us an easy to use bitset, saving us RAM.
 	 * if (modes[modeid]) is set, then the mode is set.
@@ -374,11 +433,30 @@ class CoreExport User : public Extensible
 	 */
 	virtual const std::string& GetFullRealHost();
 
+	/** Returns the prefix of messages from this user
+	 * This is the full displayed host in ":nick!ident\@host " form, including the
+	 * trailing space, ready to be put in front of a command.
+	 * @return The message prefix of the user
+	 */
+	virtual const std::string& GetMessagePrefix();
+
 	/** This clears any cached results that are used for GetFullRealHost() etc.
 	 * The results of these calls are cached as generating them can be generally expensive.
 	 */
 	void InvalidateCache();
 
+	/** Discard the ban verdicts cached for this user on all channels, see Channel::IsBanned().
+	 * This is done by InvalidateCache() and whenever the user's IP, gecos, oper status or
+	 * channels change; modules providing bans which match on other state must call this
+	 * when that state changes.
+	 */
+	void InvalidateBanCache() { bangeneration++; }
+
+	/** Get the counter which is incremented by InvalidateBanCache()
+	 * @return The current ban generation of the user
+	 */
+	unsigned int GetBanGeneration() const { return bangeneration; }
+
 	/** Returns whether this user is currently away or not. If true,
 	 * further information can be found in User::awaymsg and User::awaytime
 	 * @return True if the user is away, false otherwise
@@ -488,6 +566,13 @@ class CoreExport User : public Extensible
 	 */
 	virtual void Write(const char *text, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line created by LocalUser::PrepareLine() or a MessageBuilder to this user.
+	 * Works on local users only. Unless overridden, the line is passed to Write(const std::string&)
+	 * without its CR/LF.
+	 * @param line The line to send, already terminated by CR/LF
+	 */
+	virtual void Write(const reference<SendBuffer>& line);
+
 	/** Write text to this user, appending CR/LF and prepending :server.name
 	 * Works on local users only.
 	 * @param text A std::string to send to the user
@@ -535,6 +620,12 @@ class CoreExport User : public Extensible
 	 */
 	void WriteCommonRaw(const std::string &line, bool include_self = true);
 
+	/** Write to all users that can see this user (including this user in the list if include_self is true)
+	 * @param line The line to send, already terminated by CR/LF
+	 * @param include_self Should the message be sent back to the author?
+	 */
+	void WriteCommonRaw(const reference<SendBuffer>& line, bool include_self = true);
+
 	/** Write to all users that can see this user (including this user in the list), appending CR/LF
 	 * @param text The format string for text to send to the users
 	 * @param ... POD-type format arguments
@@ -578,6 +669,14 @@ class CoreExport User : public Extensible
 	 */
 	bool ChangeDisplayedHost(const std::string& host);
 
+	/** Change the real host of a user.
+	 * ALWAYS use this function, rather than writing User::host directly,
+	 * as this triggers a module event allowing indexes of the host to be updated.
+	 * @param newhost The new real hostname to set
+	 * @param resetdisplay If true, the displayed host is set to the new real host as well
+	 */
+	void ChangeRealHost(const std::string& newhost, bool resetdisplay);
+
 	/** Change the ident (username) of a user.
 	 * ALWAYS use this function, rather than writing User::ident directly,
 	 * as this triggers module events allowing the change to be syncronized to
@@ -616,11 +715,21 @@ class CoreExport User : public Extensible
 
 class CoreExport UserIOHandler : public StreamSocket
 {
+	/** True if OnSendQDrained should be called once the sendq drains */
+	bool drainnotify;
+
  public:
 	LocalUser* const user;
-	UserIOHandler(LocalUser* me) : user(me) {}
+	UserIOHandler(LocalUser* me) : drainnotify(false), user(me) {}
 	void OnDataReady();
 	void OnError(BufferedSocketError error);
+	void DoWrite() CXX11_OVERRIDE;
+
+	/** Call the OnSendQDrained module event the next time a write leaves the
+	 * sendq below the soft sendq limit of the user's connect class. This lets
+	 * a module pause sending a large amount of data and pick up where it left off.
+	 */
+	void NotifyOnDrain() { drainnotify = true; }
 
 	/** Adds to the user's write buffer.
 	 * You may add any amount of text up to this users sendq value, if you exceed the
@@ -628,11 +737,33 @@ class CoreExport UserIOHandler : public StreamSocket
 	 * @param data The data to add to the write buffer
 	 */
 	void AddWriteBuf(const std::string &data);
+
+	/** Adds a shared buffer to the user's write buffer without copying it.
+	 * The same sendq limits as for AddWriteBuf(const std::string&) apply.
+	 * @param data The buffer to add to the write buffer
+	 */
+	void AddWriteBuf(const reference<SendBuffer>& data);
+};
+
+/** Runs UserManager::DoHousekeeping() for a local user when its next registration or ping check is due
+ */
+class CoreExport UserHousekeepingTimer : public Timer
+{
+	LocalUser* const user;
+
+ public:
+	UserHousekeepingTimer(LocalUser* me);
+	bool Tick(time_t TIME) CXX11_OVERRIDE;
+
+	/** Make the timer tick at the given time, replacing the time it was set to tick at before
+	 * @param when The time to tick at, ticks happen at the start of the second
+	 */
+	void Schedule(time_t when);
 };
 
 typedef unsigned int already_sent_t;
 
-class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public intrusive_list_node<LocalUser>
+class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public intrusive_list_node<LocalUser>, public intrusive_list_node<LocalUser, fakelag_list_tag>
 {
  public:
 	LocalUser(int fd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server);
@@ -640,6 +771,10 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 
 	UserIOHandler eh;
 
+	/** Checks registration, the registration timeout and pings of this user, see UserManager::ScheduleHousekeeping()
+	 */
+	UserHousekeepingTimer housekeeping;
+
 	/** Stats counter for bytes inbound
 	 */
 	unsigned int bytes_in;
@@ -698,6 +833,10 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	 */
 	unsigned int exempt:1;
 
+	/** True if the user is in UserManager::fakelag_users
+	 */
+	unsigned int fakelagged:1;
+
 	/** Used by PING checking code
 	 */
 	time_t nping;
@@ -707,10 +846,17 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	time_t idle_lastmsg;
 
 	/** This value contains how far into the penalty threshold the user is.
-	 * This is used either to enable fake lag or for excess flood quits
+	 * This is used either to enable fake lag or for excess flood quits.
+	 * Use AddPenalty() to increase it, so it is decreased again over time.
 	 */
 	unsigned int CommandFloodPenalty;
 
+	/** Increase the command flood penalty of the user and make sure it decays
+	 * even if the user sends nothing more
+	 * @param penalty The penalty to add
+	 */
+	void AddPenalty(unsigned int penalty);
+
 	static already_sent_t already_sent_id;
 	already_sent_t already_sent;
 
@@ -739,6 +885,18 @@ class CoreExport LocalUser : public User, public InviteBase<LocalUser>, public i
 	void Write(const std::string& text);
 	void Write(const char*, ...) CUSTOM_PRINTF(2, 3);
 
+	/** Write a line created by PrepareLine() to this user.
+	 * The buffer is queued as-is, so the same line can be sent to any number of users without being copied.
+	 * @param line The line to send, already terminated by CR/LF
+	 */
+	void Write(const reference<SendBuffer>& line) CXX11_OVERRIDE;
+
+	/** Prepare a line to be sent to one or more local users with Write(const reference<SendBuffer>&).
+	 * @param text The line to send, without CR/LF. It is cropped to the maximum line length if necessary.
+	 * @return A new buffer holding the line terminated by CR/LF
+	 */
+	static reference<SendBuffer> PrepareLine(const std::string& text);
+
 	/** Returns the list of channels this user has been invited to but has not yet joined.
 	 * @return A list of channels the user is invited to
 	 */
@@ -799,6 +957,11 @@ class CoreExport RemoteUser : public User
 
 class CoreExport FakeUser : public User
 {
+	/** Message prefix returned by GetMessagePrefix(), rebuilt when the name
+	 * shown for the server changes on rehash
+	 */
+	std::string messageprefix;
+
  public:
 	FakeUser(const std::string& uid, Server* srv) : User(uid, srv, USERTYPE_SERVER)
 	{
@@ -815,6 +978,7 @@ class CoreExport FakeUser : public User
 	virtual void SendText(const std::string& line);
 	virtual const std::string& GetFullHost();
 	virtual const std::string& GetFullRealHost();
+	virtual const std::string& GetMessagePrefix();
 };
 
 /* Faster than dynamic_cast */
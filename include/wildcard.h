@@ -0,0 +1,106 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+/** A glob mask prepared for being matched against many strings.
+ * Gives the same results as InspIRCd::Match() (or InspIRCd::MatchCIDR() if
+ * created with cidr set) for strings without NUL bytes, but the mask is case
+ * folded and split at its '*' characters only once. Strings shorter than the literal parts of the mask are
+ * rejected by their length, the first and last part are compared in place and
+ * the parts in between are searched with memchr() on their first literal byte.
+ */
+class CoreExport WildcardMask
+{
+	/** A run of the mask between two '*' characters */
+	struct Segment
+	{
+		/** Position of the segment in the mask */
+		size_t pos;
+
+		/** Length of the segment */
+		size_t length;
+
+		/** Offset of the first character in the segment that is not a '?', or length if there is none */
+		size_t literal;
+
+		/** True if the segment contains a '?' */
+		bool wild;
+
+		/** The bytes which fold to the first literal character, if there are at most two */
+		unsigned char first[2];
+
+		/** Number of valid bytes in first, 0 if there are more than two */
+		unsigned char firstcount;
+	};
+
+	/** The mask as given */
+	std::string mask;
+
+	/** The mask with every character passed through the case map */
+	mutable std::string folded;
+
+	/** The map given to the constructor, NULL for the national case map */
+	unsigned const char* requestedmap;
+
+	/** The map the mask was folded with; differs from the national case map if that changed since */
+	mutable unsigned const char* map;
+
+	/** Segments of the mask in order */
+	mutable std::vector<Segment> segments;
+
+	/** Total length of the segments, no string shorter than this can match */
+	size_t minlength;
+
+	/** True if the mask does not start or end with a '*' */
+	bool anchorstart;
+	bool anchorend;
+
+	/** True if the mask has to be tried as a CIDR range before being matched as a glob */
+	bool trycidr;
+
+	/** Fold the mask with the current map and find the first literal bytes of the segments */
+	void Fold() const;
+
+	/** Check whether a segment matches a string at the given position */
+	bool SegmentMatches(const Segment& seg, const unsigned char* str) const;
+
+	/** Find the first position at or after pos where a segment matches
+	 * @return The position or std::string::npos
+	 */
+	size_t FindSegment(const Segment& seg, const unsigned char* str, size_t pos, size_t len) const;
+
+ public:
+	/** Create a mask which matches nothing but the empty string */
+	WildcardMask();
+
+	/** Prepare a mask
+	 * @param mask The glob pattern
+	 * @param map The case map to use, NULL for the national case map
+	 * @param cidr True to also match the mask as a CIDR range like InspIRCd::MatchCIDR()
+	 */
+	WildcardMask(const std::string& mask, unsigned const char* map = NULL, bool cidr = false);
+
+	/** Match a string against the mask
+	 * @param str The string to match
+	 * @return True if the string matches
+	 */
+	bool Match(const std::string& str) const;
+
+	/** Get the mask this object was created from */
+	const std::string& GetMask() const { return mask; }
+};
@@ -159,6 +159,7 @@ class CoreExport KLine : public XLine
 	 */
 	KLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "K"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map, true)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -188,6 +189,11 @@ class CoreExport KLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	WildcardMask identmatch;
+	WildcardMask hostmatch;
 };
 
 /** GLine class
@@ -205,6 +211,7 @@ class CoreExport GLine : public XLine
 	 */
 	GLine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "G"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map, true)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -232,6 +239,11 @@ class CoreExport GLine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	WildcardMask identmatch;
+	WildcardMask hostmatch;
 };
 
 /** ELine class
@@ -249,6 +261,7 @@ class CoreExport ELine : public XLine
 	 */
 	ELine(time_t s_time, long d, std::string src, std::string re, std::string ident, std::string host)
 		: XLine(s_time, d, src, re, "E"), identmask(ident), hostmask(host)
+		, identmatch(ident, ascii_case_insensitive_map), hostmatch(host, ascii_case_insensitive_map, true)
 	{
 		matchtext = this->identmask;
 		matchtext.append("@").append(this->hostmask);
@@ -276,6 +289,11 @@ class CoreExport ELine : public XLine
 	std::string hostmask;
 
 	std::string matchtext;
+
+	/** Compiled forms of identmask and hostmask
+	 */
+	WildcardMask identmatch;
+	WildcardMask hostmatch;
 };
 
 /** ZLine class
@@ -291,7 +309,7 @@ class CoreExport ZLine : public XLine
 	 * @param ip IP to match
 	 */
 	ZLine(time_t s_time, long d, std::string src, std::string re, std::string ip)
-		: XLine(s_time, d, src, re, "Z"), ipaddr(ip)
+		: XLine(s_time, d, src, re, "Z"), ipaddr(ip), ipmatch(ip, NULL, true)
 	{
 	}
 
@@ -312,6 +330,10 @@ class CoreExport ZLine : public XLine
 	/** IP mask (no ident part)
 	 */
 	std::string ipaddr;
+
+	/** Compiled form of ipaddr
+	 */
+	WildcardMask ipmatch;
 };
 
 /** QLine class
@@ -327,7 +349,7 @@ class CoreExport QLine : public XLine
 	 * @param nickname Nickname to match
 	 */
 	QLine(time_t s_time, long d, std::string src, std::string re, std::string nickname)
-		: XLine(s_time, d, src, re, "Q"), nick(nickname)
+		: XLine(s_time, d, src, re, "Q"), nick(nickname), nickmatch(nickname)
 	{
 	}
 
@@ -347,6 +369,10 @@ class CoreExport QLine : public XLine
 	/** Nickname mask
 	 */
 	std::string nick;
+
+	/** Compiled form of nick
+	 */
+	WildcardMask nickmatch;
 };
 
 /** XLineFactory is used to generate an XLine pointer, given just the
@@ -395,6 +421,8 @@ class CoreExport XLineFactory
  * or any other line created by a module. It also manages XLineFactory classes which
  * can generate a specialized XLine for use by another module.
  */
+class XLineIndex;
+
 class CoreExport XLineManager
 {
  protected:
@@ -413,6 +441,24 @@ class CoreExport XLineManager
 	 */
 	XLineContainer lookup_lines;
 
+	/** Indexes of the lines of the built in types by type, used to find
+	 * the lines a user may match without checking every line
+	 */
+	std::map<std::string, XLineIndex*> indexes;
+
+	/** Lines which have a duration, ordered by the time they expire
+	 */
+	std::multimap<time_t, XLine*> expiry_queue;
+
+	/** Get the index of a line type, creating it if needed
+	 * @return The index or NULL if lines of the type are not indexed
+	 */
+	XLineIndex* GetIndex(const std::string& type);
+
+	/** Remove a line from the index of its type and from the expiry queue
+	 */
+	void Unindex(XLine* line);
+
  public:
 
 	/** Constructor
@@ -509,6 +555,11 @@ class CoreExport XLineManager
 	 */
 	void ExpireLine(ContainerIter container, LookupIter item);
 
+	/** Expire all lines whose time has passed.
+	 * This is done once a second and before lines are looked up.
+	 */
+	void ExpireLines();
+
 	/** Apply any new lines that are pending to be applied.
 	 * This will only apply lines in the pending_lines list, to save on
 	 * CPU time.
@@ -21,38 +21,33 @@
 #include "inspircd.h"
 #include "bancache.h"
 
-BanCacheHit *BanCacheManager::AddHit(const std::string &ip, const std::string &type, const std::string &reason, time_t seconds)
+BanCacheHit *BanCacheManager::AddHit(const irc::sockets::sockaddrs& ip, const std::string &type, const std::string &reason, time_t seconds)
 {
-	BanCacheHit*& b = (*BanHash)[ip];
-	if (b != NULL) // can't have two cache entries on the same IP, sorry..
+	BanCacheHit** b = BanTree.Insert(irc::sockets::cidr_mask(ip, 128));
+	if (b == NULL || *b != NULL) // can't have two cache entries on the same IP, sorry..
 		return NULL;
 
-	b = new BanCacheHit(type, reason, (seconds ? seconds : 86400));
-	return b;
+	*b = new BanCacheHit(type, reason, (seconds ? seconds : 86400));
+	return *b;
 }
 
-BanCacheHit *BanCacheManager::GetHit(const std::string &ip)
+BanCacheHit *BanCacheManager::GetHit(const irc::sockets::sockaddrs& ip)
 {
-	BanCacheHash::iterator i = this->BanHash->find(ip);
+	const irc::sockets::cidr_mask mask(ip, 128);
+	BanCacheHit** b = BanTree.Find(mask);
 
-	if (i == this->BanHash->end())
+	if (b == NULL)
 		return NULL; // free and safe
 
-	if (RemoveIfExpired(i))
+	if (ServerInstance->Time() >= (*b)->Expiry)
+	{
+		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + mask.str() + " is out of date, removing!");
+		delete *b;
+		BanTree.Erase(mask);
 		return NULL; // expired
+	}
 
-	return i->second; // hit.
-}
-
-bool BanCacheManager::RemoveIfExpired(BanCacheHash::iterator& it)
-{
-	if (ServerInstance->Time() < it->second->Expiry)
-		return false;
-
-	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "Hit on " + it->first + " is out of date, removing!");
-	delete it->second;
-	it = BanHash->erase(it);
-	return true;
+	return *b; // hit.
 }
 
 void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
@@ -62,15 +57,19 @@ void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 	else
 		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing all negative hits");
 
-	for (BanCacheHash::iterator i = BanHash->begin(); i != BanHash->end(); )
+	// The tree can't be changed while iterating it, so collect the entries first
+	std::vector<irc::sockets::cidr_mask> removed;
+	for (BanCacheTree::const_iterator i = BanTree.begin(); i != BanTree.end(); ++i)
 	{
-		if (RemoveIfExpired(i))
-			continue; // updates the iterator if expired
-
 		BanCacheHit* b = i->second;
 		bool remove = false;
 
-		if (positive)
+		if (ServerInstance->Time() >= b->Expiry)
+		{
+			// expired hits are removed regardless of their type
+			remove = true;
+		}
+		else if (positive)
 		{
 			// when removing positive hits, remove only if the type matches
 			remove = b->IsPositive() && (b->Type == type);
@@ -84,18 +83,18 @@ void BanCacheManager::RemoveEntries(const std::string& type, bool positive)
 		if (remove)
 		{
 			/* we need to remove this one. */
-			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first);
+			ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCacheManager::RemoveEntries(): Removing a hit on " + i->first.str());
 			delete b;
-			i = BanHash->erase(i);
+			removed.push_back(i->first);
 		}
-		else
-			++i;
 	}
+
+	for (std::vector<irc::sockets::cidr_mask>::const_iterator i = removed.begin(); i != removed.end(); ++i)
+		BanTree.Erase(*i);
 }
 
 BanCacheManager::~BanCacheManager()
 {
-	for (BanCacheHash::iterator n = BanHash->begin(); n != BanHash->end(); ++n)
+	for (BanCacheTree::const_iterator n = BanTree.begin(); n != BanTree.end(); ++n)
 		delete n->second;
-	delete BanHash;
 }
@@ -40,7 +40,7 @@ namespace
 }
 
 Channel::Channel(const std::string &cname, time_t ts)
-	: name(cname), age(ts), topicset(0)
+	: bangeneration(0), name(cname), age(ts), topicset(0)
 {
 	if (!ServerInstance->chanlist.insert(std::make_pair(cname, this)).second)
 		throw CoreException("Cannot create duplicate channel " + cname);
@@ -68,6 +68,14 @@ Membership* Channel::AddUser(User* user)
 		return NULL;
 
 	memb = new Membership(user, this);
+	// Bans can match on the channels a user is on
+	user->InvalidateBanCache();
+	LocalUser* const localuser = IS_LOCAL(user);
+	if (localuser)
+	{
+		memb->localpos = localmembers.size();
+		localmembers.push_back(LocalMember(localuser, memb));
+	}
 	return memb;
 }
 
@@ -103,6 +111,15 @@ void Channel::CheckDestroy()
 void Channel::DelUser(const UserMembIter& membiter)
 {
 	Membership* memb = membiter->second;
+	if (IS_LOCAL(memb->user))
+	{
+		// Move the last local member into the hole to keep the array dense
+		LocalMember& slot = localmembers[memb->localpos];
+		slot = localmembers.back();
+		slot.memb->localpos = memb->localpos;
+		localmembers.pop_back();
+	}
+	memb->user->InvalidateBanCache();
 	memb->cull();
 	delete memb;
 	userlist.erase(membiter);
@@ -352,25 +369,74 @@ void Channel::ForceJoin(User* user, const std::string* privs, bool bursting, boo
 	FOREACH_MOD(OnPostJoin, (memb));
 }
 
-bool Channel::IsBanned(User* user)
+Membership* Channel::GetBanCache(User* user)
 {
-	ModResult result;
-	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
+	UserMembIter it = userlist.find(user);
+	if (it == userlist.end())
+		return NULL;
 
-	if (result != MOD_RES_PASSTHRU)
-		return (result == MOD_RES_DENY);
+	Membership* memb = it->second;
+	if ((memb->banchangen != bangeneration) || (memb->banusergen != user->GetBanGeneration()))
+	{
+		memb->banchangen = bangeneration;
+		memb->banusergen = user->GetBanGeneration();
+		memb->banned = -1;
+		memb->banlistmatch = -1;
+	}
+	return memb;
+}
+
+void Channel::InvalidateAllBanCaches()
+{
+	const chan_hash& chans = ServerInstance->GetChans();
+	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+		i->second->InvalidateBanCache();
+}
 
+bool Channel::MatchBanList(User* user, Membership* memb)
+{
+	if ((memb) && (memb->banlistmatch != -1))
+		return (memb->banlistmatch != 0);
+
+	bool matched = false;
 	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
 	const ListModeBase::ModeList* bans = banlm->GetList(this);
 	if (bans)
 	{
 		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); it++)
 		{
-			if (CheckBan(user, it->mask))
-				return true;
+			if (CheckBan(user, it->GetBanMask()))
+			{
+				matched = true;
+				break;
+			}
 		}
 	}
-	return false;
+
+	if (memb)
+		memb->banlistmatch = matched;
+	return matched;
+}
+
+bool Channel::IsBanned(User* user)
+{
+	// Joining users have no membership yet so they are always checked in full
+	Membership* memb = GetBanCache(user);
+	if ((memb) && (memb->banned != -1))
+		return (memb->banned != 0);
+
+	bool banned;
+	ModResult result;
+	FIRST_MOD_RESULT(OnCheckChannelBan, result, (user, this));
+
+	if (result != MOD_RES_PASSTHRU)
+		banned = (result == MOD_RES_DENY);
+	else
+		banned = MatchBanList(user, memb);
+
+	if (memb)
+		memb->banned = banned;
+	return banned;
 }
 
 bool Channel::CheckBan(User* user, const std::string& mask)
@@ -401,6 +467,65 @@ bool Channel::CheckBan(User* user, const std::string& mask)
 	return false;
 }
 
+BanMask::BanMask(const std::string& Mask)
+	: mask(Mask)
+	, valid(false)
+	, split(false)
+	, cidr(false)
+{
+	// Extbans and masks without an '@' are left to modules, as in Channel::CheckBan(User*, const std::string&)
+	if ((mask.length() <= 2) || (mask[1] == ':'))
+		return;
+
+	std::string::size_type at = mask.find('@');
+	if (at == std::string::npos)
+		return;
+
+	valid = true;
+
+	// Nicks and idents never contain a '!' so a mask with a single one has to match there
+	std::string::size_type pling = mask.find('!');
+	split = ((pling < at) && (mask.find('!', pling + 1) > at));
+	if (split)
+	{
+		nick = WildcardMask(mask.substr(0, pling));
+		ident = WildcardMask(mask.substr(pling + 1, at - pling - 1));
+	}
+	else
+	{
+		nickident = WildcardMask(mask.substr(0, at));
+	}
+
+	host = WildcardMask(mask.substr(at + 1));
+	// irc::sockets::MatchCIDR() never matches a mask without a '/'
+	cidr = (mask.find('/', at + 1) != std::string::npos);
+}
+
+bool Channel::CheckBan(User* user, const BanMask& banmask)
+{
+	ModResult result;
+	FIRST_MOD_RESULT(OnCheckBan, result, (user, this, banmask.mask));
+	if (result != MOD_RES_PASSTHRU)
+		return (result == MOD_RES_DENY);
+
+	if (!banmask.valid)
+		return false;
+
+	if (banmask.split)
+	{
+		if ((!banmask.nick.Match(user->nick)) || (!banmask.ident.Match(user->ident)))
+			return false;
+	}
+	else if (!banmask.nickident.Match(user->nick + "!" + user->ident))
+		return false;
+
+	if (banmask.host.Match(user->host) || banmask.host.Match(user->dhost))
+		return true;
+
+	const std::string& ip = user->GetIPString();
+	return ((banmask.cidr && irc::sockets::MatchCIDR(ip, banmask.host.GetMask(), false)) || banmask.host.Match(ip));
+}
+
 ModResult Channel::GetExtBanStatus(User *user, char type)
 {
 	ModResult rv;
@@ -408,16 +533,8 @@ ModResult Channel::GetExtBanStatus(User *user, char type)
 	if (rv != MOD_RES_PASSTHRU)
 		return rv;
 
-	ListModeBase* banlm = static_cast<ListModeBase*>(*ban);
-	const ListModeBase::ModeList* bans = banlm->GetList(this);
-	if (bans)
-	{
-		for (ListModeBase::ModeList::const_iterator it = bans->begin(); it != bans->end(); ++it)
-		{
-			if (CheckBan(user, it->mask))
-				return MOD_RES_DENY;
-		}
-	}
+	if (MatchBanList(user, GetBanCache(user)))
+		return MOD_RES_DENY;
 	return MOD_RES_PASSTHRU;
 }
 
@@ -505,13 +622,12 @@ void Channel::WriteChannel(User* user, const char* text, ...)
 
 void Channel::WriteChannel(User* user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
+	MessageBuilder msg;
+	msg.Prefix(user->GetMessagePrefix()).Add(text);
+	const reference<SendBuffer> message = msg.Finish();
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	for (LocalMemberList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+		i->user->Write(message);
 }
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const char* text, ...)
@@ -523,13 +639,12 @@ void Channel::WriteChannelWithServ(const std::string& ServName, const char* text
 
 void Channel::WriteChannelWithServ(const std::string& ServName, const std::string &text)
 {
-	const std::string message = ":" + (ServName.empty() ? ServerInstance->Config->ServerName : ServName) + " " + text;
+	MessageBuilder msg;
+	msg.Source(ServName.empty() ? ServerInstance->Config->ServerName : ServName).Add(text);
+	const reference<SendBuffer> message = msg.Finish();
 
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
-	{
-		if (IS_LOCAL(i->first))
-			i->first->Write(message);
-	}
+	for (LocalMemberList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+		i->user->Write(message);
 }
 
 /* write formatted text from a source user to all users on a channel except
@@ -545,43 +660,75 @@ void Channel::WriteAllExcept(User* user, bool serversource, char status, CUList
 {
 	std::string textbuffer;
 	VAFORMAT(textbuffer, text, text);
-	textbuffer = ":" + (serversource ? ServerInstance->Config->ServerName : user->GetFullHost()) + " " + textbuffer;
-	this->RawWriteAllExcept(user, serversource, status, except_list, textbuffer);
+	this->WriteAllExcept(user, serversource, status, except_list, textbuffer);
 }
 
 void Channel::WriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string &text)
 {
-	const std::string message = ":" + (serversource ? ServerInstance->Config->ServerName : user->GetFullHost()) + " " + text;
-	this->RawWriteAllExcept(user, serversource, status, except_list, message);
+	MessageBuilder msg;
+	if (serversource)
+		msg.Source(ServerInstance->Config->ServerName);
+	else
+		msg.Prefix(user->GetMessagePrefix());
+	msg.Add(text);
+	this->RawWriteAllExcept(user, serversource, status, except_list, msg.Finish());
 }
 
 void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const std::string &out)
 {
-	unsigned int minrank = 0;
-	if (status)
+	this->RawWriteAllExcept(user, serversource, status, except_list, LocalUser::PrepareLine(out));
+}
+
+namespace
+{
+	/** Get the rank a member needs to see a message sent to a status prefix
+	 * @param status The status prefix, or 0 if the message goes to everyone
+	 * @return The minimum rank, 0 if every member sees the message
+	 */
+	unsigned int GetMinRank(char status)
 	{
+		if (!status)
+			return 0;
 		PrefixMode* mh = ServerInstance->Modes->FindPrefix(status);
-		if (mh)
-			minrank = mh->GetPrefixRank();
+		return (mh ? mh->GetPrefixRank() : 0);
 	}
-	for (UserMembIter i = userlist.begin(); i != userlist.end(); i++)
+}
+
+void Channel::RawWriteAllExcept(User* user, bool serversource, char status, CUList &except_list, const reference<SendBuffer>& message)
+{
+	const unsigned int minrank = GetMinRank(status);
+	for (LocalMemberList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
 	{
-		if (IS_LOCAL(i->first) && (except_list.find(i->first) == except_list.end()))
+		LocalUser* u = i->user;
+		if (except_list.find(u) == except_list.end())
 		{
 			/* User doesn't have the status we're after */
-			if (minrank && i->second->getRank() < minrank)
+			if (minrank && i->memb->getRank() < minrank)
 				continue;
 
-			i->first->Write(out);
+			u->Write(message);
 		}
 	}
 }
 
 void Channel::WriteAllExceptSender(User* user, bool serversource, char status, const std::string& text)
 {
-	CUList except_list;
-	except_list.insert(user);
-	this->WriteAllExcept(user, serversource, status, except_list, std::string(text));
+	MessageBuilder msg;
+	if (serversource)
+		msg.Source(ServerInstance->Config->ServerName);
+	else
+		msg.Prefix(user->GetMessagePrefix());
+	msg.Add(text);
+	const reference<SendBuffer> message = msg.Finish();
+
+	// Skip the sender here instead of building a CUList just to hold it
+	const unsigned int minrank = GetMinRank(status);
+	for (LocalMemberList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+	{
+		LocalUser* u = i->user;
+		if ((u != user) && ((!minrank) || (i->memb->getRank() >= minrank)))
+			u->Write(message);
+	}
 }
 
 const char* Channel::ChanModes(bool showkey)
@@ -739,6 +886,8 @@ unsigned int Channel::GetPrefixValue(User* user)
 
 bool Membership::SetPrefix(PrefixMode* delta_mh, bool adding)
 {
+	// Bans can match on the status of the user on other channels
+	user->InvalidateBanCache();
 	char prefix = delta_mh->GetModeChar();
 	for (unsigned int i = 0; i < modes.length(); i++)
 	{
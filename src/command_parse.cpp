@@ -186,7 +186,7 @@ void CommandParser::ProcessCommand(LocalUser *user, std::string &cmd)
 	if (!user->HasPrivPermission("users/flood/no-throttle"))
 	{
 		// If it *doesn't* exist, give it a slightly heftier penalty than normal to deter flooding us crap
-		user->CommandFloodPenalty += handler ? handler->Penalty * 1000 : 2000;
+		user->AddPenalty(handler ? handler->Penalty * 1000 : 2000);
 	}
 
 	if (!handler)
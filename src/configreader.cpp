@@ -31,11 +31,12 @@
 
 ServerConfig::ServerConfig()
 {
-	RawLog = HideBans = HideSplits = UndernetMsgPrefix = false;
+	RawLog = HideBans = HideSplits = UndernetMsgPrefix = HookProfiling = false;
 	WildcardIPv6 = InvBypassModes = true;
 	dns_timeout = 5;
 	MaxTargets = 20;
 	NetBufferSize = 10240;
+	WriteBufferSize = 4096;
 	SoftLimit = SocketEngine::GetMaxFds();
 	MaxConn = SOMAXCONN;
 	MaxChans = 20;
@@ -368,11 +369,13 @@ void ServerConfig::Fill()
 	}
 	SoftLimit = ConfValue("performance")->getInt("softlimit", SocketEngine::GetMaxFds(), 10, SocketEngine::GetMaxFds());
 	CCOnConnect = ConfValue("performance")->getBool("clonesonconnect", true);
+	HookProfiling = ConfValue("performance")->getBool("hookprofiling");
 	MaxConn = ConfValue("performance")->getInt("somaxconn", SOMAXCONN);
 	XLineMessage = options->getString("xlinemessage", options->getString("moronbanner", "You're banned!"));
 	ServerDesc = ConfValue("server")->getString("description", "Configure Me");
 	Network = ConfValue("server")->getString("network", "Network");
 	NetBufferSize = ConfValue("performance")->getInt("netbuffersize", 10240, 1024, 65534);
+	WriteBufferSize = ConfValue("performance")->getInt("writebuffersize", 4096, 0, 65536);
 	dns_timeout = ConfValue("dns")->getInt("timeout", 5);
 	DisabledCommands = ConfValue("disabled")->getString("commands", "");
 	DisabledDontExist = ConfValue("disabled")->getBool("fakenonexistant");
@@ -785,6 +788,8 @@ void ConfigReaderThread::Finish()
 		for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
 			i->second->ReadConfig(status);
 
+		// Bans provided by modules can depend on their configuration
+		Channel::InvalidateAllBanCaches();
 		ServerInstance->ISupport.Build();
 
 		ServerInstance->Logs->CloseLogs();
@@ -142,9 +142,13 @@ class Packet : public Query
 		record.ttl = (input[pos] << 24) | (input[pos + 1] << 16) | (input[pos + 2] << 8) | input[pos + 3];
 		pos += 4;
 
-		//record.rdlength = input[pos] << 8 | input[pos + 1];
+		const unsigned short rdlength = input[pos] << 8 | input[pos + 1];
 		pos += 2;
 
+		const unsigned short rdstart = pos;
+		if (rdstart + rdlength > input_size)
+			throw Exception("Unable to unpack resource record");
+
 		switch (record.type)
 		{
 			case QUERY_A:
@@ -185,10 +189,26 @@ class Packet : public Query
 				record.rdata = this->UnpackName(input, input_size, pos);
 				break;
 			}
+			case QUERY_SOA:
+			{
+				// Skip the primary nameserver and the mailbox, only the MINIMUM field at the end is used
+				this->UnpackName(input, input_size, pos);
+				this->UnpackName(input, input_size, pos);
+				if (pos + 20 > input_size)
+					throw Exception("Unable to unpack resource record");
+
+				/* RFC 2308 section 5: negative answers are cached for the smaller of the SOA TTL and MINIMUM */
+				const unsigned int minimum = (input[pos + 16] << 24) | (input[pos + 17] << 16) | (input[pos + 18] << 8) | input[pos + 19];
+				record.ttl = std::min(record.ttl, minimum);
+				break;
+			}
 			default:
 				break;
 		}
 
+		// Records of types that are not handled above are skipped
+		pos = rdstart + rdlength;
+
 		if (!record.name.empty() && !record.rdata.empty())
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: " + record.name + " -> " + record.rdata);
 
@@ -204,8 +224,10 @@ class Packet : public Query
 	unsigned short id;
 	/* Flags on the packet */
 	unsigned short flags;
+	/* How long a negative answer may be cached for, from the SOA record in the authority section, or 0 if there was none */
+	unsigned int negative_ttl;
 
-	Packet() : id(0), flags(0)
+	Packet() : id(0), flags(0), negative_ttl(0)
 	{
 	}
 
@@ -244,6 +266,21 @@ class Packet : public Query
 
 		for (unsigned i = 0; i < ancount; ++i)
 			this->answers.push_back(this->UnpackResourceRecord(input, len, packet_pos));
+
+		// The authority section is only needed for caching negative answers, don't fail the packet if it's broken
+		try
+		{
+			for (unsigned i = 0; i < nscount; ++i)
+			{
+				ResourceRecord record = this->UnpackResourceRecord(input, len, packet_pos);
+				if (record.type == QUERY_SOA)
+					this->negative_ttl = record.ttl;
+			}
+		}
+		catch (Exception& ex)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Ignoring authority section: " + ex.GetReason());
+		}
 	}
 
 	unsigned short Pack(unsigned char* output, unsigned short output_size)
@@ -394,19 +431,148 @@ class Packet : public Query
 	}
 };
 
-class MyManager : public Manager, public Timer, public EventHandler
+class MyManager;
+
+/** A nameserver and the UDP socket used to talk to it
+ */
+class Upstream : public EventHandler
 {
-	typedef TR1NS::unordered_map<Question, Query, Question::hash> cache_map;
-	cache_map cache;
+	MyManager* const manager;
+
+ public:
+	/** The address of the nameserver */
+	irc::sockets::sockaddrs addr;
 
-	irc::sockets::sockaddrs myserver;
+	/** Number of queries sent to, answered by and timed out on this nameserver */
+	unsigned long sent;
+	unsigned long answered;
+	unsigned long timeouts;
 
-	static bool IsExpired(const Query& record, time_t now = ServerInstance->Time())
+	/** Number of queries that timed out since the last answer */
+	unsigned int failures;
+
+	/** Time until which other nameservers are preferred because this one stopped answering */
+	time_t downuntil;
+
+	Upstream(MyManager* mgr, const irc::sockets::sockaddrs& sa)
+		: manager(mgr), addr(sa), sent(0), answered(0), timeouts(0), failures(0), downuntil(0)
 	{
-		const ResourceRecord& req = record.answers[0];
-		return (req.created + static_cast<time_t>(req.ttl) < now);
+		int s = socket(addr.sa.sa_family, SOCK_DGRAM, 0);
+		this->SetFd(s);
+
+		/* Have we got a socket? */
+		if (this->GetFd() == -1)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket for " + addr.str());
+			return;
+		}
+
+		SocketEngine::SetReuse(s);
+		SocketEngine::NonBlocking(s);
+
+		irc::sockets::sockaddrs bindto;
+		memset(&bindto, 0, sizeof(bindto));
+		bindto.sa.sa_family = addr.sa.sa_family;
+
+		if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
+		{
+			/* Failed to bind */
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding DNS socket for " + addr.str());
+			SocketEngine::Close(this->GetFd());
+			this->SetFd(-1);
+		}
+		else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS socket for " + addr.str());
+			SocketEngine::Close(this->GetFd());
+			this->SetFd(-1);
+		}
 	}
 
+	void HandleEvent(EventType et, int);
+};
+
+/** A question which was sent to the nameservers, shared by all requests that asked it until the answer arrives
+ */
+struct PendingQuery
+{
+	/** The question as sent, PTR questions are in their reverse form */
+	Question question;
+
+	/** Id of the query */
+	unsigned short id;
+
+	/** The packed query, sent again as is when retrying */
+	std::string packet;
+
+	/** Requests waiting for the answer */
+	std::vector<DNS::Request*> waiters;
+
+	/** Nameserver the query was last sent to, NULL if it went away on rehash */
+	Upstream* upstream;
+
+	/** Number of times the query was sent */
+	unsigned int tries;
+
+	/** Time the query was last sent at */
+	time_t lastsent;
+
+	/** Time the query was first sent at, for measuring latency */
+	time_t started;
+	long started_ns;
+
+	PendingQuery(const Question& q, unsigned short i)
+		: question(q), id(i), upstream(NULL), tries(0), lastsent(0)
+		, started(ServerInstance->Time()), started_ns(ServerInstance->Time_ns())
+	{
+	}
+};
+
+class MyManager : public Manager, public Timer
+{
+	/** A cached answer, positive or negative */
+	struct CacheEntry
+	{
+		Question question;
+		Query query;
+		time_t expires;
+
+		CacheEntry(const Question& q, const Query& r, time_t exp) : question(q), query(r), expires(exp) { }
+	};
+
+	/** Cached answers, the most recently used one first */
+	typedef std::list<CacheEntry> lru_list;
+	typedef TR1NS::unordered_map<Question, lru_list::iterator, Question::hash> cache_map;
+	lru_list lru;
+	cache_map cache;
+
+	/** Maximum number of cached answers */
+	size_t cachesize;
+
+	/** Queries waiting for an answer by question, used to send identical questions only once */
+	typedef TR1NS::unordered_map<Question, PendingQuery*, Question::hash> inflight_map;
+	inflight_map inflight;
+
+	/** Queries waiting for an answer by id */
+	PendingQuery* pending[MAX_REQUEST_ID];
+
+	/** Ids not used by a pending query, taken from at random */
+	std::vector<unsigned short> freeids;
+
+	/** The nameservers, used in turn */
+	std::vector<Upstream*> upstreams;
+	size_t nextupstream;
+
+	/** Time the cache was last purged of expired answers */
+	time_t lastpurge;
+
+	/** Number of failed queries after which a nameserver is skipped, and for how long */
+	static const unsigned int MAX_FAILURES = 3;
+	static const time_t DOWN_TIME = 30;
+
+	/** RFC 2308 section 5 suggests not caching negative answers for longer than a few hours */
+	static const unsigned int MAX_NEGATIVE_TTL = 10800;
+
 	/** Check the DNS cache to see if request can be handled by a cached result
 	 * @return true if a cached result was found.
 	 */
@@ -416,94 +582,245 @@ class MyManager : public Manager, public Timer, public EventHandler
 
 		cache_map::iterator it = this->cache.find(question);
 		if (it == this->cache.end())
+		{
+			this->cachemisses++;
 			return false;
+		}
 
-		Query& record = it->second;
-		if (IsExpired(record))
+		lru_list::iterator entry = it->second;
+		if (entry->expires < ServerInstance->Time())
 		{
+			this->lru.erase(entry);
 			this->cache.erase(it);
+			this->cachemisses++;
 			return false;
 		}
 
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
+		// Move the entry to the front so it's the last one to be evicted
+		this->lru.splice(this->lru.begin(), this->lru, entry);
+
+		Query& record = entry->query;
 		record.cached = true;
-		req->OnLookupComplete(&record);
+		if (record.error != ERROR_NONE)
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached negative result for " + question.name);
+			this->negativehits++;
+			req->OnError(&record);
+		}
+		else
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: Using cached result for " + question.name);
+			this->cachehits++;
+			req->OnLookupComplete(&record);
+		}
 		return true;
 	}
 
-	/** Add a record to the dns cache
-	 * @param r The record
+	/** Add an answer to the dns cache
+	 * @param question The question the answer is for
+	 * @param r The answer, a negative one if its error is set
+	 * @param ttl Number of seconds the answer may be used for
 	 */
-	void AddCache(Query& r)
+	void AddCache(const Question& question, const Query& r, unsigned int ttl)
 	{
-		const ResourceRecord& rr = r.answers[0];
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + rr.name + " -> " + rr.rdata + " ttl: " + ConvToStr(rr.ttl));
-		this->cache[r.questions[0]] = r;
+		if (!this->cachesize)
+			return;
+
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: added cache for " + question.name + (r.error != ERROR_NONE ? " (negative)" : " -> " + r.answers[0].rdata) + " ttl: " + ConvToStr(ttl));
+
+		const time_t expires = ServerInstance->Time() + ttl;
+		cache_map::iterator it = this->cache.find(question);
+		if (it != this->cache.end())
+		{
+			it->second->query = r;
+			it->second->expires = expires;
+			this->lru.splice(this->lru.begin(), this->lru, it->second);
+			return;
+		}
+
+		this->lru.push_front(CacheEntry(question, r, expires));
+		this->cache[question] = this->lru.begin();
+		this->TrimCache();
 	}
 
- public:
-	DNS::Request* requests[MAX_REQUEST_ID];
+	/** Evict the least recently used answers until the cache is within its size */
+	void TrimCache()
+	{
+		while (this->cache.size() > this->cachesize)
+		{
+			this->cache.erase(this->lru.back().question);
+			this->lru.pop_back();
+		}
+	}
 
-	MyManager(Module* c) : Manager(c), Timer(3600, ServerInstance->Time(), true)
+	/** Remove expired answers from the cache */
+	void PurgeCache(time_t now)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
-			requests[i] = NULL;
-		ServerInstance->Timers.AddTimer(this);
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
+
+		for (lru_list::iterator it = this->lru.begin(); it != this->lru.end(); )
+		{
+			if (it->expires < now)
+			{
+				this->cache.erase(it->question);
+				it = this->lru.erase(it);
+			}
+			else
+				++it;
+		}
+		this->lastpurge = now;
 	}
 
-	~MyManager()
+	/** Choose the nameserver to send a query to, taking them in turn and skipping those that are failing
+	 * @param previous The nameserver the query was sent to before, which is avoided if there are others
+	 * @return The nameserver or NULL if there are none
+	 */
+	Upstream* PickUpstream(Upstream* previous)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		if (this->upstreams.empty())
+			return NULL;
+
+		Upstream* chosen = NULL;
+		for (size_t i = 0; i < this->upstreams.size(); i++)
 		{
-			DNS::Request* request = requests[i];
-			if (!request)
+			Upstream* upstream = this->upstreams[(this->nextupstream + i) % this->upstreams.size()];
+			if ((upstream == previous) && (this->upstreams.size() > 1))
 				continue;
 
-			Query rr(*request);
-			rr.error = ERROR_UNKNOWN;
-			request->OnError(&rr);
+			if (upstream->downuntil <= ServerInstance->Time())
+			{
+				chosen = upstream;
+				break;
+			}
 
-			delete request;
+			// All of them are failing, use the first one we found
+			if (!chosen)
+				chosen = upstream;
 		}
+
+		this->nextupstream = (this->nextupstream + 1) % this->upstreams.size();
+		return chosen;
 	}
 
-	void Process(DNS::Request* req)
+	/** Send a query to the next nameserver
+	 * @return True if the query was sent
+	 */
+	bool Send(PendingQuery* query)
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type) + " to " + this->myserver.addr());
+		Upstream* upstream = this->PickUpstream(query->upstream);
+		if (!upstream)
+			return false;
 
-		/* Create an id */
-		unsigned int tries = 0;
-		do
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Sending query for " + query->question.name + " to " + upstream->addr.addr());
+
+		query->upstream = upstream;
+		query->tries++;
+		query->lastsent = ServerInstance->Time();
+		upstream->sent++;
+
+		const int len = query->packet.length();
+		return (SocketEngine::SendTo(upstream, query->packet.data(), len, 0, &upstream->addr.sa, upstream->addr.sa_size()) == len);
+	}
+
+	/** Forget a query and free its id, the requests waiting for it must have been removed from it */
+	void RemoveQuery(PendingQuery* query)
+	{
+		this->inflight.erase(query->question);
+		this->pending[query->id] = NULL;
+		this->freeids.push_back(query->id);
+		delete query;
+	}
+
+	/** Send queries which weren't answered in time again, to another nameserver if there is one */
+	void RetryQueries(time_t now)
+	{
+		const int timeout = (ServerInstance->Config->dns_timeout ? ServerInstance->Config->dns_timeout : 5);
+		const time_t retryafter = std::max(2, timeout / static_cast<int>(this->upstreams.size() + 1));
+
+		for (inflight_map::const_iterator i = this->inflight.begin(); i != this->inflight.end(); ++i)
 		{
-			req->id = ServerInstance->GenRandomInt(DNS::MAX_REQUEST_ID);
+			PendingQuery* query = i->second;
+			if (query->lastsent + retryafter > now)
+				continue;
 
-			if (++tries == DNS::MAX_REQUEST_ID*5)
+			Upstream* upstream = query->upstream;
+			if (upstream)
 			{
-				// If we couldn't find an empty slot this many times, do a sequential scan as a last
-				// resort. If an empty slot is found that way, go on, otherwise throw an exception
-				req->id = 0;
-				for (int i = 1; i < DNS::MAX_REQUEST_ID; i++)
+				upstream->timeouts++;
+				if (++upstream->failures >= MAX_FAILURES)
 				{
-					if (!this->requests[i])
-					{
-						req->id = i;
-						break;
-					}
+					if (upstream->downuntil <= now)
+						ServerInstance->Logs->Log("RESOLVER", LOG_DEFAULT, "Resolver: Nameserver %s is not answering, preferring other nameservers for %ld seconds",
+							upstream->addr.addr().c_str(), static_cast<long>(DOWN_TIME));
+					upstream->downuntil = now + DOWN_TIME;
 				}
+			}
 
-				if (req->id == 0)
-					throw Exception("DNS: All ids are in use");
+			// If this fails the requests will time out on their own
+			this->Send(query);
+		}
+	}
 
-				break;
+ public:
+	/** Number of requests answered from the cache, by a cached negative answer, and not found in the cache */
+	unsigned long cachehits;
+	unsigned long negativehits;
+	unsigned long cachemisses;
+
+	/** Number of requests which were added to an identical query that was already sent */
+	unsigned long coalesced;
+
+	/** Number of answers received, their total and highest latency in milliseconds */
+	unsigned long answers;
+	uint64_t totallatency;
+	unsigned long maxlatency;
+
+	MyManager(Module* c)
+		: Manager(c), Timer(1, ServerInstance->Time(), true)
+		, cachesize(0), nextupstream(0), lastpurge(ServerInstance->Time())
+		, cachehits(0), negativehits(0), cachemisses(0), coalesced(0)
+		, answers(0), totallatency(0), maxlatency(0)
+	{
+		freeids.reserve(MAX_REQUEST_ID - 1);
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		{
+			pending[i] = NULL;
+			if (i)
+				freeids.push_back(i);
+		}
+		ServerInstance->Timers.AddTimer(this);
+	}
+
+	~MyManager()
+	{
+		for (int i = 0; i < MAX_REQUEST_ID; ++i)
+		{
+			// Request's destructor removes it from the query, and the query once it's the last one
+			while (this->pending[i])
+			{
+				DNS::Request* request = this->pending[i]->waiters.back();
+
+				Query rr(*request);
+				rr.error = ERROR_UNKNOWN;
+				request->OnError(&rr);
+
+				delete request;
 			}
 		}
-		while (!req->id || this->requests[req->id]);
 
-		this->requests[req->id] = req;
+		for (std::vector<Upstream*>::const_iterator i = this->upstreams.begin(); i != this->upstreams.end(); ++i)
+		{
+			SocketEngine::Close(*i);
+			delete *i;
+		}
+	}
+
+	void Process(DNS::Request* req)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Processing request to lookup " + req->name + " of type " + ConvToStr(req->type));
 
 		Packet p;
 		p.flags = QUERYFLAGS_RD;
-		p.id = req->id;
 		p.questions.push_back(*req);
 
 		unsigned char buffer[524];
@@ -512,20 +829,65 @@ class MyManager : public Manager, public Timer, public EventHandler
 		/* Note that calling Pack() above can actually change the contents of p.questions[0].name, if the query is a PTR,
 		 * to contain the value that would be in the DNS cache, which is why this is here.
 		 */
-		if (req->use_cache && this->CheckCache(req, p.questions[0]))
+		const Question& question = p.questions[0];
+		if (req->use_cache && this->CheckCache(req, question))
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Using cached result");
 			delete req;
 			return;
 		}
 
-		if (SocketEngine::SendTo(this, buffer, len, 0, &this->myserver.sa, this->myserver.sa_size()) != len)
+		inflight_map::iterator it = this->inflight.find(question);
+		if (it != this->inflight.end())
+		{
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Waiting for the answer to an identical query");
+			PendingQuery* query = it->second;
+			req->id = query->id;
+			query->waiters.push_back(req);
+			this->coalesced++;
+			return;
+		}
+
+		if (this->freeids.empty())
+			throw Exception("DNS: All ids are in use");
+
+		/* Create an id */
+		const size_t idpos = ServerInstance->GenRandomInt(this->freeids.size());
+		PendingQuery* query = new PendingQuery(question, this->freeids[idpos]);
+
+		// The id is the first field of the header
+		buffer[0] = query->id >> 8;
+		buffer[1] = query->id & 0xFF;
+		query->packet.assign(reinterpret_cast<char*>(buffer), len);
+
+		if (!this->Send(query))
+		{
+			delete query;
 			throw Exception("DNS: Unable to send query");
+		}
+
+		this->freeids[idpos] = this->freeids.back();
+		this->freeids.pop_back();
+		this->pending[query->id] = query;
+		this->inflight[query->question] = query;
+
+		req->id = query->id;
+		query->waiters.push_back(req);
 	}
 
 	void RemoveRequest(DNS::Request* req)
 	{
-		this->requests[req->id] = NULL;
+		PendingQuery* query = this->pending[req->id];
+		if (!query)
+			return;
+
+		std::vector<DNS::Request*>::iterator it = std::find(query->waiters.begin(), query->waiters.end(), req);
+		if (it == query->waiters.end())
+			return;
+
+		query->waiters.erase(it);
+		if (query->waiters.empty())
+			this->RemoveQuery(query);
 	}
 
 	std::string GetErrorStr(Error e)
@@ -555,23 +917,8 @@ class MyManager : public Manager, public Timer, public EventHandler
 		}
 	}
 
-	void HandleEvent(EventType et, int)
+	void HandleReply(Upstream* upstream, const unsigned char* buffer, int length)
 	{
-		if (et == EVENT_ERROR)
-		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
-			return;
-		}
-
-		unsigned char buffer[524];
-		irc::sockets::sockaddrs from;
-		socklen_t x = sizeof(from);
-
-		int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
-
-		if (length < Packet::HEADER_LENGTH)
-			return;
-
 		Packet recv_packet;
 
 		try
@@ -584,32 +931,33 @@ class MyManager : public Manager, public Timer, public EventHandler
 			return;
 		}
 
-		if (myserver != from)
+		PendingQuery* query = this->pending[recv_packet.id];
+		if (query == NULL)
 		{
-			std::string server1 = from.str();
-			std::string server2 = myserver.str();
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
-				server1.c_str(), server2.c_str());
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for something we didn't request");
 			return;
 		}
 
-		DNS::Request* request = this->requests[recv_packet.id];
-		if (request == NULL)
+		// Ids are shared by all nameservers, only the one the query was last sent to may answer it
+		if (query->upstream != upstream)
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for something we didn't request");
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received an answer for " + query->question.name + " from " + upstream->addr.addr() + ", which it was not sent to");
 			return;
 		}
 
+		upstream->answered++;
+		upstream->failures = 0;
+		upstream->downuntil = 0;
+
+		Error error = ERROR_NONE;
 		if (recv_packet.flags & QUERYFLAGS_OPCODE)
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Received a nonstandard query");
-			ServerInstance->stats->statsDnsBad++;
-			recv_packet.error = ERROR_NONSTANDARD_QUERY;
-			request->OnError(&recv_packet);
+			error = ERROR_NONSTANDARD_QUERY;
 		}
 		else if (recv_packet.flags & QUERYFLAGS_RCODE)
 		{
-			Error error = ERROR_UNKNOWN;
+			error = ERROR_UNKNOWN;
 
 			switch (recv_packet.flags & QUERYFLAGS_RCODE)
 			{
@@ -637,93 +985,157 @@ class MyManager : public Manager, public Timer, public EventHandler
 					break;
 			}
 
-			ServerInstance->stats->statsDnsBad++;
-			recv_packet.error = error;
-			request->OnError(&recv_packet);
+			// These are problems of the nameserver rather than answers, ask another one if there is one we didn't ask yet
+			if (((error == ERROR_SERVER_FAILURE) || (error == ERROR_NOT_IMPLEMENTED) || (error == ERROR_REFUSED))
+				&& (query->tries < this->upstreams.size()) && (this->Send(query)))
+				return;
 		}
 		else if (recv_packet.questions.empty() || recv_packet.answers.empty())
 		{
 			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: No resource records returned");
-			ServerInstance->stats->statsDnsBad++;
-			recv_packet.error = ERROR_NO_RECORDS;
-			request->OnError(&recv_packet);
+			error = ERROR_NO_RECORDS;
 		}
-		else
+
+		unsigned long latency = (ServerInstance->Time() - query->started) * 1000 + (ServerInstance->Time_ns() - query->started_ns) / 1000000;
+		this->answers++;
+		this->totallatency += latency;
+		this->maxlatency = std::max(this->maxlatency, latency);
+
+		recv_packet.error = error;
+		if (error == ERROR_NONE)
+			this->AddCache(query->question, recv_packet, recv_packet.answers[0].ttl);
+		else if (((error == ERROR_DOMAIN_NOT_FOUND) || (error == ERROR_NO_RECORDS)) && (recv_packet.negative_ttl))
+			this->AddCache(query->question, recv_packet, (recv_packet.negative_ttl < MAX_NEGATIVE_TTL ? recv_packet.negative_ttl : MAX_NEGATIVE_TTL));
+
+		// Forget the query before calling the requests, they may send new queries
+		std::vector<DNS::Request*> waiters;
+		waiters.swap(query->waiters);
+		this->RemoveQuery(query);
+
+		for (std::vector<DNS::Request*>::const_iterator i = waiters.begin(); i != waiters.end(); ++i)
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Lookup complete for " + request->name);
-			ServerInstance->stats->statsDnsGood++;
-			request->OnLookupComplete(&recv_packet);
-			this->AddCache(recv_packet);
-		}
+			DNS::Request* request = *i;
+			if (error != ERROR_NONE)
+			{
+				ServerInstance->stats->statsDnsBad++;
+				request->OnError(&recv_packet);
+			}
+			else
+			{
+				ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Lookup complete for " + request->name);
+				ServerInstance->stats->statsDnsGood++;
+				request->OnLookupComplete(&recv_packet);
+			}
 
-		ServerInstance->stats->statsDns++;
+			ServerInstance->stats->statsDns++;
 
-		/* Request's destructor removes it from the request map */
-		delete request;
+			/* Request's destructor would remove it from the query, but that's gone already */
+			delete request;
+		}
 	}
 
 	bool Tick(time_t now)
 	{
-		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: cache: purging DNS cache");
+		this->RetryQueries(now);
 
-		for (cache_map::iterator it = this->cache.begin(); it != this->cache.end(); )
-		{
-			const Query& query = it->second;
-			if (IsExpired(query, now))
-				this->cache.erase(it++);
-			else
-				++it;
-		}
+		if (now - this->lastpurge >= 3600)
+			this->PurgeCache(now);
 		return true;
 	}
 
-	void Rehash(const std::string& dnsserver)
+	void SetCacheSize(size_t size)
 	{
-		if (this->GetFd() > -1)
-		{
-			SocketEngine::Shutdown(this, 2);
-			SocketEngine::Close(this);
-
-			/* Remove expired entries from the cache */
-			this->Tick(ServerInstance->Time());
-		}
+		this->cachesize = size;
+		this->TrimCache();
+	}
 
-		irc::sockets::aptosa(dnsserver, DNS::PORT, myserver);
+	size_t GetCacheCount() const { return this->cache.size(); }
+	size_t GetCacheSize() const { return this->cachesize; }
+	const std::vector<Upstream*>& GetUpstreams() const { return this->upstreams; }
 
-		/* Initialize mastersocket */
-		int s = socket(myserver.sa.sa_family, SOCK_DGRAM, 0);
-		this->SetFd(s);
+	/** Get all requests waiting for an answer */
+	void GetRequests(std::vector<DNS::Request*>& out) const
+	{
+		for (inflight_map::const_iterator i = this->inflight.begin(); i != this->inflight.end(); ++i)
+			out.insert(out.end(), i->second->waiters.begin(), i->second->waiters.end());
+	}
 
-		/* Have we got a socket? */
-		if (this->GetFd() != -1)
+	void Rehash(const std::string& dnsservers)
+	{
+		for (std::vector<Upstream*>::const_iterator i = this->upstreams.begin(); i != this->upstreams.end(); ++i)
 		{
-			SocketEngine::SetReuse(s);
-			SocketEngine::NonBlocking(s);
+			Upstream* upstream = *i;
+			SocketEngine::Shutdown(upstream, 2);
+			SocketEngine::Close(upstream);
+			ServerInstance->GlobalCulls.AddItem(upstream);
+		}
+		this->upstreams.clear();
+		this->nextupstream = 0;
 
-			irc::sockets::sockaddrs bindto;
-			memset(&bindto, 0, sizeof(bindto));
-			bindto.sa.sa_family = myserver.sa.sa_family;
+		// Pending queries are sent to the new nameservers when they are retried
+		for (inflight_map::const_iterator i = this->inflight.begin(); i != this->inflight.end(); ++i)
+			i->second->upstream = NULL;
 
-			if (SocketEngine::Bind(this->GetFd(), bindto) < 0)
-			{
-				/* Failed to bind */
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error binding dns socket - hostnames will NOT resolve");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
-			}
-			else if (!SocketEngine::AddFd(this, FD_WANT_POLL_READ | FD_WANT_NO_WRITE))
+		/* Remove expired entries from the cache */
+		this->PurgeCache(ServerInstance->Time());
+
+		irc::spacesepstream servers(dnsservers);
+		std::string server;
+		while (servers.GetToken(server))
+		{
+			irc::sockets::sockaddrs addr;
+			if (!irc::sockets::aptosa(server, DNS::PORT, addr))
 			{
-				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Internal error starting DNS - hostnames will NOT resolve.");
-				SocketEngine::Close(this->GetFd());
-				this->SetFd(-1);
+				ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Ignoring invalid nameserver address '%s'", server.c_str());
+				continue;
 			}
+
+			Upstream* upstream = new Upstream(this, addr);
+			if (upstream->GetFd() == -1)
+				delete upstream;
+			else
+				this->upstreams.push_back(upstream);
 		}
-		else
+
+		if (this->upstreams.empty())
+			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: No usable nameservers - hostnames will NOT resolve");
+	}
+};
+
+void Upstream::HandleEvent(EventType et, int)
+{
+	if (et == EVENT_ERROR)
+	{
+		ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: UDP socket got an error event");
+		return;
+	}
+
+	// Read every answer that is waiting, during a burst of lookups many arrive between two events
+	while (this->GetFd() != -1)
+	{
+		unsigned char buffer[524];
+		irc::sockets::sockaddrs from;
+		socklen_t x = sizeof(from);
+
+		int length = SocketEngine::RecvFrom(this, buffer, sizeof(buffer), 0, &from.sa, &x);
+		if (length < 0)
+			break;
+
+		if (length < Packet::HEADER_LENGTH)
+			continue;
+
+		if (this->addr != from)
 		{
-			ServerInstance->Logs->Log("RESOLVER", LOG_SPARSE, "Resolver: Error creating DNS socket - hostnames will NOT resolve");
+			std::string server1 = from.str();
+			std::string server2 = this->addr.str();
+			ServerInstance->Logs->Log("RESOLVER", LOG_DEBUG, "Resolver: Got a result from the wrong server! Bad NAT or DNS forging attempt? '%s' != '%s'",
+				server1.c_str(), server2.c_str());
+			continue;
 		}
+
+		manager->HandleReply(this, buffer, length);
 	}
-};
+}
 
 class ModuleDNS : public Module
 {
@@ -751,14 +1163,21 @@ class ModuleDNS : public Module
 			if (pFixedInfo)
 			{
 				if (GetNetworkParams(pFixedInfo, &dwBufferSize) == NO_ERROR)
-					DNSServer = pFixedInfo->DnsServerList.IpAddress.String;
+				{
+					for (PIP_ADDR_STRING server = &pFixedInfo->DnsServerList; server; server = server->Next)
+					{
+						if (!DNSServer.empty())
+							DNSServer.push_back(' ');
+						DNSServer.append(server->IpAddress.String);
+					}
+				}
 
 				HeapFree(GetProcessHeap(), 0, pFixedInfo);
 			}
 
 			if (!DNSServer.empty())
 			{
-				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first active resolver in the system settings.", DNSServer.c_str());
+				ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as the active resolvers in the system settings.", DNSServer.c_str());
 				return;
 			}
 		}
@@ -769,20 +1188,28 @@ class ModuleDNS : public Module
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "WARNING: <dns:server> not defined, attempting to find working server in /etc/resolv.conf...");
 
 		std::ifstream resolv("/etc/resolv.conf");
+		std::string token;
 
-		while (resolv >> DNSServer)
+		while (resolv >> token)
 		{
-			if (DNSServer == "nameserver")
+			if (token == "nameserver")
 			{
-				resolv >> DNSServer;
-				if (DNSServer.find_first_not_of("0123456789.") == std::string::npos)
+				resolv >> token;
+				if (token.find_first_not_of("0123456789.") == std::string::npos)
 				{
-					ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as first resolver in /etc/resolv.conf.",DNSServer.c_str());
-					return;
+					if (!DNSServer.empty())
+						DNSServer.push_back(' ');
+					DNSServer.append(token);
 				}
 			}
 		}
 
+		if (!DNSServer.empty())
+		{
+			ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "<dns:server> set to '%s' as the resolvers in /etc/resolv.conf.", DNSServer.c_str());
+			return;
+		}
+
 		ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "/etc/resolv.conf contains no viable nameserver entries! Defaulting to nameserver '127.0.0.1'!");
 #endif
 		DNSServer = "127.0.0.1";
@@ -795,23 +1222,26 @@ class ModuleDNS : public Module
 
 	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
 	{
+		ConfigTag* tag = ServerInstance->Config->ConfValue("dns");
 		std::string oldserver = DNSServer;
-		DNSServer = ServerInstance->Config->ConfValue("dns")->getString("server");
+		DNSServer = tag->getString("server");
 		if (DNSServer.empty())
 			FindDNSServer();
 
 		if (oldserver != DNSServer)
 			this->manager.Rehash(DNSServer);
+
+		this->manager.SetCacheSize(tag->getInt("cachesize", 10000, 0));
 	}
 
 	void OnUnloadModule(Module* mod)
 	{
-		for (int i = 0; i < MAX_REQUEST_ID; ++i)
-		{
-			DNS::Request* req = this->manager.requests[i];
-			if (!req)
-				continue;
+		std::vector<DNS::Request*> requests;
+		this->manager.GetRequests(requests);
 
+		for (std::vector<DNS::Request*>::const_iterator i = requests.begin(); i != requests.end(); ++i)
+		{
+			DNS::Request* req = *i;
 			if (req->creator == mod)
 			{
 				Query rr(*req);
@@ -823,6 +1253,27 @@ class ModuleDNS : public Module
 		}
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'T')
+			return MOD_RES_PASSTHRU;
+
+		results.push_back("249 " + user->nick + " :dns cache entries " + ConvToStr(manager.GetCacheCount()) + " of " + ConvToStr(manager.GetCacheSize())
+			+ " hits " + ConvToStr(manager.cachehits) + " negative hits " + ConvToStr(manager.negativehits) + " misses " + ConvToStr(manager.cachemisses));
+		results.push_back("249 " + user->nick + " :dns answers " + ConvToStr(manager.answers) + " coalesced requests " + ConvToStr(manager.coalesced)
+			+ " latency avg " + ConvToStr(manager.answers ? manager.totallatency / manager.answers : 0) + "ms max " + ConvToStr(manager.maxlatency) + "ms");
+
+		const std::vector<Upstream*>& upstreams = manager.GetUpstreams();
+		for (std::vector<Upstream*>::const_iterator i = upstreams.begin(); i != upstreams.end(); ++i)
+		{
+			const Upstream* upstream = *i;
+			results.push_back("249 " + user->nick + " :dns server " + upstream->addr.str() + " sent " + ConvToStr(upstream->sent) + " answered " + ConvToStr(upstream->answered)
+				+ " timeouts " + ConvToStr(upstream->timeouts) + (upstream->downuntil > ServerInstance->Time() ? " (not answering)" : ""));
+		}
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	Version GetVersion()
 	{
 		return Version("DNS support", VF_CORE|VF_VENDOR);
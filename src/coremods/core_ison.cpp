@@ -42,7 +42,7 @@ class CommandIson : public Command
  */
 CmdResult CommandIson::Handle (const std::vector<std::string>& parameters, User *user)
 {
-	std::map<User*,User*> ison_already;
+	SmallSet<User*, 8> ison_already;
 	User *u;
 	std::string reply = "303 " + user->nick + " :";
 
@@ -60,7 +60,7 @@ CmdResult CommandIson::Handle (const std::vector<std::string>& parameters, User
 				user->WriteServ(reply);
 				reply = "303 " + user->nick + " :";
 			}
-			ison_already[u] = u;
+			ison_already.insert(u);
 		}
 		else
 		{
@@ -85,7 +85,7 @@ CmdResult CommandIson::Handle (const std::vector<std::string>& parameters, User
 							user->WriteServ(reply);
 							reply = "303 " + user->nick + " :";
 						}
-						ison_already[u] = u;
+						ison_already.insert(u);
 					}
 				}
 			}
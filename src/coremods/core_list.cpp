@@ -20,24 +20,217 @@
 
 #include "inspircd.h"
 
+/** A LIST which is in progress. The names of all channels are taken when the
+ * LIST starts and output stops whenever the sendq of the user reaches the soft
+ * sendq limit, to continue from the next name when it has drained. Channels
+ * created while the listing is in progress are not shown and channels which
+ * have been deleted in the meantime are skipped, every other channel is shown
+ * exactly once.
+ */
+class ListJob
+{
+	/** An ELIST time condition, which limits how many minutes ago something happened */
+	struct TimeLimit
+	{
+		time_t after;
+		time_t before;
+		TimeLimit() : after(0), before(0) { }
+
+		bool Check(time_t t) const
+		{
+			return ((!after || t > after) && (!before || t < before));
+		}
+
+		/** Parse the part of a C or T condition after the letter */
+		bool Parse(const std::string& cond, time_t now)
+		{
+			if (cond.length() < 2 || (cond[0] != '<' && cond[0] != '>'))
+				return false;
+
+			time_t limit = now - ConvToInt(cond.substr(1)) * 60;
+			if (cond[0] == '<')
+				after = limit;
+			else
+				before = limit;
+			return true;
+		}
+	};
+
+	/** Users must be more than this */
+	long minusers;
+
+	/** Users must be less than this, 0 for no limit */
+	long maxusers;
+
+	/** Creation time condition (ELIST C) */
+	TimeLimit created;
+
+	/** Topic time condition (ELIST T) */
+	TimeLimit topic;
+
+	/** True if there is a topic time condition, which excludes channels without a topic */
+	bool checktopic;
+
+	/** The name or topic of a listed channel must match one of these, if there are any */
+	std::vector<std::string> masks;
+
+	/** The name of a listed channel must not match any of these (ELIST N) */
+	std::vector<std::string> negmasks;
+
+	/** True if the user can see secret and private channels */
+	bool auspex;
+
+	/** Names of the channels that existed when the LIST started */
+	std::vector<std::string> names;
+
+	/** Index of the next name in names to look at */
+	size_t next;
+
+	void ListChannel(User* user, Channel* chan, ChanModeReference& secretmode, ChanModeReference& privatemode) const
+	{
+		// Cheap conditions first so channels that do not match are never formatted
+		long users = chan->GetUserCounter();
+		if ((minusers && users <= minusers) || (maxusers && users >= maxusers))
+			return;
+
+		if (!created.Check(chan->age))
+			return;
+
+		if (checktopic && (chan->topic.empty() || !topic.Check(chan->topicset)))
+			return;
+
+		if (!masks.empty())
+		{
+			std::vector<std::string>::const_iterator i = masks.begin();
+			while (i != masks.end() && !InspIRCd::Match(chan->name, *i) && !InspIRCd::Match(chan->topic, *i))
+				++i;
+			if (i == masks.end())
+				return;
+		}
+
+		for (std::vector<std::string>::const_iterator i = negmasks.begin(); i != negmasks.end(); ++i)
+		{
+			if (InspIRCd::Match(chan->name, *i))
+				return;
+		}
+
+		// if the channel is not private/secret, OR the user is on the channel anyway
+		bool n = (auspex || chan->HasUser(user));
+
+		if (!n && chan->IsModeSet(privatemode))
+		{
+			/* Channel is +p and user is outside/not privileged */
+			user->WriteNumeric(RPL_LIST, "* %ld :", users);
+		}
+		else if (n || !chan->IsModeSet(secretmode))
+		{
+			/* User is in the channel/privileged, channel is not +s */
+			user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s", chan->name.c_str(), users, chan->ChanModes(n), chan->topic.c_str());
+		}
+	}
+
+ public:
+	ListJob(User* user, const std::vector<std::string>& parameters)
+		: minusers(0), maxusers(0), checktopic(false), auspex(user->HasPrivPermission("channels/auspex")), next(0)
+	{
+		// Names stay valid when the channel hash is resized, positions in it do not
+		const chan_hash& chans = ServerInstance->GetChans();
+		names.reserve(chans.size());
+		for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
+			names.push_back(i->first);
+
+		if (parameters.empty())
+			return;
+
+		irc::commasepstream conditions(parameters[0]);
+		std::string cond;
+		while (conditions.GetToken(cond))
+		{
+			if (cond.empty())
+				continue;
+
+			/* Work around mIRC suckyness. YOU SUCK, KHALED! */
+			if (cond[0] == '<')
+				maxusers = ConvToInt(cond.substr(1));
+			else if (cond[0] == '>')
+				minusers = ConvToInt(cond.substr(1));
+			else if (cond[0] == '!')
+				negmasks.push_back(cond.substr(1));
+			else if ((cond[0] == 'C' || cond[0] == 'c') && created.Parse(cond.substr(1), ServerInstance->Time()))
+				continue;
+			else if ((cond[0] == 'T' || cond[0] == 't') && topic.Parse(cond.substr(1), ServerInstance->Time()))
+				checktopic = true;
+			else
+				masks.push_back(cond);
+		}
+	}
+
+	/** List channels until the sendq of the user is full or all channels have been listed
+	 * @return True if the listing is complete
+	 */
+	bool Run(User* user, ChanModeReference& secretmode, ChanModeReference& privatemode)
+	{
+		LocalUser* localuser = IS_LOCAL(user);
+		const unsigned long watermark = localuser ? localuser->MyClass->GetSendqSoftMax() : ULONG_MAX;
+
+		for (; next < names.size(); next++)
+		{
+			if (localuser && localuser->eh.getSendQSize() >= watermark)
+				return false;
+
+			Channel* chan = ServerInstance->FindChan(names[next]);
+			if (chan)
+				ListChannel(user, chan, secretmode, privatemode);
+		}
+
+		End(user);
+		return true;
+	}
+
+	/** Send the end of the listing, also used when the LIST is replaced before it completed */
+	static void End(User* user)
+	{
+		user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
+	}
+};
+
 /** Handle /LIST.
  */
 class CommandList : public Command
 {
+ public:
 	ChanModeReference secretmode;
 	ChanModeReference privatemode;
 
- public:
+	/** LIST in progress for a user */
+	SimpleExtItem<ListJob> jobs;
+
 	/** Constructor for list.
 	 */
 	CommandList(Module* parent)
 		: Command(parent,"LIST", 0, 0)
 		, secretmode(creator, "secret")
 		, privatemode(creator, "private")
+		, jobs("list_job", parent)
 	{
 		Penalty = 5;
 	}
 
+	/** Continue the LIST of a user, if any
+	 * @param user The user whose LIST to continue
+	 */
+	void Continue(LocalUser* user)
+	{
+		ListJob* job = jobs.get(user);
+		if (!job)
+			return;
+
+		if (job->Run(user, secretmode, privatemode))
+			jobs.unset(user);
+		else
+			user->eh.NotifyOnDrain();
+	}
+
 	/** Handle command.
 	 * @param parameters The parameters to the command
 	 * @param user The user issuing the command
@@ -51,62 +244,49 @@ class CommandList : public Command
  */
 CmdResult CommandList::Handle (const std::vector<std::string>& parameters, User *user)
 {
-	int minusers = 0, maxusers = 0;
+	// A new LIST replaces one that is still in progress, which is ended first so
+	// every RPL_LISTSTART the client sees is matched by an RPL_LISTEND
+	LocalUser* localuser = IS_LOCAL(user);
+	if ((localuser) && (jobs.get(localuser)))
+	{
+		jobs.unset(localuser);
+		ListJob::End(user);
+	}
 
 	user->WriteNumeric(RPL_LISTSTART, "Channel :Users Name");
 
-	/* Work around mIRC suckyness. YOU SUCK, KHALED! */
-	if (parameters.size() == 1)
+	ListJob* job = new ListJob(user, parameters);
+	if (!localuser)
 	{
-		if (parameters[0][0] == '<')
-		{
-			maxusers = atoi((parameters[0].c_str())+1);
-		}
-		else if (parameters[0][0] == '>')
-		{
-			minusers = atoi((parameters[0].c_str())+1);
-		}
+		job->Run(user, secretmode, privatemode);
+		delete job;
+		return CMD_SUCCESS;
 	}
 
-	const chan_hash& chans = ServerInstance->GetChans();
-	for (chan_hash::const_iterator i = chans.begin(); i != chans.end(); ++i)
-	{
-		// attempt to match a glob pattern
-		long users = i->second->GetUserCounter();
-
-		bool too_few = (minusers && (users <= minusers));
-		bool too_many = (maxusers && (users >= maxusers));
-
-		if (too_many || too_few)
-			continue;
-
-		if (parameters.size() && !parameters[0].empty() && (parameters[0][0] != '<' && parameters[0][0] != '>'))
-		{
-			if (!InspIRCd::Match(i->second->name, parameters[0]) && !InspIRCd::Match(i->second->topic, parameters[0]))
-				continue;
-		}
+	jobs.set(localuser, job);
+	Continue(localuser);
+	return CMD_SUCCESS;
+}
 
-		// if the channel is not private/secret, OR the user is on the channel anyway
-		bool n = (i->second->HasUser(user) || user->HasPrivPermission("channels/auspex"));
+class CoreModList : public Module
+{
+	CommandList cmd;
 
-		if (!n && i->second->IsModeSet(privatemode))
-		{
-			/* Channel is +p and user is outside/not privileged */
-			user->WriteNumeric(RPL_LIST, "* %ld :", users);
-		}
-		else
-		{
-			if (n || !i->second->IsModeSet(secretmode))
-			{
-				/* User is in the channel/privileged, channel is not +s */
-				user->WriteNumeric(RPL_LIST, "%s %ld :[+%s] %s",i->second->name.c_str(),users,i->second->ChanModes(n),i->second->topic.c_str());
-			}
-		}
+ public:
+	CoreModList()
+		: cmd(this)
+	{
 	}
-	user->WriteNumeric(RPL_LISTEND, ":End of channel list.");
 
-	return CMD_SUCCESS;
-}
+	void OnSendQDrained(LocalUser* user) CXX11_OVERRIDE
+	{
+		cmd.Continue(user);
+	}
 
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides the LIST command", VF_VENDOR|VF_CORE);
+	}
+};
 
-COMMAND_INIT(CommandList)
+MODULE_INIT(CoreModList)
@@ -66,7 +66,9 @@ class MessageCommandBase : public Command
 
 void MessageCommandBase::SendAll(User* user, const std::string& msg, MessageType mt)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + MessageTypeString[mt] + " $* :" + msg;
+	MessageBuilder builder;
+	builder.Prefix(user->GetMessagePrefix()).Add(MessageTypeString[mt]).Add("$*").AddTrailing(msg);
+	const reference<SendBuffer> message = builder.Finish();
 	const LocalUserList& list = ServerInstance->Users->local_users;
 	for (LocalUserList::const_iterator i = list.begin(); i != list.end(); ++i)
 	{
@@ -180,7 +182,9 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 			}
 			else
 			{
-				chan->WriteAllExcept(user, false, status, except_list, "%s %s :%s", MessageTypeString[mt], chan->name.c_str(), text);
+				MessageBuilder msg;
+				msg.Prefix(user->GetMessagePrefix()).Add(MessageTypeString[mt]).Add(chan->name).AddTrailing(temp);
+				chan->RawWriteAllExcept(user, false, status, except_list, msg.Finish());
 			}
 
 			FOREACH_MOD(OnUserMessage, (user,chan, TYPE_CHANNEL, text, status, except_list, mt));
@@ -247,7 +251,9 @@ CmdResult MessageCommandBase::HandleMessage(const std::vector<std::string>& para
 		if (IS_LOCAL(dest))
 		{
 			// direct write, same server
-			dest->WriteFrom(user, "%s %s :%s", MessageTypeString[mt], dest->nick.c_str(), text);
+			MessageBuilder msg;
+			msg.Prefix(user->GetMessagePrefix()).Add(MessageTypeString[mt]).Add(dest->nick).AddTrailing(temp);
+			dest->Write(msg.Finish());
 		}
 
 		FOREACH_MOD(OnUserMessage, (user, dest, TYPE_USER, text, 0, except_list, mt));
@@ -184,6 +184,15 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 			results.push_back("249 "+user->nick+" :Read events:  "+ConvToStr(stats.ReadEvents));
 			results.push_back("249 "+user->nick+" :Write events: "+ConvToStr(stats.WriteEvents));
 			results.push_back("249 "+user->nick+" :Error events: "+ConvToStr(stats.ErrorEvents));
+			results.push_back("249 "+user->nick+" :Dispatches:   "+ConvToStr(stats.Dispatches));
+			if (stats.Dispatches)
+			{
+				char average[30];
+				snprintf(average, sizeof(average), "%.2f", (float)stats.TotalEvents / stats.Dispatches);
+				results.push_back("249 "+user->nick+" :Events per dispatch: "+average+" average, "+ConvToStr(stats.MaxBatch)+" max");
+			}
+			if (stats.BatchSize)
+				results.push_back("249 "+user->nick+" :Event batch size: "+ConvToStr(stats.BatchSize));
 			break;
 		}
 
@@ -379,6 +388,37 @@ void CommandStats::DoStats(char statschar, User* user, string_list &results)
 		}
 		break;
 
+		/* stats D (show the time spent by modules in their hooks) */
+		case 'D':
+		{
+			if (!ServerInstance->Config->HookProfiling)
+				results.push_back("249 "+user->nick+" :hook profiling is disabled, enable it with <performance hookprofiling=\"yes\">");
+
+			// Most expensive first
+			std::multimap<unsigned long long, std::string, std::greater<unsigned long long> > lines;
+			const ModuleManager::ModuleMap& mods = ServerInstance->Modules->GetModules();
+			for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
+			{
+				const HookProfile* profiles = i->second->HookProfiles;
+				if (!profiles)
+					continue;
+
+				for (size_t n = I_BEGIN + 1; n != I_END; ++n)
+				{
+					const HookProfile& profile = profiles[n];
+					if (!profile.calls)
+						continue;
+
+					lines.insert(std::make_pair(profile.cycles, i->first + " " + ModuleManager::GetHookName((Implementation)n) + " calls " + ConvToStr(profile.calls)
+						+ " cycles " + ConvToStr(profile.cycles) + " avg " + ConvToStr(profile.cycles / profile.calls) + " max " + ConvToStr(profile.maxcycles)));
+				}
+			}
+
+			for (std::multimap<unsigned long long, std::string, std::greater<unsigned long long> >::const_iterator i = lines.begin(); i != lines.end(); ++i)
+				results.push_back("249 "+user->nick+" :"+i->second);
+		}
+		break;
+
 		default:
 		break;
 	}
@@ -43,7 +43,7 @@ CmdResult CommandNick::Handle (const std::vector<std::string>& parameters, User
 
 	// anything except the initial NICK gets a flood penalty
 	if (user->registered == REG_ALL && IS_LOCAL(user))
-		IS_LOCAL(user)->CommandFloodPenalty += 4000;
+		IS_LOCAL(user)->AddPenalty(4000);
 
 	if (newnick.empty())
 	{
@@ -75,6 +75,8 @@ CmdResult CommandNick::Handle (const std::vector<std::string>& parameters, User
 			if (MOD_RESULT == MOD_RES_DENY)
 				return CMD_FAILURE;
 
+			ServerInstance->Users->CheckReady(IS_LOCAL(user));
+
 			// return early to not penalize new users
 			return CMD_SUCCESS;
 		}
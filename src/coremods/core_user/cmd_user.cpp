@@ -71,6 +71,7 @@ CmdResult CommandUser::HandleLocal(const std::vector<std::string>& parameters, L
 		if (MOD_RESULT == MOD_RES_DENY)
 			return CMD_FAILURE;
 
+		ServerInstance->Users->CheckReady(user);
 	}
 
 	return CMD_SUCCESS;
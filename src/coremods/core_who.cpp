@@ -20,11 +20,274 @@
 
 #include "inspircd.h"
 
+/** Indexes of the registered users by real host, displayed host, ident, realname and
+ * server, used to find the users a wildcard WHO can match without checking every user.
+ */
+class WhoIndex
+{
+ public:
+	typedef std::multimap<std::string, User*> KeyMap;
+	typedef std::multimap<Server*, User*> ServerMap;
+
+	/** Index of one field, keyed on the lowercase value and on the reversed lowercase
+	 * value so both the literal prefix and the literal suffix of a mask can be looked up
+	 */
+	class Field
+	{
+		KeyMap forward;
+		KeyMap reverse;
+
+		/** Case mapping the keys were lowercased with */
+		const unsigned char* casemap;
+
+		static void Collect(const KeyMap& map, const std::string& prefix, std::vector<User*>& out)
+		{
+			for (KeyMap::const_iterator i = map.lower_bound(prefix); i != map.end(); ++i)
+			{
+				if (i->first.compare(0, prefix.length(), prefix) != 0)
+					break;
+				out.push_back(i->second);
+			}
+		}
+
+	 public:
+		struct Position
+		{
+			KeyMap::iterator forward;
+			KeyMap::iterator reverse;
+		};
+
+		Field(const unsigned char* map)
+			: casemap(map)
+		{
+		}
+
+		const unsigned char* GetCaseMap() const { return casemap; }
+
+		/** Change the case mapping, only allowed while the field is empty */
+		void SetCaseMap(const unsigned char* map)
+		{
+			casemap = map;
+		}
+
+		Position Add(const std::string& value, User* user)
+		{
+			std::string key = Lower(value);
+			Position pos;
+			pos.forward = forward.insert(std::make_pair(key, user));
+			std::reverse(key.begin(), key.end());
+			pos.reverse = reverse.insert(std::make_pair(key, user));
+			return pos;
+		}
+
+		void Remove(const Position& pos)
+		{
+			forward.erase(pos.forward);
+			reverse.erase(pos.reverse);
+		}
+
+		/** Find the users whose value may match a mask
+		 * @param mask The mask, matched case insensitively using the case mapping of the field
+		 * @param out Candidates are appended here
+		 * @return False if the mask has no literal prefix or suffix, every user is a candidate then
+		 */
+		bool Find(const std::string& mask, std::vector<User*>& out) const
+		{
+			const std::string lowermask = Lower(mask);
+			const std::string::size_type first = lowermask.find_first_of("*?");
+			if (first == std::string::npos)
+			{
+				Collect(forward, lowermask, out);
+				return true;
+			}
+
+			const std::string::size_type last = lowermask.find_last_of("*?");
+			std::string suffix(lowermask, last + 1);
+			if (first == 0 && suffix.empty())
+				return false;
+
+			if (first >= suffix.length())
+			{
+				Collect(forward, lowermask.substr(0, first), out);
+			}
+			else
+			{
+				std::reverse(suffix.begin(), suffix.end());
+				Collect(reverse, suffix, out);
+			}
+			return true;
+		}
+
+		std::string Lower(const std::string& str) const
+		{
+			std::string ret(str);
+			for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+				*i = casemap[(unsigned char)*i];
+			return ret;
+		}
+	};
+
+	/** Positions of one user in the indexes, kept in an extension item so the user is
+	 * removed from the indexes whenever the item is freed
+	 */
+	struct Entry
+	{
+		WhoIndex* index;
+		Field::Position host;
+		Field::Position dhost;
+		Field::Position ident;
+		Field::Position name;
+		ServerMap::iterator server;
+	};
+
+	struct EntryDeleter
+	{
+		void operator()(Entry* entry) const
+		{
+			if (!entry)
+				return;
+			entry->index->host.Remove(entry->host);
+			entry->index->dhost.Remove(entry->dhost);
+			entry->index->ident.Remove(entry->ident);
+			entry->index->name.Remove(entry->name);
+			entry->index->servers.erase(entry->server);
+			delete entry;
+		}
+	};
+
+	Field host;
+	Field dhost;
+	Field ident;
+	Field name;
+	ServerMap servers;
+	SimpleExtItem<Entry, EntryDeleter> entries;
+	bool enabled;
+
+	WhoIndex(Module* parent)
+		: host(ascii_case_insensitive_map)
+		, dhost(ascii_case_insensitive_map)
+		, ident(ascii_case_insensitive_map)
+		, name(national_case_insensitive_map)
+		, entries("whoindex", parent)
+		, enabled(false)
+	{
+	}
+
+	void Add(User* user)
+	{
+		if (!enabled || user->registered != REG_ALL || user->quitting)
+			return;
+
+		Entry* entry = new Entry;
+		entry->index = this;
+		entry->host = host.Add(user->host, user);
+		entry->dhost = dhost.Add(user->dhost, user);
+		entry->ident = ident.Add(user->ident, user);
+		entry->name = name.Add(user->fullname, user);
+		entry->server = servers.insert(std::make_pair(user->server, user));
+		entries.set(user, entry);
+	}
+
+	void Remove(User* user)
+	{
+		entries.unset(user);
+	}
+
+	void ChangeDisplayedHost(User* user, const std::string& newhost)
+	{
+		Entry* entry = entries.get(user);
+		if (!entry)
+			return;
+		dhost.Remove(entry->dhost);
+		entry->dhost = dhost.Add(newhost.substr(0, ServerInstance->Config->Limits.MaxHost), user);
+	}
+
+	/** Re-index the real host and the displayed host, which may have been reset along with it */
+	void ChangeRealHost(User* user)
+	{
+		Entry* entry = entries.get(user);
+		if (!entry)
+			return;
+		host.Remove(entry->host);
+		entry->host = host.Add(user->host, user);
+		dhost.Remove(entry->dhost);
+		entry->dhost = dhost.Add(user->dhost, user);
+	}
+
+	void ChangeIdent(User* user, const std::string& newident)
+	{
+		Entry* entry = entries.get(user);
+		if (!entry)
+			return;
+		ident.Remove(entry->ident);
+		entry->ident = ident.Add(newident.substr(0, ServerInstance->Config->Limits.IdentMax), user);
+	}
+
+	void ChangeName(User* user, const std::string& newname)
+	{
+		Entry* entry = entries.get(user);
+		if (!entry)
+			return;
+		name.Remove(entry->name);
+		entry->name = name.Add(newname.substr(0, ServerInstance->Config->Limits.MaxGecos), user);
+	}
+
+	/** Rebuild the realname index if the case mapping realnames are matched with has been
+	 * changed since it was built, for example by m_nationalchars
+	 */
+	void CheckNameCaseMap()
+	{
+		if (!enabled || name.GetCaseMap() == national_case_insensitive_map)
+			return;
+
+		SetEnabled(false);
+		name.SetCaseMap(national_case_insensitive_map);
+		SetEnabled(true);
+	}
+
+	/** Turn the index on or off, adding all existing users when it is turned on */
+	void SetEnabled(bool newenabled)
+	{
+		if (newenabled == enabled)
+			return;
+
+		const user_hash& users = ServerInstance->Users->GetUsers();
+		if (!newenabled)
+		{
+			for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+				Remove(i->second);
+		}
+
+		enabled = newenabled;
+		if (enabled)
+		{
+			for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+				Add(i->second);
+		}
+	}
+
+	/** Add the users on servers whose name matches a mask */
+	void FindServers(const std::string& mask, std::vector<User*>& out) const
+	{
+		for (ServerMap::const_iterator i = servers.begin(); i != servers.end(); i = servers.upper_bound(i->first))
+		{
+			if (!InspIRCd::Match(i->first->GetName(), mask))
+				continue;
+
+			std::pair<ServerMap::const_iterator, ServerMap::const_iterator> range = servers.equal_range(i->first);
+			for (ServerMap::const_iterator j = range.first; j != range.second; ++j)
+				out.push_back(j->second);
+		}
+	}
+};
+
 /** Handle /WHO.
  */
 class CommandWho : public Command
 {
 	bool CanView(Channel* chan, User* user);
+	bool GetCandidates(User* user, const std::string& matchtext, std::vector<User*>& candidates);
+	void CheckUser(User* user, User* u, const std::vector<std::string>& parms, const std::string& initial, const std::string& matchtext, bool usingwildcards, std::vector<std::string>& whoresults);
 	bool opt_viewopersonly;
 	bool opt_showrealhost;
 	bool opt_realname;
@@ -52,6 +315,9 @@ class CommandWho : public Command
 	}
 
  public:
+	/** Users indexed by host, ident, realname and server */
+	WhoIndex index;
+
 	/** Constructor for who.
 	 */
 	CommandWho(Module* parent)
@@ -59,6 +325,7 @@ class CommandWho : public Command
 		, secretmode(parent, "secret")
 		, privatemode(parent, "private")
 		, invisiblemode(parent, "invisible")
+		, index(parent)
 	{
 		syntax = "<server>|<nickname>|<channel>|<realname>|<host>|0 [ohurmMiaplf]";
 	}
@@ -169,6 +436,77 @@ bool CommandWho::whomatch(User* cuser, User* user, const char* matchtext)
 	}
 }
 
+bool CommandWho::GetCandidates(User* user, const std::string& matchtext, std::vector<User*>& candidates)
+{
+	if (!index.enabled || opt_mode || opt_metadata)
+		return false;
+
+	// whomatch() checks one field selected by the flags, then the displayed host, nick and server
+	if (opt_showrealhost)
+	{
+		if (!index.host.Find(matchtext, candidates))
+			return false;
+	}
+	else if (opt_ident)
+	{
+		if (!index.ident.Find(matchtext, candidates))
+			return false;
+	}
+	else if (opt_realname)
+	{
+		index.CheckNameCaseMap();
+		if (!index.name.Find(matchtext, candidates))
+			return false;
+	}
+	else if (opt_port || opt_away || opt_time)
+		return false;
+
+	if (!index.dhost.Find(matchtext, candidates))
+		return false;
+
+	// Nicks are not indexed, but a mask containing a character no nick can have matches none
+	bool nickpossible = true;
+	for (std::string::const_iterator i = matchtext.begin(); i != matchtext.end(); ++i)
+	{
+		if ((*i != '*') && (*i != '?') && (!ServerInstance->IsNick(std::string("a") + *i)))
+		{
+			nickpossible = false;
+			break;
+		}
+	}
+
+	if (nickpossible)
+	{
+		if (matchtext.find_first_of("*?") != std::string::npos)
+			return false;
+
+		User* target = ServerInstance->FindNickOnly(matchtext);
+		if (target)
+			candidates.push_back(target);
+	}
+
+	if (ServerInstance->Config->HideWhoisServer.empty() || user->HasPrivPermission("users/auspex"))
+		index.FindServers(matchtext, candidates);
+
+	std::sort(candidates.begin(), candidates.end());
+	candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+	return true;
+}
+
+void CommandWho::CheckUser(User* user, User* u, const std::vector<std::string>& parms, const std::string& initial, const std::string& matchtext, bool usingwildcards, std::vector<std::string>& whoresults)
+{
+	if (!whomatch(user, u, matchtext.c_str()))
+		return;
+
+	if (!user->SharesChannelWith(u))
+	{
+		if (usingwildcards && (u->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
+			return;
+	}
+
+	SendWhoLine(user, parms, initial, NULL, u, whoresults);
+}
+
 bool CommandWho::CanView(Channel* chan, User* user)
 {
 	if (!user || !chan)
@@ -353,36 +691,21 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 			/* Showing only opers */
 			const UserManager::OperList& opers = ServerInstance->Users->all_opers;
 			for (UserManager::OperList::const_iterator i = opers.begin(); i != opers.end(); ++i)
-			{
-				User* oper = *i;
-
-				if (whomatch(user, oper, matchtext.c_str()))
-				{
-					if (!user->SharesChannelWith(oper))
-					{
-						if (usingwildcards && (oper->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
-							continue;
-					}
-
-					SendWhoLine(user, parameters, initial, NULL, oper, whoresults);
-				}
-			}
+				CheckUser(user, *i, parameters, initial, matchtext, usingwildcards, whoresults);
 		}
 		else
 		{
-			const user_hash& users = ServerInstance->Users->GetUsers();
-			for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+			std::vector<User*> candidates;
+			if (GetCandidates(user, matchtext, candidates))
 			{
-				if (whomatch(user, i->second, matchtext.c_str()))
-				{
-					if (!user->SharesChannelWith(i->second))
-					{
-						if (usingwildcards && (i->second->IsModeSet(invisiblemode)) && (!user->HasPrivPermission("users/auspex")))
-							continue;
-					}
-
-					SendWhoLine(user, parameters, initial, NULL, i->second, whoresults);
-				}
+				for (std::vector<User*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+					CheckUser(user, *i, parameters, initial, matchtext, usingwildcards, whoresults);
+			}
+			else
+			{
+				const user_hash& users = ServerInstance->Users->GetUsers();
+				for (user_hash::const_iterator i = users.begin(); i != users.end(); ++i)
+					CheckUser(user, i->second, parameters, initial, matchtext, usingwildcards, whoresults);
 			}
 		}
 	}
@@ -394,8 +717,59 @@ CmdResult CommandWho::Handle (const std::vector<std::string>& parameters, User *
 	// Penalize the user a bit for large queries
 	// (add one unit of penalty per 200 results)
 	if (IS_LOCAL(user))
-		IS_LOCAL(user)->CommandFloodPenalty += whoresults.size() * 5;
+		IS_LOCAL(user)->AddPenalty(whoresults.size() * 5);
 	return CMD_SUCCESS;
 }
 
-COMMAND_INIT(CommandWho)
+class CoreModWho : public Module
+{
+	CommandWho cmd;
+
+ public:
+	CoreModWho()
+		: cmd(this)
+	{
+	}
+
+	void ReadConfig(ConfigStatus& status) CXX11_OVERRIDE
+	{
+		cmd.index.SetEnabled(ServerInstance->Config->ConfValue("performance")->getBool("whoindex"));
+	}
+
+	void OnPostConnect(User* user) CXX11_OVERRIDE
+	{
+		cmd.index.Add(user);
+	}
+
+	void OnChangeHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeDisplayedHost(user, newhost);
+	}
+
+	void OnChangeRealHost(User* user, const std::string& newhost) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeRealHost(user);
+	}
+
+	void OnChangeIdent(User* user, const std::string& newident) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeIdent(user, newident);
+	}
+
+	void OnChangeName(User* user, const std::string& gecos) CXX11_OVERRIDE
+	{
+		cmd.index.ChangeName(user, gecos);
+	}
+
+	void OnUserQuit(User* user, const std::string& message, const std::string& oper_message) CXX11_OVERRIDE
+	{
+		cmd.index.Remove(user);
+	}
+
+	Version GetVersion() CXX11_OVERRIDE
+	{
+		return Version("Provides the WHO command", VF_VENDOR|VF_CORE);
+	}
+};
+
+MODULE_INIT(CoreModWho)
@@ -23,198 +23,374 @@
 #include "inspircd.h"
 #include "commands/cmd_whowas.h"
 
-CommandWhowas::CommandWhowas( Module* parent)
-	: Command(parent, "WHOWAS", 1)
-	, GroupSize(0), MaxGroups(0), MaxKeep(0)
+WhoWasStore::WhoWasStore()
+	: tail(0), head(0), wrapped(false), wrapend(0), budget(0), used(0), overhead(0), count(0)
 {
-	syntax = "<nick>{,<nick>}";
-	Penalty = 2;
 }
 
-CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, User* user)
+WhoWasStore::Interned WhoWasStore::Intern(const std::string& str)
 {
-	/* if whowas disabled in config */
-	if (this->GroupSize == 0 || this->MaxGroups == 0)
+	std::pair<InternMap::iterator, bool> ret = interned.insert(std::make_pair(str, 0));
+	if (ret.second)
+		overhead += sizeof(InternMap::value_type) + sizeof(void*) * 2 + str.length();
+	ret.first->second++;
+	return &*ret.first;
+}
+
+void WhoWasStore::Release(Interned str)
+{
+	InternMap::iterator it = interned.find(str->first);
+	if (--it->second == 0)
 	{
-		user->WriteNumeric(ERR_UNKNOWNCOMMAND, "%s :This command has been disabled.", name.c_str());
-		return CMD_FAILURE;
+		overhead -= sizeof(InternMap::value_type) + sizeof(void*) * 2 + it->first.length();
+		interned.erase(it);
 	}
+}
 
-	whowas_users::iterator i = whowas.find(assign(parameters[0]));
-
-	if (i == whowas.end())
+uint32_t WhoWasStore::Allocate(uint32_t size)
+{
+	if (used == 0)
 	{
-		user->WriteNumeric(ERR_WASNOSUCHNICK, "%s :There was no such nickname", parameters[0].c_str());
+		tail = head = 0;
+		wrapped = false;
 	}
-	else
+
+	uint32_t pos = NONE;
+	if (!wrapped)
 	{
-		whowas_set* grp = i->second;
-		if (!grp->empty())
+		if (ring.size() - head >= size)
 		{
-			for (whowas_set::iterator ux = grp->begin(); ux != grp->end(); ux++)
-			{
-				WhoWasGroup* u = *ux;
-
-				user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
-					u->ident.c_str(),u->dhost.c_str(),u->gecos.c_str());
-
-				if (user->HasPrivPermission("users/auspex"))
-					user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
-						parameters[0].c_str(), u->host.c_str());
-
-				std::string signon = InspIRCd::TimeString(u->signon);
-				bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
-				user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->server.c_str()), signon.c_str());
-			}
+			pos = head;
 		}
-		else
+		else if (tail >= size)
 		{
-			user->WriteNumeric(ERR_WASNOSUCHNICK, "%s :There was no such nickname", parameters[0].c_str());
+			// Continue at the start of the ring, the space after head is reclaimed with the records before it
+			wrapped = true;
+			wrapend = head;
+			pos = 0;
 		}
 	}
+	else if (tail - head >= size)
+	{
+		pos = head;
+	}
 
-	user->WriteNumeric(RPL_ENDOFWHOWAS, "%s :End of WHOWAS", parameters[0].c_str());
-	return CMD_SUCCESS;
+	if (pos != NONE)
+		head = pos + size;
+	return pos;
 }
 
-std::string CommandWhowas::GetStats()
+void WhoWasStore::Drop(uint32_t pos)
 {
-	int whowas_size = 0;
-	int whowas_bytes = 0;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	Record* record = At(pos);
+	NickMap::iterator it = nicks.find(std::string(record->GetNick(), record->nicklen));
+	Nick& nick = it->second;
+
+	if (record->newer != NONE)
+		At(record->newer)->older = record->older;
+	else
+		nick.newest = record->older;
+
+	if (record->older != NONE)
+		At(record->older)->newer = record->newer;
+	else
+		nick.oldest = record->newer;
+
+	if (--nick.count == 0)
 	{
-		whowas_set* n = i->second;
-		whowas_size += n->size();
-		whowas_bytes += (sizeof(whowas_set) + ( sizeof(WhoWasGroup) * n->size() ) );
+		overhead -= sizeof(NickMap::value_type) + sizeof(void*) * 2 + it->first.length();
+		nicks.erase(it);
 	}
-	return "Whowas entries: " +ConvToStr(whowas_size)+" ("+ConvToStr(whowas_bytes)+" bytes)";
+
+	Release(record->host);
+	Release(record->dhost);
+	Release(record->server);
+	record->host = record->dhost = record->server = NULL;
+	count--;
 }
 
-void CommandWhowas::AddToWhoWas(User* user)
+void WhoWasStore::EvictOldest()
 {
-	/* if whowas disabled */
-	if (this->GroupSize == 0 || this->MaxGroups == 0)
+	Record* record = At(tail);
+	if (record->host)
+		Drop(tail);
+
+	used -= record->size;
+	tail += record->size;
+	if (wrapped && tail == wrapend)
 	{
-		return;
+		tail = 0;
+		wrapped = false;
 	}
+}
 
-	// Insert nick if it doesn't exist
-	// 'first' will point to the newly inserted element or to the existing element with an equivalent key
-	std::pair<whowas_users::iterator, bool> ret = whowas.insert(std::make_pair(irc::string(user->nick.c_str()), static_cast<whowas_set*>(NULL)));
-
-	if (ret.second) // If inserted
-	{
-		// This nick is new, create a list for it and add the first record to it
-		whowas_set* n = new whowas_set;
-		n->push_back(new WhoWasGroup(user));
-		ret.first->second = n;
+uint32_t WhoWasStore::Place(uint32_t size)
+{
+	if (size > ring.size())
+		return NONE;
 
-		// Add this nick to the fifo too
-		whowas_fifo.push_back(std::make_pair(ServerInstance->Time(), ret.first->first));
+	uint32_t pos;
+	while ((pos = Allocate(size)) == NONE)
+		EvictOldest();
 
-		if (whowas.size() > this->MaxGroups)
-		{
-			// Too many nicks, remove the nick which was inserted the longest time ago from both the map and the fifo
-			whowas_users::iterator it = whowas.find(whowas_fifo.front().second);
-			if (it != whowas.end())
-			{
-				whowas_set* set = it->second;
-				stdalgo::delete_all(*set);
+	used += size;
+	return pos;
+}
 
-				delete set;
-				whowas.erase(it);
-			}
-			whowas_fifo.pop_front();
-		}
+void WhoWasStore::Link(uint32_t pos, unsigned int groupsize)
+{
+	Record* record = At(pos);
+	std::pair<NickMap::iterator, bool> ret = nicks.insert(std::make_pair(std::string(record->GetNick(), record->nicklen), Nick()));
+	Nick& nick = ret.first->second;
+	if (ret.second)
+	{
+		overhead += sizeof(NickMap::value_type) + sizeof(void*) * 2 + record->nicklen;
+		nick.newest = nick.oldest = NONE;
+		nick.count = 0;
 	}
+
+	record->newer = NONE;
+	record->older = nick.newest;
+	if (nick.newest != NONE)
+		At(nick.newest)->newer = pos;
 	else
-	{
-		// We've met this nick before, add a new record to the list
-		whowas_set* set = ret.first->second;
-		set->push_back(new WhoWasGroup(user));
+		nick.oldest = pos;
+	nick.newest = pos;
+	nick.count++;
+	count++;
+
+	// The dropped record keeps its space in the ring until it becomes the oldest one
+	if (nick.count > groupsize)
+		Drop(nick.oldest);
+}
 
-		// If there are too many records for this nick, remove the oldest (front)
-		if (set->size() > this->GroupSize)
-		{
-			delete set->front();
-			set->pop_front();
-		}
-	}
+void WhoWasStore::Add(User* user, unsigned int groupsize)
+{
+	if (!budget)
+		return;
+
+	if (ring.empty())
+		ring.resize(budget);
+
+	const std::string::size_type nicklen = std::min<std::string::size_type>(user->nick.length(), 0xFFFF);
+	const std::string::size_type identlen = std::min<std::string::size_type>(user->ident.length(), 0xFFFF);
+	const std::string::size_type gecoslen = std::min<std::string::size_type>(user->fullname.length(), 0xFFFF);
+
+	// Keep every record aligned for the time_t and pointer fields of the next one
+	const uint32_t size = (sizeof(Record) + nicklen + identlen + gecoslen + 7) & ~7;
+	const uint32_t pos = Place(size);
+	if (pos == NONE)
+		return;
+
+	Record* record = At(pos);
+	record->size = size;
+	record->nicklen = nicklen;
+	record->identlen = identlen;
+	record->gecoslen = gecoslen;
+	record->signon = user->signon;
+	record->quit = ServerInstance->Time();
+	record->host = Intern(user->host);
+	record->dhost = Intern(user->dhost);
+	record->server = Intern(user->server->GetName());
+
+	char* data = &ring[pos + sizeof(Record)];
+	memcpy(data, user->nick.data(), nicklen);
+	memcpy(data + nicklen, user->ident.data(), identlen);
+	memcpy(data + nicklen + identlen, user->fullname.data(), gecoslen);
+
+	Link(pos, groupsize);
+
+	// Make room for the strings and nicks that the new record may have added
+	while ((used + overhead > budget) && (used > 0))
+		EvictOldest();
 }
 
-/* on rehash, refactor maps according to new conf values */
-void CommandWhowas::Prune()
+void WhoWasStore::Find(const std::string& nick, std::vector<const Record*>& out)
+{
+	NickMap::const_iterator it = nicks.find(nick);
+	if (it == nicks.end())
+		return;
+
+	for (uint32_t pos = it->second.oldest; pos != NONE; pos = At(pos)->newer)
+		out.push_back(At(pos));
+}
+
+void WhoWasStore::Expire(time_t before)
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
+	// Records are in the order they were added, so the expired ones are all at the start
+	while (used > 0)
+	{
+		const Record* record = At(tail);
+		if ((record->host) && (record->quit >= before))
+			break;
+		EvictOldest();
+	}
+}
 
-	/* first cut the list to new size (maxgroups) and also prune entries that are timed out. */
-	while (!whowas_fifo.empty())
+void WhoWasStore::SetLimits(size_t newbudget, unsigned int groupsize)
+{
+	if (newbudget != budget)
 	{
-		if ((whowas_fifo.size() > this->MaxGroups) || (whowas_fifo.front().first < min))
+		// Move the records over to a ring of the new size, oldest first
+		std::vector<char> oldring;
+		oldring.swap(ring);
+		const uint32_t oldtail = tail;
+		const uint32_t oldhead = head;
+		const bool oldwrapped = wrapped;
+		const uint32_t oldwrapend = wrapend;
+		const bool hadrecords = (used > 0);
+
+		nicks.clear();
+		tail = head = wrapend = 0;
+		wrapped = false;
+		used = count = 0;
+		overhead = 0;
+		for (InternMap::const_iterator i = interned.begin(); i != interned.end(); ++i)
+			overhead += sizeof(InternMap::value_type) + sizeof(void*) * 2 + i->first.length();
+
+		budget = newbudget;
+		if (budget && hadrecords)
+			ring.resize(budget);
+
+		uint32_t end = (oldwrapped ? oldwrapend : oldhead);
+		bool secondpart = false;
+		for (uint32_t pos = oldtail; hadrecords; )
 		{
-			whowas_users::iterator iter = whowas.find(whowas_fifo.front().second);
-
-			/* hopefully redundant integrity check, but added while debugging r6216 */
-			if (iter == whowas.end())
+			Record* oldrecord = reinterpret_cast<Record*>(&oldring[pos]);
+			const uint32_t size = oldrecord->size;
+			if (oldrecord->host)
 			{
-				/* this should never happen, if it does maps are corrupt */
-				ServerInstance->Logs->Log("WHOWAS", LOG_DEFAULT, "BUG: Whowas maps got corrupted! (1)");
-				return;
+				const uint32_t newpos = (budget ? Place(size) : NONE);
+				if (newpos != NONE)
+				{
+					memcpy(&ring[newpos], oldrecord, size);
+					Link(newpos, groupsize);
+				}
+				else
+				{
+					Release(oldrecord->host);
+					Release(oldrecord->dhost);
+					Release(oldrecord->server);
+				}
 			}
 
-			whowas_set* set = iter->second;
-			stdalgo::delete_all(*set);
+			pos += size;
+			if (pos == end)
+			{
+				if (!oldwrapped || secondpart)
+					break;
 
-			delete set;
-			whowas.erase(iter);
-			whowas_fifo.pop_front();
+				// Continue with the records at the start of the old ring
+				pos = 0;
+				end = oldhead;
+				secondpart = true;
+			}
 		}
-		else
-			break;
+
+		while ((used + overhead > budget) && (used > 0))
+			EvictOldest();
 	}
 
-	/* Then cut the whowas sets to new size (groupsize) */
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	// Drop the oldest records of nicks that have too many
+	for (NickMap::iterator i = nicks.begin(); i != nicks.end(); )
 	{
-		whowas_set* n = i->second;
-		while (n->size() > this->GroupSize)
+		Nick& nick = i->second;
+		if (nick.count <= groupsize)
+		{
+			++i;
+			continue;
+		}
+
+		// Dropping the last record of a nick removes it from the map
+		NickMap::iterator next = i;
+		++next;
+		while (nick.count > groupsize)
 		{
-			delete n->front();
-			n->pop_front();
+			const bool last = (nick.count == 1);
+			Drop(nick.oldest);
+			if (last)
+				break;
 		}
+		i = next;
 	}
 }
 
-/* call maintain once an hour to remove expired nicks */
-void CommandWhowas::Maintain()
+CommandWhowas::CommandWhowas( Module* parent)
+	: Command(parent, "WHOWAS", 1)
+	, GroupSize(0), MaxSize(0), MaxKeep(0)
+{
+	syntax = "<nick>{,<nick>}";
+	Penalty = 2;
+}
+
+CmdResult CommandWhowas::Handle (const std::vector<std::string>& parameters, User* user)
 {
-	time_t min = ServerInstance->Time() - this->MaxKeep;
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
+	/* if whowas disabled in config */
+	if (this->GroupSize == 0 || this->MaxSize == 0)
+	{
+		user->WriteNumeric(ERR_UNKNOWNCOMMAND, "%s :This command has been disabled.", name.c_str());
+		return CMD_FAILURE;
+	}
+
+	std::vector<const WhoWasStore::Record*> records;
+	store.Find(parameters[0], records);
+
+	if (records.empty())
+	{
+		user->WriteNumeric(ERR_WASNOSUCHNICK, "%s :There was no such nickname", parameters[0].c_str());
+	}
+	else
 	{
-		whowas_set* set = i->second;
-		while (!set->empty() && set->front()->signon < min)
+		for (std::vector<const WhoWasStore::Record*>::const_iterator ux = records.begin(); ux != records.end(); ++ux)
 		{
-			delete set->front();
-			set->pop_front();
+			const WhoWasStore::Record* u = *ux;
+			const std::string ident(u->GetIdent(), u->identlen);
+			const std::string gecos(u->GetGecos(), u->gecoslen);
+
+			user->WriteNumeric(RPL_WHOWASUSER, "%s %s %s * :%s", parameters[0].c_str(),
+				ident.c_str(), u->GetDisplayedHost().c_str(), gecos.c_str());
+
+			if (user->HasPrivPermission("users/auspex"))
+				user->WriteNumeric(RPL_WHOWASIP, "%s :was connecting from *@%s",
+					parameters[0].c_str(), u->GetHost().c_str());
+
+			std::string signon = InspIRCd::TimeString(u->signon);
+			bool hide_server = (!ServerInstance->Config->HideWhoisServer.empty() && !user->HasPrivPermission("servers/auspex"));
+			user->WriteNumeric(RPL_WHOISSERVER, "%s %s :%s", parameters[0].c_str(), (hide_server ? ServerInstance->Config->HideWhoisServer.c_str() : u->GetServer().c_str()), signon.c_str());
 		}
 	}
+
+	user->WriteNumeric(RPL_ENDOFWHOWAS, "%s :End of WHOWAS", parameters[0].c_str());
+	return CMD_SUCCESS;
 }
 
-CommandWhowas::~CommandWhowas()
+std::string CommandWhowas::GetStats()
 {
-	for (whowas_users::iterator i = whowas.begin(); i != whowas.end(); ++i)
-	{
-		whowas_set* set = i->second;
-		for (whowas_set::iterator j = set->begin(); j != set->end(); ++j)
-			delete *j;
+	return "Whowas entries: " + ConvToStr(store.GetCount()) + " (" + ConvToStr(store.GetUsage()) + " of " + ConvToStr(this->MaxSize) + " bytes)";
+}
 
-		delete set;
+void CommandWhowas::AddToWhoWas(User* user)
+{
+	/* if whowas disabled */
+	if (this->GroupSize == 0 || this->MaxSize == 0)
+	{
+		return;
 	}
+
+	store.Add(user, this->GroupSize);
+}
+
+/* on rehash, refactor the store according to new conf values */
+void CommandWhowas::Prune()
+{
+	store.SetLimits((this->GroupSize ? this->MaxSize : 0), this->GroupSize);
+	Maintain();
 }
 
-WhoWasGroup::WhoWasGroup(User* user) : host(user->host), dhost(user->dhost), ident(user->ident),
-	server(user->server->GetName()), gecos(user->fullname), signon(user->signon)
+/* call maintain once an hour to remove expired nicks */
+void CommandWhowas::Maintain()
 {
+	store.Expire(ServerInstance->Time() - this->MaxKeep);
 }
 
 class ModuleWhoWas : public Module
@@ -249,14 +425,32 @@ class ModuleWhoWas : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("whowas");
 		unsigned int NewGroupSize = tag->getInt("groupsize", 10, 0, 10000);
-		unsigned int NewMaxGroups = tag->getInt("maxgroups", 10240, 0, 1000000);
+		unsigned int NewMaxSize = tag->getInt("maxsize", 4194304, 0, 1073741824);
 		unsigned int NewMaxKeep = tag->getDuration("maxkeep", 3600, 3600);
 
-		if ((NewGroupSize == cmd.GroupSize) && (NewMaxGroups == cmd.MaxGroups) && (NewMaxKeep == cmd.MaxKeep))
+		// <whowas:maxgroups> limited the number of nicks, if there is no byte budget
+		// derive one from it, estimating the size of a record with a typical nick,
+		// ident and real name
+		std::string maxgroups;
+		if (tag->readString("maxgroups", maxgroups))
+		{
+			std::string maxsize;
+			if (!tag->readString("maxsize", maxsize))
+			{
+				const unsigned long estimate = sizeof(WhoWasStore::Record) + 64;
+				const unsigned long groups = std::max(ConvToInt(maxgroups), 0L);
+				const unsigned long bytes = groups * std::max(NewGroupSize, 1U) * estimate;
+				NewMaxSize = std::min(bytes, 1073741824UL);
+			}
+
+			ServerInstance->Logs->Log("CONFIG", LOG_DEFAULT, "WARNING: <whowas:maxgroups> is deprecated, the whowas list is now limited to <whowas:maxsize> bytes (%u). Replace maxgroups with maxsize in your configuration.", NewMaxSize);
+		}
+
+		if ((NewGroupSize == cmd.GroupSize) && (NewMaxSize == cmd.MaxSize) && (NewMaxKeep == cmd.MaxKeep))
 			return;
 
 		cmd.GroupSize = NewGroupSize;
-		cmd.MaxGroups = NewMaxGroups;
+		cmd.MaxSize = NewMaxSize;
 		cmd.MaxKeep = NewMaxKeep;
 		cmd.Prune();
 	}
@@ -625,7 +625,7 @@ void InspIRCd::UpdateTime()
 	GetSystemTime(&st);
 
 	TIME.tv_sec = time(NULL);
-	TIME.tv_nsec = st.wMilliseconds;
+	TIME.tv_nsec = st.wMilliseconds * 1000000;
 #else
 	#ifdef HAS_CLOCK_GETTIME
 		clock_gettime(CLOCK_REALTIME, &TIME);
@@ -716,8 +716,8 @@ void InspIRCd::Run()
 				FOREACH_MOD(OnGarbageCollect, ());
 			}
 
-			Timers.TickTimers(TIME.tv_sec);
 			Users->DoBackgroundUserStuff();
+			XLines->ExpireLines();
 
 			if ((TIME.tv_sec % 5) == 0)
 			{
@@ -726,6 +726,9 @@ void InspIRCd::Run()
 			}
 		}
 
+		/* Timers have millisecond resolution, so check them on every iteration */
+		Timers.TickTimers(TimerManager::Now());
+
 		/* Call the socket engine to wait on the active
 		 * file descriptors. The socket engine has everything's
 		 * descriptors in its list... dns, modules, users,
@@ -148,19 +148,40 @@ CullResult StreamSocket::cull()
 	return EventHandler::cull();
 }
 
+void StreamSocket::CompactRecvQ()
+{
+	if (recvq_head >= recvq.length())
+		recvq.clear();
+	else if (recvq_head)
+		recvq.erase(0, recvq_head);
+	recvq_head = 0;
+}
+
 bool StreamSocket::GetNextLine(std::string& line, char delim)
 {
-	std::string::size_type i = recvq.find(delim);
-	if (i == std::string::npos)
+	const char* eol = NULL;
+	if (recvq_head < recvq.length())
+		eol = static_cast<const char*>(memchr(recvq.data() + recvq_head, delim, recvq.length() - recvq_head));
+
+	if (!eol)
+	{
+		// No complete line left, get rid of everything consumed so far
+		CompactRecvQ();
 		return false;
-	line = recvq.substr(0, i);
-	// TODO is this the most efficient way to split?
-	recvq = recvq.substr(i + 1);
+	}
+
+	const std::string::size_type len = eol - (recvq.data() + recvq_head);
+	line.assign(recvq, recvq_head, len);
+	recvq_head += len + 1;
 	return true;
 }
 
 void StreamSocket::DoRead()
 {
+	// If the previous reader stopped before draining the recvq, drop the
+	// consumed data now so it never reaches OnDataReady() again
+	CompactRecvQ();
+
 	if (GetIOHook())
 	{
 		int rv = -1;
@@ -216,6 +237,13 @@ void StreamSocket::DoRead()
 	}
 }
 
+void StreamSocket::RequeueFront(std::string& data)
+{
+	SendBuffer* buf = new SendBuffer;
+	buf->data.swap(data);
+	sendq.push_front(buf);
+}
+
 /* Don't try to prepare huge blobs of data to send to a blocked socket */
 static const int MYIOV_MAX = IOV_MAX < 128 ? IOV_MAX : 128;
 
@@ -229,8 +257,10 @@ void StreamSocket::DoWrite()
 		return;
 	}
 
+	IOHook* const hook = (GetIOHook() && !GetIOHook()->passthroughwrite) ? GetIOHook() : NULL;
+
 #ifndef DISABLE_WRITEV
-	if (GetIOHook())
+	if (hook)
 #endif
 	{
 		int rv = -1;
@@ -238,34 +268,45 @@ void StreamSocket::DoWrite()
 		{
 			while (error.empty() && !sendq.empty())
 			{
-				if (sendq.size() > 1 && sendq[0].length() < 1024)
+				// Queued buffers may be shared with other sockets, so hand the IOHook
+				// its own copy of the data it may modify, unless nobody else holds a
+				// reference to the first buffer. Small buffers are merged up to the
+				// configured write buffer size to avoid multiple repeated SSL encryption
+				// invocations. This adds a single copy of the queue, but avoids much
+				// more overhead in terms of system calls invoked by the IOHook.
+				//
+				// The length limit is to prevent merging strings more than once
+				// when writes begin to block. Setting writebuffersize to 0 only turns
+				// off merging in the sendq, IOHooks still get at least 1024 bytes here.
+				const std::string::size_type mergemax = std::max<std::string::size_type>(ServerInstance->Config->WriteBufferSize, 1024);
+				std::string front;
+				SendBuffer* first = sendq.front();
+				if (first->GetReferenceCount() == 1)
+				{
+					front.swap(first->data);
+					front.erase(0, sendq_head);
+				}
+				else
+					front.assign(first->GetData(), sendq_head, std::string::npos);
+				sendq.pop_front();
+				sendq_head = 0;
+				if (front.length() < mergemax && !sendq.empty())
 				{
-					// Avoid multiple repeated SSL encryption invocations
-					// This adds a single copy of the queue, but avoids
-					// much more overhead in terms of system calls invoked
-					// by the IOHook.
-					//
-					// The length limit of 1024 is to prevent merging strings
-					// more than once when writes begin to block.
-					std::string tmp;
-					tmp.reserve(1280);
-					while (!sendq.empty() && tmp.length() < 1024)
+					front.reserve(mergemax + 256);
+					while (!sendq.empty() && front.length() < mergemax)
 					{
-						tmp.append(sendq.front());
+						front.append(sendq.front()->GetData());
 						sendq.pop_front();
 					}
-					sendq.push_front(tmp);
 				}
-				std::string& front = sendq.front();
 				int itemlen = front.length();
-				if (GetIOHook())
+				if (hook)
 				{
-					rv = GetIOHook()->OnStreamSocketWrite(this, front);
+					rv = hook->OnStreamSocketWrite(this, front);
 					if (rv > 0)
 					{
 						// consumed the entire string, and is ready for more
 						sendq_len -= itemlen;
-						sendq.pop_front();
 					}
 					else if (rv == 0)
 					{
@@ -274,10 +315,12 @@ void StreamSocket::DoWrite()
 
 						// Since it is possible that a partial write took place, adjust sendq_len
 						sendq_len = sendq_len - itemlen + front.length();
+						RequeueFront(front);
 						return;
 					}
 					else
 					{
+						RequeueFront(front);
 						SetError("Write Error"); // will not overwrite a better error message
 						return;
 					}
@@ -288,11 +331,13 @@ void StreamSocket::DoWrite()
 					rv = SocketEngine::Send(this, front.data(), itemlen, 0);
 					if (rv == 0)
 					{
+						RequeueFront(front);
 						SetError("Connection closed");
 						return;
 					}
 					else if (rv < 0)
 					{
+						RequeueFront(front);
 						if (errno == EINTR || SocketEngine::IgnoreError())
 							SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
 						else
@@ -302,14 +347,14 @@ void StreamSocket::DoWrite()
 					else if (rv < itemlen)
 					{
 						SocketEngine::ChangeEventMask(this, FD_WANT_FAST_WRITE | FD_WRITE_WILL_BLOCK);
-						front = front.substr(rv);
+						RequeueFront(front);
+						sendq_head = rv;
 						sendq_len -= rv;
 						return;
 					}
 					else
 					{
 						sendq_len -= itemlen;
-						sendq.pop_front();
 						if (sendq.empty())
 							SocketEngine::ChangeEventMask(this, FD_WANT_EDGE_WRITE);
 					}
@@ -343,26 +388,29 @@ void StreamSocket::DoWrite()
 			}
 
 			int rv_max = 0;
-			iovec* iovecs = new iovec[bufcount];
+			iovec iovecs[MYIOV_MAX];
 			for(int i=0; i < bufcount; i++)
 			{
-				iovecs[i].iov_base = const_cast<char*>(sendq[i].data());
-				iovecs[i].iov_len = sendq[i].length();
-				rv_max += sendq[i].length();
+				const std::string& elem = sendq[i]->GetData();
+				// the first buffer may have been partially written already
+				size_t skip = (i == 0 ? sendq_head : 0);
+				iovecs[i].iov_base = const_cast<char*>(elem.data() + skip);
+				iovecs[i].iov_len = elem.length() - skip;
+				rv_max += iovecs[i].iov_len;
 			}
 			int rv = writev(fd, iovecs, bufcount);
-			delete[] iovecs;
 
 			if (rv == (int)sendq_len)
 			{
 				// it's our lucky day, everything got written out. Fast cleanup.
 				// This won't ever happen if the number of buffers got capped.
 				sendq_len = 0;
+				sendq_head = 0;
 				sendq.clear();
 			}
 			else if (rv > 0)
 			{
-				// Partial write. Clean out strings from the sendq
+				// Partial write. Clean out buffers from the sendq
 				if (rv < rv_max)
 				{
 					// it's going to block now
@@ -371,17 +419,18 @@ void StreamSocket::DoWrite()
 				sendq_len -= rv;
 				while (rv > 0 && !sendq.empty())
 				{
-					std::string& front = sendq.front();
-					if (front.length() <= (size_t)rv)
+					size_t remaining = sendq.front()->length() - sendq_head;
+					if (remaining <= (size_t)rv)
 					{
-						// this string got fully written out
-						rv -= front.length();
+						// this buffer got fully written out
+						rv -= remaining;
+						sendq_head = 0;
 						sendq.pop_front();
 					}
 					else
 					{
-						// stopped in the middle of this string
-						front = front.substr(rv);
+						// stopped in the middle of this buffer
+						sendq_head += rv;
 						rv = 0;
 					}
 				}
@@ -426,13 +475,56 @@ void StreamSocket::WriteData(const std::string &data)
 		return;
 	}
 
-	/* Append the data to the back of the queue ready for writing */
-	sendq.push_back(data);
-	sendq_len += data.length();
+	if (!CoalesceWrite(data))
+	{
+		/* Start a new buffer at the back of the queue which later small writes can be appended to */
+		sendq.push_back(new SendBuffer(data));
+		sendq_len += data.length();
+	}
+
+	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
+}
+
+void StreamSocket::WriteData(const reference<SendBuffer>& data)
+{
+	if (fd < 0)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to write data to dead socket: %s",
+			data->GetData().c_str());
+		return;
+	}
+
+	// A buffer which is also queued on other sockets is queued by reference rather than
+	// copied, only one nobody else holds is small enough to be worth merging
+	if ((data->GetReferenceCount() != 1) || (!CoalesceWrite(data->GetData())))
+	{
+		/* Append the buffer to the back of the queue ready for writing */
+		sendq.push_back(data);
+		sendq_len += data->length();
+	}
 
 	SocketEngine::ChangeEventMask(this, FD_ADD_TRIAL_WRITE);
 }
 
+bool StreamSocket::CoalesceWrite(const std::string& data)
+{
+	if (sendq.empty())
+		return false;
+
+	// A buffer referenced by other sockets (or by a message still being sent out) must not change
+	const std::string::size_type mergemax = ServerInstance->Config->WriteBufferSize;
+	SendBuffer* tail = sendq.back();
+	if (tail->GetReferenceCount() != 1 || tail->length() + data.length() > mergemax)
+		return false;
+
+	// Buffers are created at their exact size, the first merge makes room for the ones after it
+	if (tail->data.capacity() < tail->length() + data.length())
+		tail->data.reserve(mergemax);
+	tail->data.append(data);
+	sendq_len += data.length();
+	return true;
+}
+
 bool SocketTimeout::Tick(time_t)
 {
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "SocketTimeout::Tick");
@@ -174,6 +174,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 		{
 			// And now add the mask onto the list...
 			cd->list.push_back(ListItem(parameter, source->nick, ServerInstance->Time()));
+			channel->InvalidateBanCache();
 			return MODEACTION_ALLOW;
 		}
 		else
@@ -192,6 +193,7 @@ ModeAction ListModeBase::OnModeChange(User* source, User*, Channel* channel, std
 				if (parameter == it->mask)
 				{
 					cd->list.erase(it);
+					channel->InvalidateBanCache();
 					return MODEACTION_ALLOW;
 				}
 			}
@@ -120,6 +120,7 @@ bool ModuleManager::Load(const std::string& filename, bool defer)
 
 	FOREACH_MOD(OnLoadModule, (newmod));
 	PrioritizeHooks();
+	Channel::InvalidateAllBanCaches();
 	ServerInstance->ISupport.Build();
 	return true;
 }
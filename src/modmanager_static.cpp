@@ -126,6 +126,7 @@ bool ModuleManager::Load(const std::string& name, bool defer)
 
 	FOREACH_MOD(OnLoadModule, (mod));
 	PrioritizeHooks();
+	Channel::InvalidateAllBanCaches();
 	ServerInstance->ISupport.Build();
 	return true;
 }
@@ -36,6 +36,10 @@
 	#include <dirent.h>
 #endif
 
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
 static intrusive_list<dynamic_reference_base>* dynrefs = NULL;
 static bool dynref_init_complete = false;
 
@@ -67,13 +71,14 @@ void Event::Send()
 
 // These declarations define the behavours of the base class Module (which does nothing at all)
 
-Module::Module() { }
+Module::Module() : HookProfiles(NULL) { }
 CullResult Module::cull()
 {
 	return classbase::cull();
 }
 Module::~Module()
 {
+	delete[] HookProfiles;
 }
 
 void Module::DetachEvent(Implementation i)
@@ -147,7 +152,7 @@ ModResult	Module::OnChannelPreDelete(Channel*) { DetachEvent(I_OnChannelPreDelet
 void		Module::OnChannelDelete(Channel*) { DetachEvent(I_OnChannelDelete); }
 ModResult	Module::OnSetAway(User*, const std::string &) { DetachEvent(I_OnSetAway); return MOD_RES_PASSTHRU; }
 ModResult	Module::OnWhoisLine(User*, User*, int&, std::string&) { DetachEvent(I_OnWhoisLine); return MOD_RES_PASSTHRU; }
-void		Module::OnBuildNeighborList(User*, IncludeChanList&, std::map<User*,bool>&) { DetachEvent(I_OnBuildNeighborList); }
+void		Module::OnBuildNeighborList(User*, IncludeChanList&, NeighborExceptions&) { DetachEvent(I_OnBuildNeighborList); }
 void		Module::OnGarbageCollect() { DetachEvent(I_OnGarbageCollect); }
 ModResult	Module::OnSetConnectClass(LocalUser* user, ConnectClass* myclass) { DetachEvent(I_OnSetConnectClass); return MOD_RES_PASSTHRU; }
 void 		Module::OnText(User*, void*, int, const std::string&, char, CUList&) { DetachEvent(I_OnText); }
@@ -156,6 +161,8 @@ ModResult	Module::OnNumeric(User*, unsigned int, const std::string&) { DetachEve
 ModResult   Module::OnAcceptConnection(int, ListenSocket*, irc::sockets::sockaddrs*, irc::sockets::sockaddrs*) { DetachEvent(I_OnAcceptConnection); return MOD_RES_PASSTHRU; }
 void		Module::OnSendWhoLine(User*, const std::vector<std::string>&, User*, Membership*, std::string&) { DetachEvent(I_OnSendWhoLine); }
 void		Module::OnSetUserIP(LocalUser*) { DetachEvent(I_OnSetUserIP); }
+void		Module::OnSendQDrained(LocalUser*) { DetachEvent(I_OnSendQDrained); }
+void		Module::OnChangeRealHost(User*, const std::string&) { DetachEvent(I_OnChangeRealHost); }
 
 #ifdef INSPIRCD_ENABLE_TESTSUITE
 void		Module::OnRunTestSuite() { }
@@ -187,6 +194,59 @@ ModuleManager::~ModuleManager()
 {
 }
 
+/** Names of the hooks in the order of Implementation, starting after I_BEGIN */
+static const char* const HookNames[] = {
+	"OnUserConnect", "OnUserQuit", "OnUserDisconnect", "OnUserJoin", "OnUserPart", "OnSendSnotice",
+	"OnUserPreJoin", "OnUserPreKick", "OnUserKick", "OnOper", "OnInfo", "OnWhois", "OnUserPreInvite",
+	"OnUserInvite", "OnUserPreMessage", "OnUserPreNick", "OnUserMessage", "OnMode", "OnSyncUser",
+	"OnSyncChannel", "OnDecodeMetaData", "OnAcceptConnection", "OnUserInit", "OnChangeHost",
+	"OnChangeName", "OnAddLine", "OnDelLine", "OnExpireLine", "OnUserPostNick", "OnPreMode",
+	"On005Numeric", "OnKill", "OnLoadModule", "OnUnloadModule", "OnBackgroundTimer", "OnPreCommand",
+	"OnCheckReady", "OnCheckInvite", "OnRawMode", "OnCheckKey", "OnCheckLimit", "OnCheckBan",
+	"OnCheckChannelBan", "OnExtBanCheck", "OnStats", "OnChangeLocalUserHost", "OnPreTopicChange",
+	"OnPostTopicChange", "OnEvent", "OnGlobalOper", "OnPostConnect", "OnChangeLocalUserGECOS",
+	"OnUserRegister", "OnChannelPreDelete", "OnChannelDelete", "OnPostOper", "OnSyncNetwork",
+	"OnSetAway", "OnPostCommand", "OnPostJoin", "OnWhoisLine", "OnBuildNeighborList",
+	"OnGarbageCollect", "OnSetConnectClass", "OnText", "OnPassCompare", "OnNamesListItem",
+	"OnNumeric", "OnPreRehash", "OnModuleRehash", "OnSendWhoLine", "OnChangeIdent", "OnSetUserIP",
+	"OnSendQDrained", "OnChangeRealHost"
+};
+
+// Fails to compile if a hook was added to Implementation without adding its name above
+typedef char HookNamesComplete[(sizeof(HookNames) / sizeof(*HookNames) == I_END - 1) ? 1 : -1];
+
+const char* ModuleManager::GetHookName(Implementation i)
+{
+	if ((i <= I_BEGIN) || (i >= I_END))
+		return "unknown";
+	return HookNames[i - 1];
+}
+
+unsigned long long ModuleManager::GetCycles()
+{
+#if defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined _MSC_VER
+	return __rdtsc();
+#else
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void ModuleManager::RecordHook(Module* mod, Implementation i, unsigned long long cycles)
+{
+	if (!mod->HookProfiles)
+		mod->HookProfiles = new HookProfile[I_END];
+
+	HookProfile& profile = mod->HookProfiles[i];
+	profile.calls++;
+	profile.cycles += cycles;
+	if (cycles > profile.maxcycles)
+		profile.maxcycles = cycles;
+}
+
 bool ModuleManager::Attach(Implementation i, Module* mod)
 {
 	if (std::find(EventHandlers[i].begin(), EventHandlers[i].end(), mod) != EventHandlers[i].end())
@@ -440,6 +500,7 @@ void ModuleManager::DoSafeUnload(Module* mod)
 	dynamic_reference_base::reset_all();
 
 	DetachAll(mod);
+	Channel::InvalidateAllBanCaches();
 
 	Modules.erase(modfind);
 	ServerInstance->GlobalCulls.AddItem(mod);
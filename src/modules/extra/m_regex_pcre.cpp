@@ -55,6 +55,11 @@ class PCRERegex : public Regex
 	{
 		return (pcre_exec(regex, NULL, text.c_str(), text.length(), 0, 0, NULL, 0) >= 0);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		return ExtractLiteral(regex_string);
+	}
 };
 
 class PCREFactory : public RegexFactory
@@ -27,8 +27,11 @@ class POSIXRegex : public Regex
 {
 	regex_t regbuf;
 
+	/** True if the regex was compiled as a basic regex */
+	const bool basic;
+
  public:
-	POSIXRegex(const std::string& rx, bool extended) : Regex(rx)
+	POSIXRegex(const std::string& rx, bool extended) : Regex(rx), basic(!extended)
 	{
 		int flags = (extended ? REG_EXTENDED : 0) | REG_NOSUB;
 		int errcode;
@@ -58,6 +61,11 @@ class POSIXRegex : public Regex
 	{
 		return (regexec(&regbuf, text.c_str(), 0, NULL, 0) == 0);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		return ExtractLiteral(regex_string, basic);
+	}
 };
 
 class PosixFactory : public RegexFactory
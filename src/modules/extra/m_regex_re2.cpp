@@ -25,6 +25,7 @@
 #include "inspircd.h"
 #include "modules/regex.h"
 #include <re2/re2.h>
+#include <re2/set.h>
 
 
 /* $CompileFlags: -std=c++11 */
@@ -47,6 +48,76 @@ class RE2Regex : public Regex
 	{
 		return RE2::FullMatch(text, regexcl);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		return ExtractLiteral(regex_string);
+	}
+};
+
+/** All regexes compiled into one automaton which finds every match in a single pass */
+class RE2RegexSet : public RegexSet
+{
+	RE2::Set set;
+	std::vector<int> matches;
+
+	/** The regexes, owned by the creator of the set, for when the automaton fails */
+	std::vector<Regex*> regexes;
+
+	/** True once running out of memory has been logged */
+	bool warned;
+
+	static RE2::Options GetOptions()
+	{
+		RE2::Options options(RE2::Quiet);
+		// The DFA of a set of many regexes needs far more than the default budget of one regex
+		options.set_max_mem(64 << 20);
+		return options;
+	}
+
+ public:
+	RE2RegexSet(const std::vector<Regex*>& rxs)
+		: set(GetOptions(), RE2::ANCHOR_BOTH), regexes(rxs), warned(false)
+	{
+		for (std::vector<Regex*>::const_iterator i = regexes.begin(); i != regexes.end(); ++i)
+		{
+			std::string error;
+			if (set.Add((*i)->GetRegexString(), &error) < 0)
+				throw RegexException((*i)->GetRegexString(), error);
+		}
+
+		if (!set.Compile())
+			throw ModuleException("Unable to compile the regex set, it is too large");
+	}
+
+	void Match(const std::string& text, std::vector<size_t>& out) CXX11_OVERRIDE
+	{
+		matches.clear();
+		RE2::Set::ErrorInfo error;
+		if (!set.Match(text, &matches, &error))
+		{
+			if (error.kind == RE2::Set::kNoError)
+				return;
+
+			// The automaton gave up, usually because the DFA ran out of memory, so
+			// a failure says nothing about the regexes and each has to be tried
+			if (!warned)
+			{
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Regex set failed to match (error %d), matching regexes separately", (int)error.kind);
+				warned = true;
+			}
+
+			for (size_t i = 0; i < regexes.size(); i++)
+			{
+				if (regexes[i]->Matches(text))
+					out.push_back(i);
+			}
+			return;
+		}
+
+		std::sort(matches.begin(), matches.end());
+		out.insert(out.end(), matches.begin(), matches.end());
+	}
 };
 
 class RE2Factory : public RegexFactory
@@ -57,6 +128,19 @@ class RE2Factory : public RegexFactory
 	{
 		return new RE2Regex(expr);
 	}
+
+	RegexSet* CreateSet(const std::vector<Regex*>& regexes) CXX11_OVERRIDE
+	{
+		try
+		{
+			return new RE2RegexSet(regexes);
+		}
+		catch (ModuleException& e)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Falling back to matching regexes separately: " + e.GetReason());
+			return RegexFactory::CreateSet(regexes);
+		}
+	}
 };
 
 class ModuleRegexRE2 : public Module
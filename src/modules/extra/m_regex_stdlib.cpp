@@ -26,8 +26,12 @@ class StdRegex : public Regex
 {
 	std::regex regexcl;
 
+	/** True if the regex uses the POSIX basic syntax */
+	const bool basic;
+
  public:
-	StdRegex(const std::string& rx, std::regex::flag_type fltype) : Regex(rx)
+	StdRegex(const std::string& rx, std::regex::flag_type fltype)
+		: Regex(rx), basic((fltype & (std::regex::basic | std::regex::grep)) != 0)
 	{
 		try{
 			regexcl.assign(rx, fltype | std::regex::optimize);
@@ -42,6 +46,11 @@ class StdRegex : public Regex
 	{
 		return std::regex_search(text, regexcl);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		return ExtractLiteral(regex_string, basic);
+	}
 };
 
 class StdRegexFactory : public RegexFactory
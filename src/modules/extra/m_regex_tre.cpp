@@ -61,6 +61,11 @@ public:
 	{
 		return (regexec(&regbuf, text.c_str(), 0, NULL, 0) == 0);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		return ExtractLiteral(regex_string);
+	}
 };
 
 class TREFactory : public RegexFactory
@@ -27,6 +27,7 @@
 #include "modules/ssl.h"
 #include "modules/cap.h"
 #include <memory>
+#include <list>
 
 #if ((GNUTLS_VERSION_MAJOR > 2) || (GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR > 9) || (GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR == 9 && GNUTLS_VERSION_PATCH >= 8))
 #define GNUTLS_HAS_MAC_GET_ID
@@ -39,6 +40,15 @@
 # include <gcrypt.h>
 #endif
 
+#if (GNUTLS_VERSION_MAJOR > 2 || GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR >= 10)
+# define GNUTLS_HAS_SESSION_TICKETS
+#endif
+
+// TLS 1.3 clients get their session ticket after the handshake
+#if (GNUTLS_VERSION_MAJOR > 3 || GNUTLS_VERSION_MAJOR == 3 && (GNUTLS_VERSION_MINOR > 6 || GNUTLS_VERSION_MINOR == 6 && GNUTLS_VERSION_PATCH >= 5))
+# define GNUTLS_HAS_TLS13
+#endif
+
 #ifdef _WIN32
 # pragma comment(lib, "libgnutls.lib")
 # pragma comment(lib, "libgcrypt.lib")
@@ -71,6 +81,16 @@ typedef gnutls_dh_params_t gnutls_dh_params;
 
 enum issl_status { ISSL_NONE, ISSL_HANDSHAKING_READ, ISSL_HANDSHAKING_WRITE, ISSL_HANDSHAKEN, ISSL_CLOSING, ISSL_CLOSED };
 
+/** Get the address of the remote end of a connected socket, or an empty string if it is unknown */
+static std::string GetPeerAddress(StreamSocket* sock)
+{
+	irc::sockets::sockaddrs sa;
+	socklen_t len = sizeof(sa);
+	if (getpeername(sock->GetFd(), &sa.sa, &len) != 0)
+		return "";
+	return sa.str();
+}
+
 #if (GNUTLS_VERSION_MAJOR > 2 || (GNUTLS_VERSION_MAJOR == 2 && GNUTLS_VERSION_MINOR >= 12))
 #define GNUTLS_NEW_CERT_CALLBACK_API
 typedef gnutls_retr2_st cert_cb_last_param_type;
@@ -446,6 +466,254 @@ namespace GnuTLS
 		}
 	};
 
+	/** Number of full and resumed handshakes */
+	struct HandshakeCounter
+	{
+		unsigned long full;
+		unsigned long resumed;
+
+		HandshakeCounter()
+			: full(0)
+			, resumed(0)
+		{
+		}
+
+		void Add(bool isresumed)
+		{
+			if (isresumed)
+				resumed++;
+			else
+				full++;
+		}
+
+		std::string ToString() const
+		{
+			const unsigned long total = full + resumed;
+			return ConvToStr(full) + " full, " + ConvToStr(resumed) + " resumed (" + ConvToStr(total ? resumed * 100 / total : 0) + "%)";
+		}
+	};
+
+	/** Session resumption state of a profile: the session cache, the ticket key,
+	 * saved outbound sessions and counters. It is handed over to the profile with
+	 * the same name when the profiles are read again, so it survives a rehash.
+	 */
+	class SessionState : public refcountbase
+	{
+		typedef std::list<std::string> CacheOrder;
+
+		struct CacheEntry
+		{
+			std::string data;
+			time_t expires;
+
+			/** Position of the session id in cacheorder
+			 */
+			CacheOrder::iterator order;
+		};
+
+		typedef std::map<std::string, CacheEntry> SessionCache;
+
+		/** Sessions of inbound connections by session id, for clients which resume without a ticket
+		 */
+		SessionCache cache;
+
+		/** Ids of the sessions in the cache, least recently stored first, these are dropped first when the cache is full
+		 */
+		CacheOrder cacheorder;
+
+		/** Remove a session from both the cache and cacheorder
+		 */
+		void EraseSession(SessionCache::iterator it)
+		{
+			cacheorder.erase(it->second.order);
+			cache.erase(it);
+		}
+
+		/** Sessions of outbound connections, by the address of the remote end
+		 */
+		std::map<std::string, std::string> clientsessions;
+
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+		/** The key session tickets are sealed with, GnuTLS only accepts tickets sealed with the current key
+		 */
+		gnutls_datum_t ticketkey;
+
+		/** Time the ticket key was made
+		 */
+		time_t ticketkeycreated;
+
+		/** Make a new ticket key if the current one is older than the rotation interval
+		 * @return True if there is a usable ticket key
+		 */
+		bool UpdateTicketKey()
+		{
+			const time_t now = ServerInstance->Time();
+			if ((ticketkey.data) && (now < ticketkeycreated + ticketrotate))
+				return true;
+
+			gnutls_datum_t newkey;
+			if (gnutls_session_ticket_key_generate(&newkey) < 0)
+				return (ticketkey.data != NULL);
+
+			// A session takes a single ticket key, so the old one cannot be kept for decrypting
+			// tickets issued before the rotation; their clients do a full handshake instead
+			FreeTicketKey();
+			ticketkey = newkey;
+			ticketkeycreated = now;
+			return true;
+		}
+
+		void FreeTicketKey()
+		{
+			if (!ticketkey.data)
+				return;
+			memset(ticketkey.data, 0, ticketkey.size);
+			gnutls_free(ticketkey.data);
+			ticketkey.data = NULL;
+		}
+#endif
+
+		static int StoreCallback(void* ptr, gnutls_datum_t key, gnutls_datum_t data)
+		{
+			SessionState* state = static_cast<SessionState*>(ptr);
+			const std::string id(reinterpret_cast<const char*>(key.data), key.size);
+
+			std::pair<SessionCache::iterator, bool> ret = state->cache.insert(std::make_pair(id, CacheEntry()));
+			CacheEntry& entry = ret.first->second;
+			entry.data.assign(reinterpret_cast<const char*>(data.data), data.size);
+			entry.expires = ServerInstance->Time() + state->timeout;
+
+			// A session stored again moves to the back rather than being listed twice
+			if (ret.second)
+				entry.order = state->cacheorder.insert(state->cacheorder.end(), id);
+			else
+				state->cacheorder.splice(state->cacheorder.end(), state->cacheorder, entry.order);
+
+			while (state->cache.size() > state->cachesize)
+				state->EraseSession(state->cache.find(state->cacheorder.front()));
+			return 0;
+		}
+
+		static gnutls_datum_t RetrieveCallback(void* ptr, gnutls_datum_t key)
+		{
+			SessionState* state = static_cast<SessionState*>(ptr);
+			gnutls_datum_t ret = { NULL, 0 };
+
+			SessionCache::iterator it = state->cache.find(std::string(reinterpret_cast<const char*>(key.data), key.size));
+			if (it == state->cache.end())
+				return ret;
+
+			if (it->second.expires <= ServerInstance->Time())
+			{
+				state->EraseSession(it);
+				return ret;
+			}
+
+			// GnuTLS frees the returned data with gnutls_free()
+			ret.data = static_cast<unsigned char*>(gnutls_malloc(it->second.data.length()));
+			if (ret.data)
+			{
+				memcpy(ret.data, it->second.data.data(), it->second.data.length());
+				ret.size = it->second.data.length();
+			}
+			return ret;
+		}
+
+		static int RemoveCallback(void* ptr, gnutls_datum_t key)
+		{
+			SessionState* state = static_cast<SessionState*>(ptr);
+			SessionCache::iterator it = state->cache.find(std::string(reinterpret_cast<const char*>(key.data), key.size));
+			if (it != state->cache.end())
+				state->EraseSession(it);
+			return 0;
+		}
+
+	 public:
+		/** Maximum number of sessions in the session cache, 0 if it is disabled
+		 */
+		unsigned long cachesize;
+
+		/** Seconds a session can be resumed for
+		 */
+		unsigned int timeout;
+
+		/** True to issue session tickets to clients
+		 */
+		bool tickets;
+
+		/** Seconds between two ticket key rotations
+		 */
+		time_t ticketrotate;
+
+		HandshakeCounter inbound;
+		HandshakeCounter outbound;
+
+		SessionState()
+			: cachesize(0)
+			, timeout(3600)
+			, tickets(false)
+			, ticketrotate(3600)
+		{
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			ticketkey.data = NULL;
+			ticketkey.size = 0;
+			ticketkeycreated = 0;
+#endif
+		}
+
+		~SessionState()
+		{
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			FreeTicketKey();
+#endif
+		}
+
+		/** Let a server session be resumed from the cache or a ticket
+		 */
+		void SetupServerSession(gnutls_session_t sess)
+		{
+			if (cachesize)
+			{
+				gnutls_db_set_ptr(sess, this);
+				gnutls_db_set_store_function(sess, StoreCallback);
+				gnutls_db_set_retrieve_function(sess, RetrieveCallback);
+				gnutls_db_set_remove_function(sess, RemoveCallback);
+			}
+			gnutls_db_set_cache_expiration(sess, timeout);
+
+#ifdef GNUTLS_HAS_SESSION_TICKETS
+			if ((tickets) && (UpdateTicketKey()))
+				gnutls_session_ticket_enable_server(sess, &ticketkey);
+#endif
+		}
+
+		/** Offer the session of the last connection to the same address in a client session
+		 */
+		void SetupClientSession(gnutls_session_t sess, const std::string& peer)
+		{
+#if defined GNUTLS_HAS_SESSION_TICKETS && GNUTLS_VERSION_MAJOR < 3
+			gnutls_session_ticket_enable_client(sess);
+#endif
+			std::map<std::string, std::string>::const_iterator it = clientsessions.find(peer);
+			if (it != clientsessions.end())
+				gnutls_session_set_data(sess, it->second.data(), it->second.length());
+		}
+
+		/** Save the session of an outbound connection for resuming it the next time
+		 */
+		void SaveClientSession(gnutls_session_t sess, const std::string& peer)
+		{
+			gnutls_datum_t data;
+			if (gnutls_session_get_data2(sess, &data) < 0)
+				return;
+
+			clientsessions[peer].assign(reinterpret_cast<const char*>(data.data), data.size);
+			gnutls_free(data.data);
+		}
+
+		size_t GetCachedSessions() const { return cache.size(); }
+	};
+
 	class Profile : public refcountbase
 	{
 		/** Name of this profile
@@ -468,14 +736,20 @@ namespace GnuTLS
 		 */
 		Priority priority;
 
+		/** Session cache, ticket key, outbound sessions and handshake counters
+		 */
+		reference<SessionState> sessions;
+
 		Profile(const std::string& profilename, const std::string& certstr, const std::string& keystr,
 				std::auto_ptr<DHParams>& DH, unsigned int mindh, const std::string& hashstr,
-				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL)
+				const std::string& priostr, std::auto_ptr<X509CertList>& CA, std::auto_ptr<X509CRL>& CRL,
+				SessionState* sessionstate)
 			: name(profilename)
 			, x509cred(certstr, keystr)
 			, min_dh_bits(mindh)
 			, hash(hashstr)
 			, priority(priostr)
+			, sessions(sessionstate)
 		{
 			x509cred.SetDH(DH);
 			x509cred.SetCA(CA, CRL);
@@ -491,7 +765,7 @@ namespace GnuTLS
 		}
 
 	 public:
-		static reference<Profile> Create(const std::string& profilename, ConfigTag* tag)
+		static reference<Profile> Create(const std::string& profilename, ConfigTag* tag, SessionState* oldsessions)
 		{
 			std::string certstr = ReadFile(tag->getString("certfile", "cert.pem"));
 			std::string keystr = ReadFile(tag->getString("keyfile", "key.pem"));
@@ -524,7 +798,19 @@ namespace GnuTLS
 					crl.reset(new X509CRL(ReadFile(filename)));
 			}
 
-			return new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl);
+			// Session resumption, for clients with the session cache or tickets and for outbound links by saving their sessions
+			unsigned long cachesize = tag->getInt("sessioncache", 20480, 0);
+			unsigned int timeout = tag->getDuration("sessiontimeout", 3600, 1);
+			bool tickets = tag->getBool("tickets", true);
+			time_t ticketrotate = tag->getDuration("ticketrotate", timeout, 60);
+
+			reference<SessionState> sessions = (oldsessions ? oldsessions : new SessionState);
+			reference<Profile> profile = new Profile(profilename, certstr, keystr, dh, mindh, hashstr, priostr, ca, crl, sessions);
+			sessions->cachesize = cachesize;
+			sessions->timeout = timeout;
+			sessions->tickets = tickets;
+			sessions->ticketrotate = ticketrotate;
+			return profile;
 		}
 
 		/** Set up the given session with the settings in this profile
@@ -539,6 +825,16 @@ namespace GnuTLS
 		const std::string& GetName() const { return name; }
 		X509Credentials& GetX509Credentials() { return x509cred; }
 		gnutls_digest_algorithm_t GetHash() const { return hash.get(); }
+		SessionState* GetSessionState() { return sessions; }
+
+		/** Write the handshake counters and cache usage of this profile to a STATS reply
+		 */
+		void GetStats(const std::string& prefix, string_list& results)
+		{
+			results.push_back(prefix + "inbound handshakes: " + sessions->inbound.ToString());
+			results.push_back(prefix + "outbound handshakes: " + sessions->outbound.ToString());
+			results.push_back(prefix + "session cache: " + ConvToStr(sessions->GetCachedSessions()) + " of " + ConvToStr(sessions->cachesize) + " entries used");
+		}
 	};
 }
 
@@ -549,6 +845,14 @@ class GnuTLSIOHook : public SSLIOHook
 	issl_status status;
 	reference<GnuTLS::Profile> profile;
 
+	/** Address of the remote end of an outbound connection, its session is saved under this
+	 */
+	std::string peer;
+
+	/** True once the session of an outbound connection was saved
+	 */
+	bool sessionsaved;
+
 	void InitSession(StreamSocket* user, bool me_server)
 	{
 		gnutls_init(&sess, me_server ? GNUTLS_SERVER : GNUTLS_CLIENT);
@@ -559,7 +863,32 @@ class GnuTLSIOHook : public SSLIOHook
 		gnutls_transport_set_pull_function(sess, gnutls_pull_wrapper);
 
 		if (me_server)
+		{
 			gnutls_certificate_server_set_request(sess, GNUTLS_CERT_REQUEST); // Request client certificate if any.
+			profile->GetSessionState()->SetupServerSession(sess);
+		}
+		else
+		{
+			peer = GetPeerAddress(user);
+			if (!peer.empty())
+				profile->GetSessionState()->SetupClientSession(sess, peer);
+		}
+	}
+
+	/** Save the session of an outbound connection once it can be resumed
+	 */
+	void SaveSession()
+	{
+		if ((peer.empty()) || (sessionsaved))
+			return;
+
+#ifdef GNUTLS_HAS_TLS13
+		if ((gnutls_protocol_get_version(sess) == GNUTLS_TLS1_3) && (!(gnutls_session_get_flags(sess) & GNUTLS_SFLAGS_SESSION_TICKET)))
+			return;
+#endif
+
+		profile->GetSessionState()->SaveClientSession(sess, peer);
+		sessionsaved = true;
 	}
 
 	void CloseSession()
@@ -613,6 +942,10 @@ class GnuTLSIOHook : public SSLIOHook
 
 			VerifyCertificate();
 
+			GnuTLS::SessionState* sessions = profile->GetSessionState();
+			(peer.empty() ? sessions->inbound : sessions->outbound).Add(gnutls_session_is_resumed(sess));
+			SaveSession();
+
 			// Finish writing, if any left
 			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
 
@@ -795,6 +1128,7 @@ info_done_dealloc:
 		, sess(NULL)
 		, status(ISSL_NONE)
 		, profile(sslprofile)
+		, sessionsaved(false)
 	{
 		InitSession(sock, outbound);
 		sock->AddIOHook(this);
@@ -837,6 +1171,7 @@ info_done_dealloc:
 			if (ret > 0)
 			{
 				recvq.append(buffer, ret);
+				SaveSession();
 				return 1;
 			}
 			else if (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED)
@@ -978,6 +1313,8 @@ class GnuTLSIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new GnuTLSIOHook(this, sock, false, profile);
 	}
+
+	GnuTLS::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLGnuTLS : public Module
@@ -989,6 +1326,19 @@ class ModuleSSLGnuTLS : public Module
 	RandGen randhandler;
 	ProfileList profiles;
 
+	/** Get the session state of the current profile with the given name, or NULL if there is no such profile
+	 */
+	GnuTLS::SessionState* GetSessionState(const std::string& name)
+	{
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			GnuTLS::Profile* profile = (*i)->GetProfile();
+			if (profile->GetName() == name)
+				return profile->GetSessionState();
+		}
+		return NULL;
+	}
+
 	void ReadProfiles()
 	{
 		// First, store all profiles in a new, temporary container. If no problems occur, swap the two
@@ -1006,7 +1356,7 @@ class ModuleSSLGnuTLS : public Module
 
 			try
 			{
-				reference<GnuTLS::Profile> profile(GnuTLS::Profile::Create(defname, tag));
+				reference<GnuTLS::Profile> profile(GnuTLS::Profile::Create(defname, tag, GetSessionState(defname)));
 				newprofiles.push_back(new GnuTLSIOHookProvider(this, profile));
 			}
 			catch (CoreException& ex)
@@ -1031,7 +1381,7 @@ class ModuleSSLGnuTLS : public Module
 			reference<GnuTLS::Profile> profile;
 			try
 			{
-				profile = GnuTLS::Profile::Create(name, tag);
+				profile = GnuTLS::Profile::Create(name, tag, GetSessionState(name));
 			}
 			catch (CoreException& ex)
 			{
@@ -1080,6 +1430,17 @@ class ModuleSSLGnuTLS : public Module
 		ServerInstance->GenRandom = &ServerInstance->HandleGenRandom;
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'r')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+			(*i)->GetProfile()->GetStats("304 " + user->nick + " :SSLSTATS " + (*i)->name + " ", results);
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnCleanup(int target_type, void* item) CXX11_OVERRIDE
 	{
 		if(target_type == TYPE_USER)
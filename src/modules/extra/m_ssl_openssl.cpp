@@ -34,8 +34,16 @@
 #include "iohook.h"
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/rand.h>
 #include "modules/ssl.h"
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+# include <openssl/core_names.h>
+# define OPENSSL_TICKET_EVP_MAC
+#else
+# include <openssl/hmac.h>
+#endif
+
 #ifdef _WIN32
 # pragma comment(lib, "libcrypto.lib")
 # pragma comment(lib, "libssl.lib")
@@ -61,6 +69,17 @@ char* get_error()
 }
 
 static int OnVerify(int preverify_ok, X509_STORE_CTX* ctx);
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* session);
+
+/** Get the address of the remote end of a connected socket, or an empty string if it is unknown */
+static std::string GetPeerAddress(StreamSocket* sock)
+{
+	irc::sockets::sockaddrs sa;
+	socklen_t len = sizeof(sa);
+	if (getpeername(sock->GetFd(), &sa.sa, &len) != 0)
+		return "";
+	return sa.str();
+}
 
 namespace OpenSSL
 {
@@ -99,6 +118,199 @@ namespace OpenSSL
 		}
 	};
 
+	/** Keys which session tickets are sealed with. A new key is made every rotation
+	 * interval; tickets sealed with the key before it are still accepted during the
+	 * next interval. Every resumed client is given a new ticket.
+	 */
+	class TicketKeys
+	{
+		struct Key
+		{
+			unsigned char name[16];
+			unsigned char aes[32];
+			unsigned char hmac[32];
+		};
+
+		/** The current key and the one before it */
+		Key keys[2];
+
+		/** True if keys[1] holds a key which can still be used for opening tickets */
+		bool hasprevious;
+
+		/** Time the current key was made, 0 if there is none */
+		time_t created;
+
+		/** Make a new current key if the current one is older than the rotation interval
+		 * @return True if there is a usable current key
+		 */
+		bool Update()
+		{
+			const time_t now = ServerInstance->Time();
+			if ((created) && (now < created + interval))
+				return true;
+
+			hasprevious = ((created) && (now < created + 2 * interval));
+			if (hasprevious)
+				keys[1] = keys[0];
+
+			if (RAND_bytes(reinterpret_cast<unsigned char*>(&keys[0]), sizeof(keys[0])) != 1)
+			{
+				created = 0;
+				return false;
+			}
+			created = now;
+			return true;
+		}
+
+#ifdef OPENSSL_TICKET_EVP_MAC
+		typedef EVP_MAC_CTX MACContext;
+
+		static bool InitMAC(MACContext* macctx, unsigned char* key)
+		{
+			OSSL_PARAM params[3];
+			params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, 32);
+			params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+			params[2] = OSSL_PARAM_construct_end();
+			return EVP_MAC_CTX_set_params(macctx, params);
+		}
+#else
+		typedef HMAC_CTX MACContext;
+
+		static bool InitMAC(MACContext* macctx, unsigned char* key)
+		{
+			return HMAC_Init_ex(macctx, key, 32, EVP_sha256(), NULL);
+		}
+#endif
+
+	 public:
+		/** Seconds between two key rotations */
+		time_t interval;
+
+		TicketKeys()
+			: hasprevious(false)
+			, created(0)
+			, interval(3600)
+		{
+		}
+
+		~TicketKeys()
+		{
+			OPENSSL_cleanse(keys, sizeof(keys));
+		}
+
+		/** Called by OpenSSL to seal (enc = 1) or open (enc = 0) a ticket, the
+		 * TicketKeys object is the app data of the SSL_CTX
+		 */
+		static int Callback(SSL* ssl, unsigned char* keyname, unsigned char* iv, EVP_CIPHER_CTX* cipherctx, MACContext* macctx, int enc)
+		{
+			TicketKeys* tickets = static_cast<TicketKeys*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+			if (!tickets->Update())
+				return -1;
+
+			if (enc)
+			{
+				Key& key = tickets->keys[0];
+				memcpy(keyname, key.name, sizeof(key.name));
+				if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+					return -1;
+				if ((!EVP_EncryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, key.aes, iv)) || (!InitMAC(macctx, key.hmac)))
+					return -1;
+				return 1;
+			}
+
+			Key* key = &tickets->keys[0];
+			if (memcmp(keyname, key->name, sizeof(key->name)))
+			{
+				key = &tickets->keys[1];
+				if ((!tickets->hasprevious) || (memcmp(keyname, key->name, sizeof(key->name))))
+					return 0;
+			}
+
+			if ((!InitMAC(macctx, key->hmac)) || (!EVP_DecryptInit_ex(cipherctx, EVP_aes_256_cbc(), NULL, key->aes, iv)))
+				return -1;
+
+			// Always have a new ticket issued: a TLS 1.3 client only gets one after resuming if we ask
+			// for it, and tickets sealed with the previous key have to be replaced anyway
+			return 2;
+		}
+	};
+
+	/** Number of full and resumed handshakes */
+	struct HandshakeCounter
+	{
+		unsigned long full;
+		unsigned long resumed;
+
+		HandshakeCounter()
+			: full(0)
+			, resumed(0)
+		{
+		}
+
+		void Add(bool isresumed)
+		{
+			if (isresumed)
+				resumed++;
+			else
+				full++;
+		}
+
+		std::string ToString() const
+		{
+			const unsigned long total = full + resumed;
+			return ConvToStr(full) + " full, " + ConvToStr(resumed) + " resumed (" + ConvToStr(total ? resumed * 100 / total : 0) + "%)";
+		}
+	};
+
+	/** Session resumption state of a profile. It is handed over to the profile
+	 * with the same name when the profiles are read again, so ticket keys, saved
+	 * outbound sessions and counters survive a rehash.
+	 */
+	class SessionState : public refcountbase
+	{
+		typedef std::map<std::string, SSL_SESSION*> ClientSessionMap;
+
+		/** Sessions of outbound connections, by the address of the remote end */
+		ClientSessionMap clientsessions;
+
+	 public:
+		TicketKeys tickets;
+		HandshakeCounter inbound;
+		HandshakeCounter outbound;
+
+		/** Number of connections whose writes were offloaded to kernel TLS */
+		unsigned long kerneltls;
+
+		SessionState()
+			: kerneltls(0)
+		{
+		}
+
+		~SessionState()
+		{
+			for (ClientSessionMap::iterator i = clientsessions.begin(); i != clientsessions.end(); ++i)
+				SSL_SESSION_free(i->second);
+		}
+
+		/** Remember the session of an outbound connection, taking over the reference passed in */
+		void SetClientSession(const std::string& peer, SSL_SESSION* session)
+		{
+			std::pair<ClientSessionMap::iterator, bool> ret = clientsessions.insert(std::make_pair(peer, session));
+			if (!ret.second)
+			{
+				SSL_SESSION_free(ret.first->second);
+				ret.first->second = session;
+			}
+		}
+
+		/** Get the last session to a remote end, or NULL if there is none */
+		SSL_SESSION* GetClientSession(const std::string& peer) const
+		{
+			ClientSessionMap::const_iterator it = clientsessions.find(peer);
+			return (it != clientsessions.end() ? it->second : NULL);
+		}
+	};
+
 	class Context
 	{
 		SSL_CTX* const ctx;
@@ -144,6 +356,54 @@ namespace OpenSSL
 			return SSL_CTX_load_verify_locations(ctx, filename.c_str(), 0);
 		}
 
+		/** Set up the session id cache of a server context
+		 * @param size Maximum number of sessions to keep, 0 to disable the cache
+		 * @param timeout Seconds a session (or ticket) can be resumed for
+		 */
+		void SetSessionCache(long size, long timeout)
+		{
+			SSL_CTX_set_session_cache_mode(ctx, size ? SSL_SESS_CACHE_SERVER : SSL_SESS_CACHE_OFF);
+			SSL_CTX_sess_set_cache_size(ctx, size);
+			SSL_CTX_set_timeout(ctx, timeout);
+		}
+
+		/** Issue session tickets sealed with the given keys, or none if keys is NULL */
+		void SetTicketKeys(TicketKeys* keys)
+		{
+			if (!keys)
+			{
+				SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+				return;
+			}
+
+			SSL_CTX_set_app_data(ctx, keys);
+#ifdef OPENSSL_TICKET_EVP_MAC
+			SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, TicketKeys::Callback);
+#else
+			SSL_CTX_set_tlsext_ticket_key_cb(ctx, TicketKeys::Callback);
+#endif
+		}
+
+		/** Have OpenSSL hand the sessions of a client context to OnNewClientSession() */
+		void SetClientSessionCallback()
+		{
+			SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+			SSL_CTX_sess_set_new_cb(ctx, OnNewClientSession);
+		}
+
+#ifdef SSL_OP_ENABLE_KTLS
+		/** Let OpenSSL hand the record encryption of established connections to the kernel where it can */
+		void EnableKernelTLS()
+		{
+			SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+		}
+#endif
+
+		long GetCachedSessions()
+		{
+			return SSL_CTX_sess_number(ctx);
+		}
+
 		SSL* CreateSession()
 		{
 			return SSL_new(ctx);
@@ -169,6 +429,18 @@ namespace OpenSSL
 		 */
 		const EVP_MD* digest;
 
+		/** Ticket keys, outbound sessions and handshake counters
+		 */
+		reference<SessionState> sessions;
+
+		/** Maximum number of sessions in the session id cache of ctx
+		 */
+		long sessioncache;
+
+		/** True if kernel TLS offload was requested
+		 */
+		bool kerneltls;
+
 		/** Last error, set by error_callback()
 		 */
 		std::string lasterr;
@@ -181,11 +453,12 @@ namespace OpenSSL
 		}
 
 	 public:
-		Profile(const std::string& profilename, ConfigTag* tag)
+		Profile(const std::string& profilename, ConfigTag* tag, SessionState* oldsessions)
 			: name(profilename)
 			, dh(ServerInstance->Config->Paths.PrependConfig(tag->getString("dhfile", "dh.pem")))
 			, ctx(SSL_CTX_new(SSLv23_server_method()))
 			, clictx(SSL_CTX_new(SSLv23_client_method()))
+			, sessions(oldsessions ? oldsessions : new SessionState)
 		{
 			if ((!ctx.SetDH(dh)) || (!clictx.SetDH(dh)))
 				throw Exception("Couldn't set DH parameters");
@@ -229,12 +502,45 @@ namespace OpenSSL
 				ERR_print_errors_cb(error_callback, this);
 				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Can't read CA list from %s. This is only a problem if you want to verify client certificates, otherwise it's safe to ignore this message. Error: %s", filename.c_str(), lasterr.c_str());
 			}
+
+			// Session resumption, for clients with the session id cache or tickets and for outbound links by saving their sessions
+			sessioncache = tag->getInt("sessioncache", 20480, 0);
+			const long sessiontimeout = tag->getDuration("sessiontimeout", 3600, 1);
+			ctx.SetSessionCache(sessioncache, sessiontimeout);
+			clictx.SetSessionCache(0, sessiontimeout);
+			clictx.SetClientSessionCallback();
+
+			sessions->tickets.interval = tag->getDuration("ticketrotate", sessiontimeout, 60);
+			ctx.SetTicketKeys(tag->getBool("tickets", true) ? &sessions->tickets : NULL);
+
+			// OpenSSL only uses kernel TLS when the kernel supports the negotiated cipher, other connections are unaffected
+			kerneltls = tag->getBool("ktls");
+			if (kerneltls)
+			{
+#ifdef SSL_OP_ENABLE_KTLS
+				ctx.EnableKernelTLS();
+				clictx.EnableKernelTLS();
+#else
+				ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Kernel TLS was enabled in profile %s but OpenSSL is too old to support it", name.c_str());
+#endif
+			}
 		}
 
 		const std::string& GetName() const { return name; }
 		SSL* CreateServerSession() { return ctx.CreateSession(); }
 		SSL* CreateClientSession() { return clictx.CreateSession(); }
 		const EVP_MD* GetDigest() { return digest; }
+		SessionState* GetSessionState() { return sessions; }
+
+		/** Write the handshake counters and cache usage of this profile to a STATS reply */
+		void GetStats(const std::string& prefix, string_list& results)
+		{
+			results.push_back(prefix + "inbound handshakes: " + sessions->inbound.ToString());
+			results.push_back(prefix + "outbound handshakes: " + sessions->outbound.ToString());
+			results.push_back(prefix + "session cache: " + ConvToStr(ctx.GetCachedSessions()) + " of " + ConvToStr(sessioncache) + " entries used");
+			if (kerneltls)
+				results.push_back(prefix + "kernel TLS: " + ConvToStr(sessions->kerneltls) + " connections offloaded");
+		}
 	};
 }
 
@@ -261,6 +567,14 @@ class OpenSSLIOHook : public SSLIOHook
 	bool data_to_write;
 	reference<OpenSSL::Profile> profile;
 
+	/** True if the kernel encrypts the records written to this connection
+	 */
+	bool kernelsend;
+
+	/** Address of the remote end of an outbound connection, its session is saved under this
+	 */
+	std::string peer;
+
 	bool Handshake(StreamSocket* user)
 	{
 		int ret;
@@ -298,6 +612,12 @@ class OpenSSLIOHook : public SSLIOHook
 			// Handshake complete.
 			VerifyCertificate();
 
+			OpenSSL::SessionState* sessions = profile->GetSessionState();
+			(outbound ? sessions->outbound : sessions->inbound).Add(SSL_session_reused(sess));
+#ifdef SSL_OP_ENABLE_KTLS
+			CheckKernelTLS();
+#endif
+
 			status = ISSL_OPEN;
 
 			SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE | FD_ADD_TRIAL_WRITE);
@@ -313,6 +633,23 @@ class OpenSSLIOHook : public SSLIOHook
 		return true;
 	}
 
+#ifdef SSL_OP_ENABLE_KTLS
+	/** Let the socket bypass this hook for writing if the kernel took over the record encryption
+	 */
+	void CheckKernelTLS()
+	{
+		// Writes bypass the hook once nothing is left half written through SSL_write()
+		kernelsend = BIO_get_ktls_send(SSL_get_wbio(sess));
+		if (kernelsend)
+			profile->GetSessionState()->kerneltls++;
+		passthroughwrite = ((kernelsend) && (!data_to_write));
+
+		// Reads always go through SSL_read(), even if the kernel decrypts the records. A plain
+		// recv() fails with EIO on records which are not application data, such as alerts,
+		// session tickets and the KeyUpdate messages either side may send at any time.
+	}
+#endif
+
 	void CloseSession()
 	{
 		if (sess)
@@ -386,12 +723,23 @@ class OpenSSLIOHook : public SSLIOHook
 		, outbound(is_outbound)
 		, data_to_write(false)
 		, profile(sslprofile)
+		, kernelsend(false)
 	{
 		if (sess == NULL)
 			return;
 		if (SSL_set_fd(sess, sock->GetFd()) == 0)
 			throw ModuleException("Can't set fd with SSL_set_fd: " + ConvToStr(sock->GetFd()));
 
+		if (outbound)
+		{
+			// Offer the session of the last connection to the same address, new sessions are passed to SaveSession()
+			peer = GetPeerAddress(sock);
+			SSL_set_app_data(sess, this);
+			SSL_SESSION* lastsession = (peer.empty() ? NULL : profile->GetSessionState()->GetClientSession(peer));
+			if (lastsession)
+				SSL_set_session(sess, lastsession);
+		}
+
 		sock->AddIOHook(this);
 		Handshake(sock);
 	}
@@ -495,6 +843,7 @@ class OpenSSLIOHook : public SSLIOHook
 			if (ret == (int)buffer.length())
 			{
 				data_to_write = false;
+				passthroughwrite = kernelsend;
 				SocketEngine::ChangeEventMask(user, FD_WANT_POLL_READ | FD_WANT_NO_WRITE);
 				return 1;
 			}
@@ -545,8 +894,25 @@ class OpenSSLIOHook : public SSLIOHook
 			user->WriteNotice(text);
 		}
 	}
+
+	/** Save a session of this outbound connection for resuming it the next time
+	 * @return True if the session was saved and its reference taken over
+	 */
+	bool SaveSession(SSL_SESSION* session)
+	{
+		if (peer.empty())
+			return false;
+		profile->GetSessionState()->SetClientSession(peer, session);
+		return true;
+	}
 };
 
+static int OnNewClientSession(SSL* ssl, SSL_SESSION* session)
+{
+	OpenSSLIOHook* hook = static_cast<OpenSSLIOHook*>(SSL_get_app_data(ssl));
+	return ((hook) && (hook->SaveSession(session)));
+}
+
 class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 {
 	reference<OpenSSL::Profile> profile;
@@ -573,6 +939,8 @@ class OpenSSLIOHookProvider : public refcountbase, public IOHookProvider
 	{
 		new OpenSSLIOHook(this, sock, true, profile->CreateClientSession(), profile);
 	}
+
+	OpenSSL::Profile* GetProfile() { return profile; }
 };
 
 class ModuleSSLOpenSSL : public Module
@@ -581,6 +949,19 @@ class ModuleSSLOpenSSL : public Module
 
 	ProfileList profiles;
 
+	/** Get the session state of the current profile with the given name, or NULL if there is no such profile
+	 */
+	OpenSSL::SessionState* GetSessionState(const std::string& name)
+	{
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+		{
+			OpenSSL::Profile* profile = (*i)->GetProfile();
+			if (profile->GetName() == name)
+				return profile->GetSessionState();
+		}
+		return NULL;
+	}
+
 	void ReadProfiles()
 	{
 		ProfileList newprofiles;
@@ -594,7 +975,7 @@ class ModuleSSLOpenSSL : public Module
 
 			try
 			{
-				reference<OpenSSL::Profile> profile(new OpenSSL::Profile(defname, tag));
+				reference<OpenSSL::Profile> profile(new OpenSSL::Profile(defname, tag, GetSessionState(defname)));
 				newprofiles.push_back(new OpenSSLIOHookProvider(this, profile));
 			}
 			catch (OpenSSL::Exception& ex)
@@ -619,7 +1000,7 @@ class ModuleSSLOpenSSL : public Module
 			reference<OpenSSL::Profile> profile;
 			try
 			{
-				profile = new OpenSSL::Profile(name, tag);
+				profile = new OpenSSL::Profile(name, tag, GetSessionState(name));
 			}
 			catch (CoreException& ex)
 			{
@@ -667,6 +1048,17 @@ class ModuleSSLOpenSSL : public Module
 			static_cast<OpenSSLIOHook*>(hook)->TellCiphersAndFingerprint(user);
 	}
 
+	ModResult OnStats(char symbol, User* user, string_list& results) CXX11_OVERRIDE
+	{
+		if (symbol != 'r')
+			return MOD_RES_PASSTHRU;
+
+		for (ProfileList::iterator i = profiles.begin(); i != profiles.end(); ++i)
+			(*i)->GetProfile()->GetStats("304 " + user->nick + " :SSLSTATS " + (*i)->name + " ", results);
+
+		return MOD_RES_PASSTHRU;
+	}
+
 	void OnCleanup(int target_type, void* item) CXX11_OVERRIDE
 	{
 		if (target_type == TYPE_USER)
@@ -88,7 +88,7 @@ class ModuleBanException : public Module
 
 		for (ListModeBase::ModeList::iterator it = list->begin(); it != list->end(); it++)
 		{
-			if (chan->CheckBan(user, it->mask))
+			if (chan->CheckBan(user, it->GetBanMask()))
 			{
 				// They match an entry on the list, so let them in.
 				return MOD_RES_ALLOW;
@@ -22,20 +22,193 @@
 struct HistoryItem
 {
 	time_t ts;
+
+	/** The line as sent to clients, including the CR/LF */
 	std::string line;
-	HistoryItem(const std::string& Line) : ts(ServerInstance->Time()), line(Line) {}
+
+	HistoryItem() : ts(0) { }
+};
+
+class HistoryList;
+
+/** Accounts for the memory used by the history of every channel and evicts
+ * from the least recently used channel when it goes over the budget. Only the
+ * accounting is shared, every ring and line is still allocated on its own.
+ */
+class HistoryBudget
+{
+ public:
+	typedef std::list<HistoryList*> LRUList;
+
+	/** Channels which have lines, the most recently written to first */
+	LRUList lru;
+
+	/** Bytes used by the rings and the lines in them */
+	size_t used;
+
+	/** Most bytes to use, 0 for no limit */
+	size_t maxsize;
+
+	HistoryBudget() : used(0), maxsize(0) { }
+
+	/** Drop the oldest lines of the least recently used channels until the usage is within the budget */
+	void Trim();
 };
 
-struct HistoryList
+/** History of one channel, a ring of maxlen slots which is allocated when the first line is added */
+class HistoryList
 {
-	std::deque<HistoryItem> lines;
+	HistoryBudget& budget;
+
+	/** Slots of the ring, empty while there are no lines */
+	std::vector<HistoryItem> ring;
+
+	/** Position of the oldest line in the ring */
+	size_t first;
+
+	/** Number of lines in the ring */
+	size_t count;
+
+	/** Position of this list in HistoryBudget::lru, valid while ring is not empty */
+	HistoryBudget::LRUList::iterator lrupos;
+
+	HistoryItem& At(size_t n) { return ring[(first + n) % ring.size()]; }
+
+ public:
 	unsigned int maxlen, maxtime;
 	std::string param;
 
-	HistoryList(unsigned int len, unsigned int time, const std::string& oparam)
-		: maxlen(len), maxtime(time), param(oparam) { }
+	HistoryList(HistoryBudget& Budget, unsigned int len, unsigned int time, const std::string& oparam)
+		: budget(Budget), first(0), count(0), maxlen(len), maxtime(time), param(oparam) { }
+
+	~HistoryList()
+	{
+		Release();
+	}
+
+	/** Free the ring, the list takes no memory from the budget afterwards */
+	void Release()
+	{
+		if (ring.empty())
+			return;
+
+		for (size_t i = 0; i < count; i++)
+			budget.used -= At(i).line.length();
+		budget.used -= ring.size() * sizeof(HistoryItem);
+		budget.lru.erase(lrupos);
+		std::vector<HistoryItem>().swap(ring);
+		first = count = 0;
+	}
+
+	/** Drop the oldest line
+	 * @return False if there were no lines
+	 */
+	bool DropOldest()
+	{
+		if (!count)
+			return false;
+
+		HistoryItem& item = At(0);
+		budget.used -= item.line.length();
+		std::string().swap(item.line);
+		first = (first + 1) % ring.size();
+		count--;
+		return true;
+	}
+
+	/** Add a line, dropping lines that are too old or do not fit
+	 * @param line The line including the CR/LF
+	 */
+	void Add(const std::string& line)
+	{
+		if (maxtime)
+		{
+			const time_t mintime = ServerInstance->Time() - maxtime;
+			while ((count) && (At(0).ts < mintime))
+				DropOldest();
+		}
+
+		if (ring.empty())
+		{
+			ring.resize(maxlen);
+			budget.used += ring.size() * sizeof(HistoryItem);
+			budget.lru.push_front(this);
+			lrupos = budget.lru.begin();
+		}
+		else
+		{
+			budget.lru.splice(budget.lru.begin(), budget.lru, lrupos);
+		}
+
+		if (count == ring.size())
+			DropOldest();
+
+		HistoryItem& item = At(count++);
+		item.ts = ServerInstance->Time();
+		item.line = line;
+		budget.used += line.length();
+		budget.Trim();
+	}
+
+	/** Change the number of lines kept, keeping the newest ones */
+	void Resize(unsigned int len)
+	{
+		maxlen = len;
+		if ((ring.empty()) || (ring.size() == len))
+			return;
+
+		while (count > len)
+			DropOldest();
+
+		std::vector<HistoryItem> newring(len);
+		for (size_t i = 0; i < count; i++)
+		{
+			newring[i].ts = At(i).ts;
+			newring[i].line.swap(At(i).line);
+		}
+
+		budget.used -= ring.size() * sizeof(HistoryItem);
+		budget.used += newring.size() * sizeof(HistoryItem);
+		ring.swap(newring);
+		first = 0;
+	}
+
+	/** Send the lines newer than a time to a user, all in one write
+	 * @return Number of lines sent
+	 */
+	size_t Replay(LocalUser* user, time_t mintime)
+	{
+		size_t start = 0;
+		while ((start < count) && (At(start).ts < mintime))
+			start++;
+		if (start == count)
+			return 0;
+
+		size_t length = 0;
+		for (size_t i = start; i < count; i++)
+			length += At(i).line.length();
+
+		std::string batch;
+		batch.reserve(length);
+		for (size_t i = start; i < count; i++)
+			batch.append(At(i).line);
+
+		user->Write(reference<SendBuffer>(new SendBuffer(batch)));
+		return count - start;
+	}
 };
 
+void HistoryBudget::Trim()
+{
+	while ((maxsize) && (used > maxsize) && (!lru.empty()))
+	{
+		// A channel whose lines are all gone gives up its ring too
+		HistoryList* list = lru.back();
+		if (!list->DropOldest())
+			list->Release();
+	}
+}
+
 class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 {
 	bool IsValidDuration(const std::string& duration)
@@ -54,8 +227,11 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 
  public:
 	unsigned int maxlines;
-	HistoryMode(Module* Creator)
+	HistoryBudget& budget;
+
+	HistoryMode(Module* Creator, HistoryBudget& Budget)
 		: ParamMode<HistoryMode, SimpleExtItem<HistoryList> >(Creator, "history", 'H')
+		, budget(Budget)
 	{
 	}
 
@@ -81,17 +257,13 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 		HistoryList* history = ext.get(channel);
 		if (history)
 		{
-			// Shrink the list if the new line number limit is lower than the old one
-			if (len < history->lines.size())
-				history->lines.erase(history->lines.begin(), history->lines.begin() + (history->lines.size() - len));
-
-			history->maxlen = len;
+			history->Resize(len);
 			history->maxtime = time;
 			history->param = parameter;
 		}
 		else
 		{
-			ext.set(channel, new HistoryList(len, time, parameter));
+			ext.set(channel, new HistoryList(budget, len, time, parameter));
 		}
 		return MODEACTION_ALLOW;
 	}
@@ -102,14 +274,79 @@ class HistoryMode : public ParamMode<HistoryMode, SimpleExtItem<HistoryList> >
 	}
 };
 
+/** Send the history of a channel to a user
+ * @param since Only send lines from after this time, 0 for all
+ * @return Number of lines sent
+ */
+static size_t ReplayHistory(LocalUser* user, HistoryList* list, time_t since)
+{
+	time_t mintime = 0;
+	if (list->maxtime)
+		mintime = ServerInstance->Time() - list->maxtime;
+	if (since >= mintime)
+		mintime = since + 1;
+	return list->Replay(user, mintime);
+}
+
+/** Handle /HISTORY
+ */
+class CommandHistory : public SplitCommand
+{
+	HistoryMode& historymode;
+
+ public:
+	/** Time set with HISTORY * <timestamp>, history from before it is not replayed on join */
+	LocalIntExt since;
+
+	CommandHistory(Module* Creator, HistoryMode& Historymode)
+		: SplitCommand(Creator, "HISTORY", 1, 2)
+		, historymode(Historymode)
+		, since("chanhistory_since", Creator)
+	{
+		syntax = "<channel>|* [<timestamp>]";
+		Penalty = 2;
+	}
+
+	CmdResult HandleLocal(const std::vector<std::string>& parameters, LocalUser* user)
+	{
+		const time_t ts = (parameters.size() > 1 ? ConvToInt(parameters[1]) : 0);
+		if (parameters[0] == "*")
+		{
+			since.set(user, ts);
+			user->WriteNotice("*** History from before " + ConvToStr(ts) + " will not be replayed when you join a channel");
+			return CMD_SUCCESS;
+		}
+
+		Channel* chan = ServerInstance->FindChan(parameters[0]);
+		if (!chan)
+		{
+			user->WriteNumeric(ERR_NOSUCHCHANNEL, "%s :No such channel", parameters[0].c_str());
+			return CMD_FAILURE;
+		}
+
+		if (!chan->HasUser(user))
+		{
+			user->WriteNumeric(ERR_NOTONCHANNEL, "%s :You're not on that channel!", chan->name.c_str());
+			return CMD_FAILURE;
+		}
+
+		HistoryList* list = historymode.ext.get(chan);
+		if ((!list) || (!ReplayHistory(user, list, ts)))
+			user->WriteNotice("*** No history to replay for " + chan->name);
+		return CMD_SUCCESS;
+	}
+};
+
 class ModuleChanHistory : public Module
 {
+	HistoryBudget budget;
 	HistoryMode m;
+	CommandHistory cmd;
 	bool sendnotice;
 	UserModeReference botmode;
 	bool dobots;
  public:
-	ModuleChanHistory() : m(this), botmode(this, "bot")
+	ModuleChanHistory() : m(this, budget), cmd(this, m), botmode(this, "bot")
 	{
 	}
 
@@ -119,6 +356,8 @@ class ModuleChanHistory : public Module
 		m.maxlines = tag->getInt("maxlines", 50);
 		sendnotice = tag->getBool("notice", true);
 		dobots = tag->getBool("bots", true);
+		budget.maxsize = tag->getInt("maxsize", 4194304, 0);
+		budget.Trim();
 	}
 
 	void OnUserMessage(User* user, void* dest, int target_type, const std::string &text, char status, const CUList&, MessageType msgtype) CXX11_OVERRIDE
@@ -129,39 +368,38 @@ class ModuleChanHistory : public Module
 			HistoryList* list = m.ext.get(c);
 			if (list)
 			{
-				const std::string line = ":" + user->GetFullHost() + " PRIVMSG " + c->name + " :" + text;
-				list->lines.push_back(HistoryItem(line));
-				if (list->lines.size() > list->maxlen)
-					list->lines.pop_front();
+				// Same line as the one sent to the channel, built from the cached prefix
+				const std::string& prefix = user->GetMessagePrefix();
+				std::string line;
+				line.reserve(prefix.length() + c->name.length() + text.length() + 12);
+				line.append(prefix).append("PRIVMSG ").append(c->name).append(" :").append(text);
+				if (line.length() > ServerInstance->Config->Limits.MaxLine - 2)
+					line.erase(ServerInstance->Config->Limits.MaxLine - 2);
+				line.append("\r\n");
+				list->Add(line);
 			}
 		}
 	}
 
 	void OnPostJoin(Membership* memb) CXX11_OVERRIDE
 	{
-		if (IS_REMOTE(memb->user))
+		LocalUser* user = IS_LOCAL(memb->user);
+		if (!user)
 			return;
 
-		if (memb->user->IsModeSet(botmode) && !dobots)
+		if (user->IsModeSet(botmode) && !dobots)
 			return;
 
 		HistoryList* list = m.ext.get(memb->chan);
 		if (!list)
 			return;
-		time_t mintime = 0;
-		if (list->maxtime)
-			mintime = ServerInstance->Time() - list->maxtime;
 
 		if (sendnotice)
 		{
-			memb->user->WriteNotice("Replaying up to " + ConvToStr(list->maxlen) + " lines of pre-join history spanning up to " + ConvToStr(list->maxtime) + " seconds");
+			user->WriteNotice("Replaying up to " + ConvToStr(list->maxlen) + " lines of pre-join history spanning up to " + ConvToStr(list->maxtime) + " seconds");
 		}
 
-		for(std::deque<HistoryItem>::iterator i = list->lines.begin(); i != list->lines.end(); ++i)
-		{
-			if (i->ts >= mintime)
-				memb->user->Write(i->line);
-		}
+		ReplayHistory(user, list, cmd.since.get(user));
 	}
 
 	Version GetVersion() CXX11_OVERRIDE
@@ -155,7 +155,7 @@ class ModuleClearChan : public Module
 		ServerInstance->Modules->DetachAll(this);
 	}
 
-	void OnBuildNeighborList(User* source, IncludeChanList& include, std::map<User*, bool>& exception) CXX11_OVERRIDE
+	void OnBuildNeighborList(User* source, IncludeChanList& include, NeighborExceptions& exception) CXX11_OVERRIDE
 	{
 		bool found = false;
 		for (IncludeChanList::iterator i = include.begin(); i != include.end(); ++i)
@@ -85,7 +85,7 @@ class CloakUser : public ModeHandler
 
 		/* don't allow this user to spam modechanges */
 		if (source == dest)
-			user->CommandFloodPenalty += 5000;
+			user->AddPenalty(5000);
 
 		if (adding)
 		{
@@ -22,8 +22,7 @@
 
 class ModuleConnectBan : public Module
 {
-	typedef std::map<irc::sockets::cidr_mask, unsigned int> ConnectMap;
-	ConnectMap connects;
+	CIDRTree<unsigned int> connects;
 	unsigned int threshold;
 	unsigned int banduration;
 	unsigned int ipv4_cidr;
@@ -65,13 +64,14 @@ class ModuleConnectBan : public Module
 		}
 
 		irc::sockets::cidr_mask mask(u->client_sa, range);
-		ConnectMap::iterator i = connects.find(mask);
+		unsigned int* count = connects.Insert(mask);
+		if (!count)
+			return;
 
-		if (i != connects.end())
+		// The first connection from a range only creates its counter
+		if ((*count)++ > 0)
 		{
-			i->second++;
-
-			if (i->second >= threshold)
+			if (*count >= threshold)
 			{
 				// Create zline for set duration.
 				ZLine* zl = new ZLine(ServerInstance->Time(), banduration, ServerInstance->Config->ServerName, banmessage, mask.str());
@@ -86,13 +86,9 @@ class ModuleConnectBan : public Module
 				ServerInstance->SNO->WriteGlobalSno('x',"Module m_connectban added Z:line on *@%s to expire on %s: Connect flooding",
 					maskstr.c_str(), timestr.c_str());
 				ServerInstance->SNO->WriteGlobalSno('a', "Connect flooding from IP range %s (%d)", maskstr.c_str(), threshold);
-				connects.erase(i);
+				connects.Erase(mask);
 			}
 		}
-		else
-		{
-			connects[mask] = 1;
-		}
 	}
 
 	void OnGarbageCollect()
@@ -228,7 +228,7 @@ class CommandDccallow : public Command
 
 		LocalUser* localuser = IS_LOCAL(user);
 		if (localuser)
-			localuser->CommandFloodPenalty += 4000;
+			localuser->AddPenalty(4000);
 	}
 
 	void DisplayDCCAllowList(User* user)
@@ -71,6 +71,8 @@ class DNSBLResolver : public DNS::Request
 		int i = countExt.get(them);
 		if (i)
 			countExt.set(them, i - 1);
+		if (i == 1)
+			ServerInstance->Users->CheckReady(them);
 
 		// Now we calculate the bitmask: 256*(256*(256*a+b)+c)+d
 
@@ -204,6 +206,8 @@ class DNSBLResolver : public DNS::Request
 		int i = countExt.get(them);
 		if (i)
 			countExt.set(them, i - 1);
+		if (i == 1)
+			ServerInstance->Users->CheckReady(them);
 
 		if (q->error == DNS::ERROR_NO_RECORDS || q->error == DNS::ERROR_DOMAIN_NOT_FOUND)
 			ConfEntry->stats_misses++;
@@ -154,6 +154,18 @@ class CommandFilter : public Command
 	}
 };
 
+/** The regexes of some of the filters, matched against a text together */
+struct FilterSet
+{
+	/** The set, NULL if there are no filters in it */
+	RegexSet* set;
+
+	/** Position of the filter of every regex in the set in ModuleFilter::filters */
+	std::vector<size_t> positions;
+
+	FilterSet() : set(NULL) { }
+};
+
 class ModuleFilter : public Module
 {
 	typedef std::set<std::string, irc::insensitive_swo> ExemptTargetSet;
@@ -162,6 +174,18 @@ class ModuleFilter : public Module
 	RegexFactory* factory;
 	void FreeFilters();
 
+	/** Filters matched against the text as it is and ones matched against it with colours stripped */
+	FilterSet sets[2];
+
+	/** True if the sets are up to date with the filters */
+	bool setsbuilt;
+
+	/** Put the regexes of all filters in the sets */
+	void BuildSets();
+
+	/** Delete the sets, they are built again when the next text is checked */
+	void FreeSets();
+
  public:
 	CommandFilter filtcommand;
 	dynamic_reference<RegexFactory> RegexEngine;
@@ -292,7 +316,7 @@ bool ModuleFilter::AppliesToMe(User* user, FilterResult* filter, int iflags)
 }
 
 ModuleFilter::ModuleFilter()
-	: initing(true), filtcommand(this), RegexEngine(this, "regex")
+	: initing(true), setsbuilt(false), filtcommand(this), RegexEngine(this, "regex")
 {
 }
 
@@ -304,12 +328,44 @@ CullResult ModuleFilter::cull()
 
 void ModuleFilter::FreeFilters()
 {
+	FreeSets();
 	for (std::vector<FilterResult>::const_iterator i = filters.begin(); i != filters.end(); ++i)
 		delete i->regex;
 
 	filters.clear();
 }
 
+void ModuleFilter::FreeSets()
+{
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		delete sets[i].set;
+		sets[i].set = NULL;
+		sets[i].positions.clear();
+	}
+	setsbuilt = false;
+}
+
+void ModuleFilter::BuildSets()
+{
+	FreeSets();
+
+	std::vector<Regex*> regexes[2];
+	for (size_t i = 0; i < filters.size(); i++)
+	{
+		const unsigned int which = (filters[i].flag_strip_color ? 1 : 0);
+		regexes[which].push_back(filters[i].regex);
+		sets[which].positions.push_back(i);
+	}
+
+	for (unsigned int i = 0; i < 2; i++)
+	{
+		if (!regexes[i].empty())
+			sets[i].set = RegexEngine->CreateSet(regexes[i]);
+	}
+	setsbuilt = true;
+}
+
 ModResult ModuleFilter::OnUserPreMessage(User* user, void* dest, int target_type, std::string& text, char status, CUList& exempt_list, MessageType msgtype)
 {
 	// Leave remote users and servers alone
@@ -571,27 +627,45 @@ void ModuleFilter::OnDecodeMetaData(Extensible* target, const std::string &extna
 
 FilterResult* ModuleFilter::FilterMatch(User* user, const std::string &text, int flgs)
 {
+	if ((filters.empty()) || (!RegexEngine))
+		return NULL;
+
+	if (!setsbuilt)
+		BuildSets();
+
 	static std::string stripped_text;
-	stripped_text.clear();
+	static std::vector<size_t> matches;
 
-	for (std::vector<FilterResult>::iterator i = filters.begin(); i != filters.end(); ++i)
+	/* Scan the text once per set, the first matching filter in list order which applies to us wins */
+	size_t first = filters.size();
+	for (unsigned int i = 0; i < 2; i++)
 	{
-		FilterResult* filter = &*i;
-
-		/* Skip ones that dont apply to us */
-		if (!AppliesToMe(user, filter, flgs))
+		if (!sets[i].set)
 			continue;
 
-		if ((filter->flag_strip_color) && (stripped_text.empty()))
+		if (i == 1)
 		{
 			stripped_text = text;
 			InspIRCd::StripColor(stripped_text);
 		}
 
-		if (filter->regex->Matches(filter->flag_strip_color ? stripped_text : text))
-			return filter;
+		matches.clear();
+		sets[i].set->Match(i == 1 ? stripped_text : text, matches);
+		for (std::vector<size_t>::const_iterator j = matches.begin(); j != matches.end(); ++j)
+		{
+			const size_t pos = sets[i].positions[*j];
+			if (pos >= first)
+				break;
+
+			if (AppliesToMe(user, &filters[pos], flgs))
+			{
+				first = pos;
+				break;
+			}
+		}
 	}
-	return NULL;
+
+	return (first != filters.size() ? &filters[first] : NULL);
 }
 
 bool ModuleFilter::DeleteFilter(const std::string &freeform)
@@ -600,6 +674,7 @@ bool ModuleFilter::DeleteFilter(const std::string &freeform)
 	{
 		if (i->freeform == freeform)
 		{
+			FreeSets();
 			delete i->regex;
 			filters.erase(i);
 			return true;
@@ -621,6 +696,7 @@ std::pair<bool, std::string> ModuleFilter::AddFilter(const std::string &freeform
 	try
 	{
 		filters.push_back(FilterResult(RegexEngine, freeform, reason, type, duration, flgs));
+		FreeSets();
 	}
 	catch (ModuleException &e)
 	{
@@ -684,6 +760,7 @@ void ModuleFilter::ReadFilters()
 		try
 		{
 			filters.push_back(FilterResult(RegexEngine, pattern, reason, fa, gline_time, flgs));
+			FreeSets();
 			ServerInstance->Logs->Log(MODNAME, LOG_DEFAULT, "Regular expression %s loaded.", pattern.c_str());
 		}
 		catch (ModuleException &e)
@@ -33,11 +33,11 @@ class ModuleHostCycle : public Module
 		already_sent_t seen_id = ++LocalUser::already_sent_id;
 
 		IncludeChanList include_chans(user->chans.begin(), user->chans.end());
-		std::map<User*,bool> exceptions;
+		NeighborExceptions exceptions;
 
 		FOREACH_MOD(OnBuildNeighborList, (user, include_chans, exceptions));
 
-		for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
 			if (u && !u->quitting)
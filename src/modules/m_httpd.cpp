@@ -27,11 +27,18 @@
 #include "modules/httpd.h"
 
 class ModuleHttpServer;
+class HttpServerSocket;
 
 static ModuleHttpServer* HttpModule;
 static bool claimed;
 static std::set<HttpServerSocket*> sockets;
 
+/** Seconds a client has to send a complete request, 0 for no limit */
+static unsigned int timeoutsec;
+
+/** Seconds an idle persistent connection is kept open, 0 to close after every response */
+static unsigned int keepalivesec;
+
 /** HTTP socket states
  */
 enum HttpState
@@ -41,6 +48,21 @@ enum HttpState
 	HTTP_SERVE_SEND_DATA = 2 /* Sending response */
 };
 
+/** Closes a HTTP connection which was idle or sending a request for too long
+ */
+class HttpTimeout : public Timer
+{
+	HttpServerSocket* const sock;
+
+ public:
+	HttpTimeout(HttpServerSocket* s)
+		: Timer(0, 0), sock(s)
+	{
+	}
+
+	bool Tick(time_t) CXX11_OVERRIDE;
+};
+
 /** A socket used for HTTP transport
  */
 class HttpServerSocket : public BufferedSocket
@@ -49,21 +71,73 @@ class HttpServerSocket : public BufferedSocket
 	std::string ip;
 
 	HTTPHeaders headers;
-	std::string reqbuffer;
 	std::string postdata;
 	unsigned int postsize;
 	std::string request_type;
 	std::string uri;
 	std::string http_version;
 
- public:
-	const time_t createtime;
+	/** True if the connection stays open after the response to the current request */
+	bool keepalive;
+
+	/** True once no more requests are read, the socket is culled when its sendq is empty */
+	bool closing;
+
+	/** True if the socket has been queued for culling */
+	bool culled;
+
+	/** True if the timer counts the idle time between two requests rather than the time taken by one */
+	bool idle;
+
+	HttpTimeout timer;
+
+	/** Check whether a header field starts at pos and has the given name, ignoring case */
+	bool IsField(std::string::size_type pos, std::string::size_type len, const char* name) const
+	{
+		return ((len == strlen(name)) && (!strncasecmp(recvq.data() + pos, name, len)));
+	}
+
+	/** Check whether a comma separated header value contains a token, ignoring case */
+	bool HasToken(std::string::size_type pos, std::string::size_type end, const char* token) const
+	{
+		while (pos < end)
+		{
+			std::string::size_type tokend = recvq.find(',', pos);
+			if (tokend > end)
+				tokend = end;
+
+			std::string::size_type tokbegin = pos;
+			while ((tokbegin < tokend) && (recvq[tokbegin] == ' ' || recvq[tokbegin] == '\t'))
+				tokbegin++;
+			std::string::size_type toklast = tokend;
+			while ((toklast > tokbegin) && (recvq[toklast - 1] == ' ' || recvq[toklast - 1] == '\t'))
+				toklast--;
+
+			if (IsField(tokbegin, toklast - tokbegin, token))
+				return true;
+			pos = tokend + 1;
+		}
+		return false;
+	}
+
+	/** Start the timer, or stop it if secs is 0 */
+	void SetTimeout(unsigned int secs)
+	{
+		if (secs)
+		{
+			timer.SetTrigger(ServerInstance->Time() + secs);
+			ServerInstance->Timers.AddTimer(&timer);
+		}
+		else
+			ServerInstance->Timers.DelTimer(&timer);
+	}
 
+ public:
 	HttpServerSocket(int newfd, const std::string& IP, ListenSocket* via, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server)
-		: BufferedSocket(newfd), ip(IP), postsize(0)
-		, createtime(ServerInstance->Time())
+		: BufferedSocket(newfd), ip(IP), postsize(0), keepalive(false), closing(false), culled(false), idle(false), timer(this)
 	{
 		InternalState = HTTP_SERVE_WAIT_REQUEST;
+		SetTimeout(timeoutsec);
 
 		if (via->iohookprov)
 			via->iohookprov->OnAccept(this, client, server);
@@ -74,11 +148,29 @@ class HttpServerSocket : public BufferedSocket
 		sockets.erase(this);
 	}
 
-	void OnError(BufferedSocketError) CXX11_OVERRIDE
+	/** Queue the socket for culling, at most once */
+	void CloseConnection()
 	{
+		if (culled)
+			return;
+
+		culled = true;
+		sockets.erase(this);
 		ServerInstance->GlobalCulls.AddItem(this);
 	}
 
+	void OnError(BufferedSocketError) CXX11_OVERRIDE
+	{
+		CloseConnection();
+	}
+
+	void DoWrite() CXX11_OVERRIDE
+	{
+		BufferedSocket::DoWrite();
+		if ((closing) && (!getSendQSize()))
+			CloseConnection();
+	}
+
 	std::string Response(int response)
 	{
 		switch (response)
@@ -177,13 +269,22 @@ class HttpServerSocket : public BufferedSocket
 		                   "<small>Powered by <a href='http://www.inspircd.org'>InspIRCd</a></small></body></html>";
 
 		SendHeaders(data.length(), response, empty);
-		WriteData(data);
+		if (request_type != "HEAD")
+			WriteData(data);
 	}
 
-	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders)
+	/** Answer a request which can not be served with an error and close the connection after it */
+	void RejectRequest(int response)
 	{
+		keepalive = false;
+		closing = true;
+		SendHTTPError(response);
+	}
 
-		WriteData(http_version + " "+ConvToStr(response)+" "+Response(response)+"\r\n");
+	void SendHeaders(unsigned long size, int response, HTTPHeaders &rheaders)
+	{
+		// Errors may be sent before the version of the request is known
+		WriteData((http_version == "HTTP/1.0" ? "HTTP/1.0 " : "HTTP/1.1 ")+ConvToStr(response)+" "+Response(response)+"\r\n");
 
 		time_t local = ServerInstance->Time();
 		struct tm *timeinfo = gmtime(&local);
@@ -199,116 +300,195 @@ class HttpServerSocket : public BufferedSocket
 		else
 			rheaders.RemoveHeader("Content-Type");
 
-		/* Supporting Connection: keep-alive causes a whole world of hurt syncronizing timeouts,
-		 * so remove it, its not essential for what we need.
-		 */
-		rheaders.SetHeader("Connection", "Close");
+		if (keepalive)
+		{
+			rheaders.SetHeader("Connection", "Keep-Alive");
+			rheaders.SetHeader("Keep-Alive", "timeout=" + ConvToStr(keepalivesec));
+		}
+		else
+		{
+			rheaders.SetHeader("Connection", "Close");
+			rheaders.RemoveHeader("Keep-Alive");
+		}
 
 		WriteData(rheaders.GetFormattedHeaders());
 		WriteData("\r\n");
 	}
 
-	void OnDataReady()
+	void OnDataReady() CXX11_OVERRIDE
 	{
-		if (InternalState == HTTP_SERVE_RECV_POSTDATA)
+		if (closing)
 		{
-			postdata.append(recvq);
-			if (postdata.length() >= postsize)
-				ServeData();
+			// Anything sent after the last request is ignored
+			recvq_head = recvq.length();
+			return;
 		}
-		else
+
+		// Serve every complete request in the recvq, pipelined requests are
+		// answered in order as the handlers respond before returning
+		bool served = false;
+		while (!closing)
 		{
-			reqbuffer.append(recvq);
+			if ((InternalState == HTTP_SERVE_WAIT_REQUEST) && (!CheckRequestBuffer()))
+				break;
 
-			if (reqbuffer.length() >= 8192)
+			if (InternalState == HTTP_SERVE_RECV_POSTDATA)
 			{
-				ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "m_httpd dropped connection due to an oversized request buffer");
-				reqbuffer.clear();
-				SetError("Buffer");
+				if (recvq.length() - recvq_head < postsize)
+					break;
+
+				postdata.assign(recvq, recvq_head, postsize);
+				recvq_head += postsize;
 			}
 
-			if (InternalState == HTTP_SERVE_WAIT_REQUEST)
-				CheckRequestBuffer();
+			ServeData();
+			served = true;
+
+			if (!keepalive)
+				closing = true;
+
+			InternalState = HTTP_SERVE_WAIT_REQUEST;
+			headers.Clear();
+			postdata.clear();
+			postsize = 0;
+			request_type.clear();
+			uri.clear();
+			http_version.clear();
 		}
-	}
 
-	void CheckRequestBuffer()
-	{
-		std::string::size_type reqend = reqbuffer.find("\r\n\r\n");
-		if (reqend == std::string::npos)
+		if (closing)
+		{
+			// Give the client as long to read the last response as it had to send a request
+			SetTimeout(timeoutsec);
 			return;
+		}
 
-		// We have the headers; parse them all
-		std::string::size_type hbegin = 0, hend;
-		while ((hend = reqbuffer.find("\r\n", hbegin)) != std::string::npos)
+		// The keepalive timer runs while nothing of the next request has arrived,
+		// once it starts the client has timeoutsec seconds to finish it
+		const bool pending = ((InternalState != HTTP_SERVE_WAIT_REQUEST) || (recvq_head < recvq.length()));
+		if ((served) || (idle && pending))
 		{
-			if (hbegin == hend)
-				break;
-
-			if (request_type.empty())
-			{
-				std::istringstream cheader(std::string(reqbuffer, hbegin, hend - hbegin));
-				cheader >> request_type;
-				cheader >> uri;
-				cheader >> http_version;
-
-				if (request_type.empty() || uri.empty() || http_version.empty())
-				{
-					SendHTTPError(400);
-					return;
-				}
+			idle = !pending;
+			SetTimeout(idle ? keepalivesec : timeoutsec);
+		}
+	}
 
-				hbegin = hend + 2;
-				continue;
-			}
+	/** Parse the request at the start of the recvq once all of its headers arrived.
+	 * The request line and header fields are parsed in place, only the values
+	 * which are kept are copied out of the recvq.
+	 * @return True if a request was parsed, false if more data is needed or the request was rejected
+	 */
+	bool CheckRequestBuffer()
+	{
+		// Clients may send empty lines before a request
+		while (!recvq.compare(recvq_head, 2, "\r\n"))
+			recvq_head += 2;
 
-			std::string cheader = reqbuffer.substr(hbegin, hend - hbegin);
+		const std::string::size_type reqend = recvq.find("\r\n\r\n", recvq_head);
+		if ((reqend == std::string::npos ? recvq.length() : reqend) - recvq_head >= 8192)
+		{
+			ServerInstance->Logs->Log(MODNAME, LOG_DEBUG, "m_httpd dropped connection due to an oversized request buffer");
+			recvq_head = recvq.length();
+			SetError("Buffer");
+			return false;
+		}
 
-			std::string::size_type fieldsep = cheader.find(':');
-			if ((fieldsep == std::string::npos) || (fieldsep == 0) || (fieldsep == cheader.length() - 1))
-			{
-				SendHTTPError(400);
-				return;
-			}
+		if (reqend == std::string::npos)
+			return false;
 
-			headers.SetHeader(cheader.substr(0, fieldsep), cheader.substr(fieldsep + 2));
+		const std::string::size_type begin = recvq_head;
+		recvq_head = reqend + 4;
 
-			hbegin = hend + 2;
+		// Request line: method, URI and version separated by spaces
+		const std::string::size_type lineend = recvq.find("\r\n", begin);
+		const std::string::size_type methodend = recvq.find(' ', begin);
+		const std::string::size_type uriend = (methodend < lineend ? recvq.find(' ', methodend + 1) : std::string::npos);
+		if ((methodend == begin) || (uriend >= lineend) || (uriend == methodend + 1) || (uriend + 1 == lineend))
+		{
+			RejectRequest(400);
+			return false;
 		}
 
-		reqbuffer.erase(0, reqend + 4);
+		request_type.assign(recvq, begin, methodend - begin);
+		uri.assign(recvq, methodend + 1, uriend - methodend - 1);
+		http_version.assign(recvq, uriend + 1, lineend - uriend - 1);
 
 		std::transform(request_type.begin(), request_type.end(), request_type.begin(), ::toupper);
 		std::transform(http_version.begin(), http_version.end(), http_version.begin(), ::toupper);
 
-		if ((http_version != "HTTP/1.1") && (http_version != "HTTP/1.0"))
+		bool connclose = false;
+		bool connkeepalive = false;
+		bool chunked = false;
+		bool havelength = false;
+		for (std::string::size_type pos = lineend + 2; pos < reqend; )
 		{
-			SendHTTPError(505);
-			return;
-		}
+			const std::string::size_type eol = recvq.find("\r\n", pos);
+			const char* colon = static_cast<const char*>(memchr(recvq.data() + pos, ':', eol - pos));
+			const std::string::size_type namelen = (colon ? colon - (recvq.data() + pos) : 0);
+			if (!namelen)
+			{
+				RejectRequest(400);
+				return false;
+			}
 
-		if (headers.IsSet("Content-Length") && (postsize = ConvToInt(headers.GetHeader("Content-Length"))) > 0)
-		{
-			InternalState = HTTP_SERVE_RECV_POSTDATA;
+			std::string::size_type valbegin = pos + namelen + 1;
+			while ((valbegin < eol) && (recvq[valbegin] == ' ' || recvq[valbegin] == '\t'))
+				valbegin++;
+			std::string::size_type valend = eol;
+			while ((valend > valbegin) && (recvq[valend - 1] == ' ' || recvq[valend - 1] == '\t'))
+				valend--;
 
-			if (reqbuffer.length() >= postsize)
+			if (IsField(pos, namelen, "Connection"))
 			{
-				postdata = reqbuffer.substr(0, postsize);
-				reqbuffer.erase(0, postsize);
+				connclose |= HasToken(valbegin, valend, "close");
+				connkeepalive |= HasToken(valbegin, valend, "keep-alive");
 			}
-			else if (!reqbuffer.empty())
+			else if (IsField(pos, namelen, "Transfer-Encoding"))
+				chunked = true;
+
+			const std::string value(recvq, valbegin, valend - valbegin);
+			if (IsField(pos, namelen, "Content-Length"))
 			{
-				postdata = reqbuffer;
-				reqbuffer.clear();
+				// A length which is not a plain decimal number, or more than one length,
+				// leaves it unclear where the body ends
+				if ((havelength) || (value.empty()) || (value.find_first_not_of("0123456789") != std::string::npos))
+				{
+					RejectRequest(400);
+					return false;
+				}
+
+				if (value.length() > 9)
+				{
+					RejectRequest(413);
+					return false;
+				}
+
+				havelength = true;
+				postsize = ConvToInt(value);
 			}
 
-			if (postdata.length() >= postsize)
-				ServeData();
+			headers.SetHeader(std::string(recvq, pos, namelen), value);
+			pos = eol + 2;
+		}
 
-			return;
+		if ((http_version != "HTTP/1.1") && (http_version != "HTTP/1.0"))
+		{
+			RejectRequest(505);
+			return false;
+		}
+
+		// Without support for chunked bodies the end of the request can not be found
+		if (chunked)
+		{
+			RejectRequest(501);
+			return false;
 		}
 
-		ServeData();
+		// HTTP/1.1 connections are persistent unless the client asks otherwise, HTTP/1.0 ones only if it asks
+		keepalive = ((keepalivesec) && (http_version == "HTTP/1.1" ? !connclose : connkeepalive));
+
+		InternalState = (postsize ? HTTP_SERVE_RECV_POSTDATA : HTTP_SERVE_SEND_DATA);
+		return true;
 	}
 
 	void ServeData()
@@ -332,10 +512,17 @@ class HttpServerSocket : public BufferedSocket
 	void Page(std::stringstream* n, int response, HTTPHeaders *hheaders)
 	{
 		SendHeaders(n->str().length(), response, *hheaders);
-		WriteData(n->str());
+		if (request_type != "HEAD")
+			WriteData(n->str());
 	}
 };
 
+bool HttpTimeout::Tick(time_t)
+{
+	sock->CloseConnection();
+	return false;
+}
+
 class HTTPdAPIImpl : public HTTPdAPIBase
 {
  public:
@@ -355,7 +542,6 @@ class ModuleHttpServer : public Module
 {
 	std::vector<HttpServerSocket *> httpsocks;
 	HTTPdAPIImpl APIImpl;
-	unsigned int timeoutsec;
 
  public:
 	ModuleHttpServer()
@@ -372,6 +558,7 @@ class ModuleHttpServer : public Module
 	{
 		ConfigTag* tag = ServerInstance->Config->ConfValue("httpd");
 		timeoutsec = tag->getInt("timeout");
+		keepalivesec = tag->getInt("keepalive", 15);
 	}
 
 	ModResult OnAcceptConnection(int nfd, ListenSocket* from, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* server) CXX11_OVERRIDE
@@ -385,24 +572,6 @@ class ModuleHttpServer : public Module
 		return MOD_RES_ALLOW;
 	}
 
-	void OnBackgroundTimer(time_t curtime) CXX11_OVERRIDE
-	{
-		if (!timeoutsec)
-			return;
-
-		time_t oldest_allowed = curtime - timeoutsec;
-		for (std::set<HttpServerSocket*>::const_iterator i = sockets.begin(); i != sockets.end(); )
-		{
-			HttpServerSocket* sock = *i;
-			++i;
-			if (sock->createtime < oldest_allowed)
-			{
-				sock->cull();
-				delete sock;
-			}
-		}
-	}
-
 	CullResult cull() CXX11_OVERRIDE
 	{
 		std::set<HttpServerSocket*> local;
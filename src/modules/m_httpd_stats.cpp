@@ -73,6 +73,24 @@ class ModuleHttpStats : public Module
 		return ret;
 	}
 
+	void DumpHookProfiles(std::stringstream& data, Module* mod)
+	{
+		if (!mod->HookProfiles)
+			return;
+
+		data << "<hooks>";
+		for (size_t i = I_BEGIN + 1; i != I_END; ++i)
+		{
+			const HookProfile& profile = mod->HookProfiles[i];
+			if (!profile.calls)
+				continue;
+
+			data << "<hook><name>" << ModuleManager::GetHookName((Implementation)i) << "</name><calls>" << profile.calls
+				<< "</calls><cycles>" << profile.cycles << "</cycles><maxcycles>" << profile.maxcycles << "</maxcycles></hook>";
+		}
+		data << "</hooks>";
+	}
+
 	void DumpMeta(std::stringstream& data, Extensible* ext)
 	{
 		data << "<metadata>";
@@ -146,7 +164,9 @@ class ModuleHttpStats : public Module
 				for (ModuleManager::ModuleMap::const_iterator i = mods.begin(); i != mods.end(); ++i)
 				{
 					Version v = i->second->GetVersion();
-					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description></module>";
+					data << "<module><name>" << i->first << "</name><description>" << Sanitize(v.description) << "</description>";
+					DumpHookProfiles(data, i->second);
+					data << "</module>";
 				}
 				data << "</modulelist><channellist>";
 
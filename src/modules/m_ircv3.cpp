@@ -35,11 +35,11 @@ class ModuleIRCv3 : public Module
 	{
 		IncludeChanList chans(user->chans.begin(), user->chans.end());
 
-		std::map<User*, bool> exceptions;
+		NeighborExceptions exceptions;
 		FOREACH_MOD(OnBuildNeighborList, (user, chans, exceptions));
 
 		// Send it to all local users who were explicitly marked as neighbours by modules and have the required ext
-		for (std::map<User*, bool>::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+		for (NeighborExceptions::const_iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 		{
 			LocalUser* u = IS_LOCAL(i->first);
 			if ((u) && (i->second) && (ext.get(u)))
@@ -32,6 +32,23 @@ public:
 	{
 		return InspIRCd::Match(text, this->regex_string);
 	}
+
+	std::string GetLiteral() CXX11_OVERRIDE
+	{
+		// Longest run of the mask without wildcards
+		std::string best;
+		irc::sepstream runs(this->regex_string, '*');
+		for (std::string run; runs.GetToken(run); )
+		{
+			irc::sepstream parts(run, '?');
+			for (std::string part; parts.GetToken(part); )
+			{
+				if (part.length() > best.length())
+					best.swap(part);
+			}
+		}
+		return best;
+	}
 };
 
 class GlobFactory : public RegexFactory
@@ -117,6 +117,8 @@ class AccountExtItemImpl : public AccountExtItem
 			return;
 
 		StringExtItem::unserialize(format, container, value);
+		// The account can be matched by the R and U extbans
+		user->InvalidateBanCache();
 		if (!value.empty())
 		{
 			// Logged in
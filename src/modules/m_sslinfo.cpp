@@ -177,7 +177,7 @@ class ModuleSSLInfo : public Module
 				if (ifo->oper_block->getBool("sslonly") && !cert)
 				{
 					user->WriteNumeric(491, ":This oper login requires an SSL connection.");
-					user->CommandFloodPenalty += 10000;
+					user->AddPenalty(10000);
 					return MOD_RES_DENY;
 				}
 
@@ -185,7 +185,7 @@ class ModuleSSLInfo : public Module
 				if (ifo->oper_block->readString("fingerprint", fingerprint) && (!cert || cert->GetFingerprint() != fingerprint))
 				{
 					user->WriteNumeric(491, ":This oper login requires a matching SSL fingerprint.");
-					user->CommandFloodPenalty += 10000;
+					user->AddPenalty(10000);
 					return MOD_RES_DENY;
 				}
 			}
@@ -38,7 +38,7 @@ class CommandTest : public Command
 		}
 		else if (parameters[0] == "freeze" && IS_LOCAL(user) && parameters.size() > 1)
 		{
-			IS_LOCAL(user)->CommandFloodPenalty += atoi(parameters[1].c_str());
+			IS_LOCAL(user)->AddPenalty(atoi(parameters[1].c_str()));
 		}
 		return CMD_SUCCESS;
 	}
@@ -34,7 +34,7 @@ size_t SocketEngine::CurrentSetSize = 0;
 
 /** List of handlers that want a trial read/write
  */
-std::set<int> SocketEngine::trials;
+std::vector<int> SocketEngine::trials;
 
 int SocketEngine::MAX_DESCRIPTORS;
 
@@ -66,7 +66,7 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 
 	// if adding a trial read/write, insert it into the set
 	if (change & FD_TRIAL_NOTE_MASK && !(old_m & FD_TRIAL_NOTE_MASK))
-		trials.insert(eh->GetFd());
+		trials.push_back(eh->GetFd());
 
 	new_m |= change;
 	if (new_m == old_m)
@@ -76,12 +76,19 @@ void SocketEngine::ChangeEventMask(EventHandler* eh, int change)
 	OnSetEvent(eh, old_m, new_m);
 }
 
+int SocketEngine::GetWaitTimeout()
+{
+	unsigned long timeout = 1000 - ServerInstance->Time_ns() / 1000000;
+	return ServerInstance->Timers.GetTimeout(TimerManager::Now(), timeout);
+}
+
 void SocketEngine::DispatchTrialWrites()
 {
-	std::vector<int> working_list;
-	working_list.reserve(trials.size());
-	working_list.assign(trials.begin(), trials.end());
-	trials.clear();
+	// Swap the lists so handlers can add new trials while we work, and so
+	// that both vectors keep their capacity between calls
+	static std::vector<int> working_list;
+	working_list.clear();
+	working_list.swap(trials);
 	for(unsigned int i=0; i < working_list.size(); i++)
 	{
 		int fd = working_list[i];
@@ -35,9 +35,22 @@ namespace
 {
 	int EngineHandle;
 
+	/** Smallest and initial number of events fetched by one epoll_wait() call
+	 */
+	const size_t MIN_BATCH = 16;
+
+	/** Number of consecutive waits which used less than a quarter of the batch
+	 * before the batch is halved again
+	 */
+	const unsigned int SHRINK_AFTER = 256;
+
 	/** These are used by epoll() to hold socket events
 	 */
-	std::vector<struct epoll_event> events(1);
+	std::vector<struct epoll_event> events(MIN_BATCH);
+
+	/** Number of consecutive waits which used less than a quarter of the batch
+	 */
+	unsigned int underused = 0;
 }
 
 void SocketEngine::Init()
@@ -128,7 +141,6 @@ bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
 	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
 
 	eh->SetEventMask(event_mask);
-	ResizeDouble(events);
 
 	return true;
 }
@@ -175,10 +187,33 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = epoll_wait(EngineHandle, &events[0], events.size(), 1000);
+	int i = epoll_wait(EngineHandle, &events[0], events.size(), GetWaitTimeout());
 	ServerInstance->UpdateTime();
 
-	stats.TotalEvents += i;
+	stats.Dispatched(i);
+
+	// Size the event array after the number of ready sockets: if it was filled
+	// there may be more events waiting, so allow twice as many next time; if
+	// it has been mostly empty for a while give the memory back
+	if ((size_t)i == events.size())
+	{
+		if (events.size() < CurrentSetSize)
+			events.resize(events.size() * 2);
+		underused = 0;
+	}
+	else if ((size_t)i < events.size() / 4 && events.size() > MIN_BATCH)
+	{
+		if (++underused >= SHRINK_AFTER)
+		{
+			std::vector<struct epoll_event>(events.size() / 2).swap(events);
+			underused = 0;
+		}
+	}
+	else
+	{
+		underused = 0;
+	}
+	stats.BatchSize = events.size();
 
 	for (int j = 0; j < i; j++)
 	{
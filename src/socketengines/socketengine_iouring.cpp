@@ -0,0 +1,479 @@
+/*
+ * InspIRCd -- Internet Relay Chat Daemon
+ *
+ * This file is part of InspIRCd.  InspIRCd is free software: you can
+ * redistribute it and/or modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <vector>
+#include <string>
+#include "inspircd.h"
+#include "exitcodes.h"
+#include "socketengine.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/syscall.h>
+#include <ulimit.h>
+#include <iostream>
+
+/** A specialisation of the SocketEngine class, designed to use the linux io_uring interface.
+ *
+ * The SocketEngine interface is readiness based, so this engine uses one-shot
+ * poll requests which are rearmed after every event, much like the ports engine.
+ * The advantage over epoll is that registrations, rearms and removals are queued
+ * in the submission ring and handed to the kernel in the same io_uring_enter()
+ * call which waits for events, so a busy iteration costs one system call instead
+ * of one epoll_ctl() per changed socket plus epoll_wait().
+ *
+ * The sockets themselves are still read, written and accepted on with the usual
+ * system calls once they are ready. Queueing recv, sendmsg and accept requests
+ * with registered buffers would need a completion based interface in place of
+ * SocketEngine's readiness events, and is not done here.
+ */
+namespace
+{
+	int EngineHandle;
+
+	/** Number of entries in the submission ring; the completion ring is twice as large
+	 */
+	const unsigned int RING_ENTRIES = 4096;
+
+	/** user_data of requests whose completions are not interesting, e.g. poll removals
+	 */
+	const uint64_t IGNORED_COMPLETION = ~uint64_t(0);
+
+	/** The submission ring
+	 */
+	struct
+	{
+		unsigned* head;
+		unsigned* tail;
+		unsigned* mask;
+		unsigned* array;
+		io_uring_sqe* sqes;
+		/** Number of entries queued but not submitted yet */
+		unsigned pending;
+	} sq;
+
+	/** The completion ring
+	 */
+	struct
+	{
+		unsigned* head;
+		unsigned* tail;
+		unsigned* mask;
+		io_uring_cqe* cqes;
+	} cq;
+
+	/** Per-fd poll state, indexed by fd
+	 */
+	struct PollState
+	{
+		/** Poll events of the outstanding request, 0 if there is none */
+		unsigned armed;
+		/** Incremented whenever a new request is made, completions of older ones are ignored */
+		uint32_t generation;
+
+		PollState() : armed(0), generation(0) { }
+	};
+	std::vector<PollState> polls;
+
+	/** Fds whose poll request could not be queued because the submission ring was full
+	 */
+	std::vector<int> unarmed;
+
+	/** user_data of poll requests whose removal could not be queued yet
+	 */
+	std::vector<uint64_t> unremoved;
+
+	/** These are used by io_uring to hold socket events once they are taken off the completion ring
+	 */
+	std::vector<io_uring_cqe> events(16);
+}
+
+static int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags, const void* arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, EngineHandle, to_submit, min_complete, flags, arg, argsz);
+}
+
+/** Hand all queued requests to the kernel without waiting for completions
+ */
+static void Submit()
+{
+	while (sq.pending)
+	{
+		int rv = io_uring_enter(sq.pending, 0, 0, NULL, 0);
+		if (rv < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "io_uring_enter() failed to submit requests: %s", strerror(errno));
+			break;
+		}
+		sq.pending -= rv;
+	}
+}
+
+/** Get a free submission queue entry, submitting the queued ones if the ring is full
+ * @return The entry, or NULL if the kernel did not take any of the queued ones
+ */
+static io_uring_sqe* GetSQE()
+{
+	unsigned tail = *sq.tail;
+	if (tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) > *sq.mask)
+	{
+		// Entries the kernel has not consumed yet are still in use and must not be overwritten
+		Submit();
+		if (tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE) > *sq.mask)
+			return NULL;
+	}
+
+	io_uring_sqe* sqe = &sq.sqes[tail & *sq.mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sq.array[tail & *sq.mask] = tail & *sq.mask;
+	__atomic_store_n(sq.tail, tail + 1, __ATOMIC_RELEASE);
+	sq.pending++;
+	return sqe;
+}
+
+static uint64_t MakeUserData(int fd, uint32_t generation)
+{
+	return (uint64_t(generation) << 32) | uint32_t(fd);
+}
+
+static void* MapRing(size_t size, off_t offset)
+{
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, EngineHandle, offset);
+	if (ptr == MAP_FAILED)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Could not map io_uring rings: %s", strerror(errno));
+		std::cout << "ERROR: Could not map io_uring rings: " << strerror(errno) << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+	return ptr;
+}
+
+void SocketEngine::Init()
+{
+	int max = ulimit(4, 0);
+	if (max > 0)
+	{
+		MAX_DESCRIPTORS = max;
+	}
+	else
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Can't determine maximum number of open sockets!");
+		std::cout << "ERROR: Can't determine maximum number of open sockets!" << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	EngineHandle = io_uring_setup(RING_ENTRIES, &params);
+
+	// Waiting with a timeout needs IORING_FEAT_EXT_ARG (Linux 5.11)
+	if (EngineHandle != -1 && !(params.features & IORING_FEAT_EXT_ARG))
+	{
+		close(EngineHandle);
+		EngineHandle = -1;
+		errno = ENOSYS;
+	}
+
+	if (EngineHandle == -1)
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Could not initialize socket engine: %s", strerror(errno));
+		ServerInstance->Logs->Log("SOCKET", LOG_DEFAULT, "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now.");
+		std::cout << "ERROR: Could not initialize io_uring socket engine: " << strerror(errno) << std::endl;
+		std::cout << "ERROR: Your kernel probably does not have the proper features. This is a fatal error, exiting now." << std::endl;
+		ServerInstance->QuickExit(EXIT_STATUS_SOCKETENGINE);
+	}
+
+	size_t sqsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sqsize = cqsize = std::max(sqsize, cqsize);
+
+	char* sqring = static_cast<char*>(MapRing(sqsize, IORING_OFF_SQ_RING));
+	char* cqring = sqring;
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+		cqring = static_cast<char*>(MapRing(cqsize, IORING_OFF_CQ_RING));
+
+	sq.head = reinterpret_cast<unsigned*>(sqring + params.sq_off.head);
+	sq.tail = reinterpret_cast<unsigned*>(sqring + params.sq_off.tail);
+	sq.mask = reinterpret_cast<unsigned*>(sqring + params.sq_off.ring_mask);
+	sq.array = reinterpret_cast<unsigned*>(sqring + params.sq_off.array);
+	sq.sqes = static_cast<io_uring_sqe*>(MapRing(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+	sq.pending = 0;
+
+	cq.head = reinterpret_cast<unsigned*>(cqring + params.cq_off.head);
+	cq.tail = reinterpret_cast<unsigned*>(cqring + params.cq_off.tail);
+	cq.mask = reinterpret_cast<unsigned*>(cqring + params.cq_off.ring_mask);
+	cq.cqes = reinterpret_cast<io_uring_cqe*>(cqring + params.cq_off.cqes);
+}
+
+void SocketEngine::RecoverFromFork()
+{
+}
+
+void SocketEngine::Deinit()
+{
+	Close(EngineHandle);
+}
+
+static unsigned mask_to_poll(int event_mask)
+{
+	unsigned rv = 0;
+	if (event_mask & (FD_WANT_POLL_READ | FD_WANT_FAST_READ))
+		rv |= POLLIN;
+	if (event_mask & (FD_WANT_POLL_WRITE | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE))
+		rv |= POLLOUT;
+	return rv;
+}
+
+/** Queue the removal of a poll request
+ * @return False if the submission ring was full
+ */
+static bool QueueRemove(uint64_t user_data)
+{
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+		return false;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = user_data;
+	sqe->user_data = IGNORED_COMPLETION;
+	return true;
+}
+
+/** Queue the removal of the outstanding poll request of an fd, if there is one
+ */
+static void Disarm(int fd)
+{
+	PollState& state = polls[fd];
+	if (!state.armed)
+		return;
+
+	const uint64_t user_data = MakeUserData(fd, state.generation);
+	if (!QueueRemove(user_data))
+		unremoved.push_back(user_data);
+	state.armed = 0;
+}
+
+/** Queue a one-shot poll request for the given events, replacing the outstanding one.
+ * If the submission ring is full the fd is armed again on the next call to DispatchEvents().
+ */
+static void Arm(int fd, unsigned pollevents)
+{
+	PollState& state = polls[fd];
+	if (state.armed == pollevents)
+		return;
+
+	Disarm(fd);
+	if (!pollevents)
+		return;
+
+	state.generation++;
+
+	io_uring_sqe* sqe = GetSQE();
+	if (!sqe)
+	{
+		unarmed.push_back(fd);
+		return;
+	}
+
+	state.armed = pollevents;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = pollevents;
+	sqe->user_data = MakeUserData(fd, state.generation);
+}
+
+/** Retry the requests which did not fit into the submission ring earlier
+ */
+static void QueueDeferred()
+{
+	while ((!unremoved.empty()) && (QueueRemove(unremoved.back())))
+		unremoved.pop_back();
+
+	std::vector<int> fds;
+	fds.swap(unarmed);
+	for (std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); ++i)
+	{
+		// Skip fds which were removed or armed again since
+		EventHandler* eh = SocketEngine::GetRef(*i);
+		if ((eh) && (!polls[*i].armed))
+			Arm(*i, mask_to_poll(eh->GetEventMask()));
+	}
+}
+
+bool SocketEngine::AddFd(EventHandler* eh, int event_mask)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "AddFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return false;
+	}
+
+	if (!SocketEngine::AddFdRef(eh))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Attempt to add duplicate fd: %d", fd);
+		return false;
+	}
+
+	if ((size_t)fd >= polls.size())
+		polls.resize(std::max<size_t>(fd + 1, polls.size() * 2));
+
+	eh->SetEventMask(event_mask);
+	Arm(fd, mask_to_poll(event_mask));
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "New file descriptor: %d", fd);
+
+	return true;
+}
+
+void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
+{
+	Arm(eh->GetFd(), mask_to_poll(new_mask));
+}
+
+void SocketEngine::DelFd(EventHandler* eh)
+{
+	int fd = eh->GetFd();
+	if ((fd < 0) || (fd > GetMaxFds() - 1))
+	{
+		ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "DelFd out of range: (fd: %d, max: %d)", fd, GetMaxFds());
+		return;
+	}
+
+	// Completions of anything that is still in flight are ignored from now on. The
+	// removal is submitted right away as the poll request holds a reference to the
+	// socket, which would otherwise stay open until the next call to DispatchEvents().
+	Disarm(fd);
+	polls[fd].generation++;
+	Submit();
+
+	SocketEngine::DelFdRef(eh);
+
+	ServerInstance->Logs->Log("SOCKET", LOG_DEBUG, "Remove file descriptor: %d", fd);
+}
+
+int SocketEngine::DispatchEvents()
+{
+	const int timeout = GetWaitTimeout();
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+
+	QueueDeferred();
+
+	io_uring_getevents_arg arg;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = reinterpret_cast<uintptr_t>(&ts);
+
+	// Submit everything queued since the last call and wait in a single system call
+	int rv = io_uring_enter(sq.pending, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	ServerInstance->UpdateTime();
+	if (rv > 0)
+		sq.pending -= std::min<unsigned>(rv, sq.pending);
+
+	// Copy the completions off the ring before dispatching them so the handlers can queue new requests
+	unsigned head = *cq.head;
+	const unsigned tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+	size_t count = 0;
+	for (; head != tail; head++)
+	{
+		const io_uring_cqe& cqe = cq.cqes[head & *cq.mask];
+		if (cqe.user_data == IGNORED_COMPLETION)
+			continue;
+		if (count == events.size())
+			events.resize(events.size() * 2);
+		events[count++] = cqe;
+	}
+	__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+
+	stats.Dispatched(count);
+
+	for (size_t j = 0; j < count; j++)
+	{
+		const io_uring_cqe& cqe = events[j];
+		const int fd = cqe.user_data & 0xFFFFFFFF;
+		const uint32_t generation = cqe.user_data >> 32;
+
+		EventHandler* const eh = GetRef(fd);
+		if (!eh || polls[fd].generation != generation)
+			continue;
+
+		// The poll request is one-shot, it is gone now
+		polls[fd].armed = 0;
+
+		if (cqe.res < 0)
+		{
+			if (cqe.res == -ECANCELED)
+				continue;
+			stats.ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, -cqe.res);
+			continue;
+		}
+
+		const unsigned revents = cqe.res;
+		if (revents & POLLHUP)
+		{
+			stats.ErrorEvents++;
+			eh->HandleEvent(EVENT_ERROR, 0);
+			continue;
+		}
+
+		if (revents & POLLERR)
+		{
+			stats.ErrorEvents++;
+			/* Get error number */
+			socklen_t codesize = sizeof(int);
+			int errcode;
+			if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &errcode, &codesize) < 0)
+				errcode = errno;
+			eh->HandleEvent(EVENT_ERROR, errcode);
+			continue;
+		}
+
+		int mask = eh->GetEventMask();
+		if (revents & POLLOUT)
+			mask &= ~(FD_WRITE_WILL_BLOCK | FD_WANT_FAST_WRITE | FD_WANT_SINGLE_WRITE);
+		if (revents & POLLIN)
+			mask &= ~FD_READ_WILL_BLOCK;
+		// rearm for next time around, pretending to be one-shot for writes
+		eh->SetEventMask(mask);
+		Arm(fd, mask_to_poll(mask));
+		if (revents & POLLIN)
+		{
+			stats.ReadEvents++;
+			eh->HandleEvent(EVENT_READ);
+			if (eh != GetRef(fd))
+				continue;
+		}
+		if (revents & POLLOUT)
+		{
+			stats.WriteEvents++;
+			eh->HandleEvent(EVENT_WRITE);
+		}
+	}
+
+	return count;
+}
@@ -171,19 +171,19 @@ void SocketEngine::OnSetEvent(EventHandler* eh, int old_mask, int new_mask)
 
 int SocketEngine::DispatchEvents()
 {
+	const int timeout = GetWaitTimeout();
 	struct timespec ts;
-	ts.tv_nsec = 0;
-	ts.tv_sec = 1;
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
 
 	int i = kevent(EngineHandle, &changelist.front(), ChangePos, &ke_list.front(), ke_list.size(), &ts);
 	ChangePos = 0;
 	ServerInstance->UpdateTime();
 
+	stats.Dispatched(i);
 	if (i < 0)
 		return i;
 
-	stats.TotalEvents += i;
-
 	for (int j = 0; j < i; j++)
 	{
 		struct kevent& kev = ke_list[j];
@@ -170,9 +170,10 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
-	int i = poll(&events[0], CurrentSetSize, 1000);
+	int i = poll(&events[0], CurrentSetSize, GetWaitTimeout());
 	int processed = 0;
 	ServerInstance->UpdateTime();
+	stats.Dispatched(i);
 
 	for (int index = 0; index < CurrentSetSize && processed < i; index++)
 	{
@@ -131,10 +131,11 @@ void SocketEngine::DelFd(EventHandler* eh)
 
 int SocketEngine::DispatchEvents()
 {
+	const int timeout = GetWaitTimeout();
 	struct timespec poll_time;
 
-	poll_time.tv_sec = 1;
-	poll_time.tv_nsec = 0;
+	poll_time.tv_sec = timeout / 1000;
+	poll_time.tv_nsec = (timeout % 1000) * 1000000;
 
 	unsigned int nget = 1; // used to denote a retrieve request.
 	int ret = port_getn(EngineHandle, &events[0], events.size(), &nget, &poll_time);
@@ -142,9 +143,12 @@ int SocketEngine::DispatchEvents()
 
 	// first handle an error condition
 	if (ret == -1)
+	{
+		stats.Dispatched(-1);
 		return -1;
+	}
 
-	stats.TotalEvents += nget;
+	stats.Dispatched(nget);
 
 	unsigned int i;
 	for (i = 0; i < nget; i++)
@@ -24,6 +24,7 @@
 #include "inspircd.h"
 #include "testsuite.h"
 #include "threadengine.h"
+#include "modules/regex.h"
 #include <iostream>
 
 class TestSuiteThread : public Thread
@@ -64,6 +65,13 @@ TestSuite::TestSuite()
 		std::cout << "(6) Comma sepstream tests\n";
 		std::cout << "(7) Space sepstream tests\n";
 		std::cout << "(8) UID generation tests\n";
+		std::cout << "(9) Timer benchmark\n";
+		std::cout << "(A) Channel broadcast benchmark\n";
+		std::cout << "(B) Small set and map tests\n";
+		std::cout << "(C) Compiled wildcard mask tests and benchmark\n";
+		std::cout << "(D) CIDR tree tests\n";
+		std::cout << "(E) Ban cache tests\n";
+		std::cout << "(F) Regex literal tests\n";
 
 		std::cout << std::endl << "(X) Exit test suite\n";
 
@@ -111,6 +119,27 @@ TestSuite::TestSuite()
 			case '8':
 				std::cout << (DoGenerateUIDTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
 				break;
+			case '9':
+				std::cout << (DoTimerBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'A':
+				std::cout << (DoChannelBenchmark() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'B':
+				std::cout << (DoSmallContainerTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'C':
+				std::cout << (DoWildcardMaskTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'D':
+				std::cout << (DoCIDRTreeTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'E':
+				std::cout << (DoBanCacheTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
+			case 'F':
+				std::cout << (DoRegexLiteralTests() ? "\nSUCCESS!\n" : "\nFAILURE\n");
+				break;
 			case 'X':
 				return;
 				break;
@@ -395,6 +424,692 @@ bool TestSuite::DoGenerateUIDTests()
 	return true;
 }
 
+/** Simulated time used by the timer benchmark */
+static uint64_t bench_now;
+
+class BenchTimer : public Timer
+{
+ public:
+	unsigned long fired;
+	uint64_t maxlate;
+
+	BenchTimer() : Timer(0, 0), fired(0), maxlate(0) { }
+
+	bool Tick(time_t)
+	{
+		fired++;
+		maxlate = std::max(maxlate, bench_now - GetTriggerMS());
+		return true;
+	}
+};
+
+/** The std::multimap based timer manager which TimerManager replaced, for comparison */
+class LegacyTimerManager
+{
+	typedef std::multimap<uint64_t, Timer*> TimerMap;
+	TimerMap Timers;
+
+ public:
+	void TickTimers(uint64_t now)
+	{
+		for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+		{
+			Timer* t = i->second;
+			if (t->GetTriggerMS() > now)
+				break;
+
+			Timers.erase(i++);
+			t->Tick(now / 1000);
+		}
+	}
+
+	void DelTimer(Timer* t)
+	{
+		std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTriggerMS());
+		for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+		{
+			if (i->second == t)
+			{
+				Timers.erase(i);
+				break;
+			}
+		}
+	}
+
+	void AddTimer(Timer* t)
+	{
+		Timers.insert(std::make_pair(t->GetTriggerMS(), t));
+	}
+};
+
+template <typename Manager>
+static bool RunTimerBenchmark(const char* name, Manager& manager, std::vector<BenchTimer>& timers, const std::vector<unsigned long>& delays)
+{
+	const unsigned long step = 10;
+	const uint64_t start = TimerManager::Now();
+	bench_now = start;
+
+	for (size_t i = 0; i < timers.size(); i++)
+	{
+		timers[i].fired = timers[i].maxlate = 0;
+		timers[i].SetTrigger(0);
+	}
+
+	clock_t before = clock();
+	for (size_t i = 0; i < timers.size(); i++)
+	{
+		// SetIntervalMS() would add the timer to the global TimerManager, so
+		// fake the trigger time through the one second API and the offset
+		Timer& t = timers[i];
+		t.SetTrigger((start + delays[i]) / 1000);
+		manager.AddTimer(&t);
+	}
+	clock_t added = clock();
+
+	// Cancel every other timer
+	for (size_t i = 0; i < timers.size(); i += 2)
+		manager.DelTimer(&timers[i]);
+	clock_t cancelled = clock();
+
+	const uint64_t end = start + 1000 * 1000;
+	while (bench_now < end)
+	{
+		bench_now += step;
+		manager.TickTimers(bench_now);
+	}
+	clock_t ticked = clock();
+
+	bool passed = true;
+	for (size_t i = 0; i < timers.size(); i++)
+	{
+		unsigned long expected = (i % 2) ? 1 : 0;
+		if (timers[i].fired != expected || timers[i].maxlate > step)
+			passed = false;
+		manager.DelTimer(&timers[i]);
+	}
+
+	std::cout << name << ": add " << (double)(added - before) / CLOCKS_PER_SEC * 1000 << "ms, cancel "
+		<< (double)(cancelled - added) / CLOCKS_PER_SEC * 1000 << "ms, tick " << (double)(ticked - cancelled) / CLOCKS_PER_SEC * 1000
+		<< "ms" << (passed ? "" : " (WRONG RESULTS)") << std::endl;
+	return passed;
+}
+
+bool TestSuite::DoTimerBenchmark()
+{
+	const size_t count = 200000;
+	std::cout << "\nAdding " << count << " timers due within 1000 seconds, cancelling half and ticking every 10ms\n\n";
+
+	std::vector<unsigned long> delays;
+	delays.reserve(count);
+	for (size_t i = 0; i < count; i++)
+		delays.push_back(1000 + ServerInstance->GenRandomInt(998000));
+	std::vector<BenchTimer> timers(count);
+
+	LegacyTimerManager legacy;
+	TimerManager wheel;
+	bool passed = RunTimerBenchmark("std::multimap", legacy, timers, delays);
+	passed &= RunTimerBenchmark("timing wheel", wheel, timers, delays);
+
+	// A timer added after the clock went back a minute has to fire on time
+	// rather than once the clock reaches the time it was at before
+	TimerManager stepped;
+	const uint64_t now = TimerManager::Now() / 1000 * 1000;
+	BenchTimer& before = timers[0];
+	BenchTimer& after = timers[1];
+	before.fired = after.fired = 0;
+	before.SetTrigger(now / 1000 + 10);
+	stepped.AddTimer(&before);
+	bench_now = now + 1000;
+	stepped.TickTimers(bench_now);
+	bench_now = now - 60000;
+	stepped.TickTimers(bench_now);
+	after.SetTrigger((now - 59000) / 1000);
+	stepped.AddTimer(&after);
+	bench_now = now - 58990;
+	stepped.TickTimers(bench_now);
+	const bool stepok = ((after.fired == 1) && (before.fired == 0));
+	stepped.DelTimer(&before);
+	stepped.DelTimer(&after);
+	std::cout << "clock going back: " << (stepok ? "SUCCESS" : "FAILURE") << std::endl;
+	return passed && stepok;
+}
+
+/** Bytes currently allocated through CountingAllocator */
+static size_t bench_bytes;
+
+/** Allocator which keeps track of how much memory a container holds */
+template <typename T>
+class CountingAllocator : public std::allocator<T>
+{
+ public:
+	template <typename U>
+	struct rebind
+	{
+		typedef CountingAllocator<U> other;
+	};
+
+	CountingAllocator() { }
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>&) { }
+
+	T* allocate(size_t n, const void* = NULL)
+	{
+		bench_bytes += n * sizeof(T);
+		return std::allocator<T>::allocate(n);
+	}
+
+	void deallocate(T* p, size_t n)
+	{
+		bench_bytes -= n * sizeof(T);
+		std::allocator<T>::deallocate(p, n);
+	}
+};
+
+/** Stands in for a user in the channel benchmark, about as large as a real LocalUser */
+struct BenchUser
+{
+	int usertype;
+	unsigned long received;
+	char padding[sizeof(LocalUser)];
+};
+
+/** The std::map userlist which Channel used to broadcast through, for comparison */
+class LegacyUserList
+{
+	typedef std::map<BenchUser*, Membership*, std::less<BenchUser*>, CountingAllocator<std::pair<BenchUser* const, Membership*> > > MemberMap;
+	MemberMap members;
+
+ public:
+	void Add(BenchUser* user)
+	{
+		members.insert(std::make_pair(user, (Membership*)NULL));
+	}
+
+	void Broadcast()
+	{
+		for (MemberMap::const_iterator i = members.begin(); i != members.end(); ++i)
+		{
+			if (i->first->usertype == USERTYPE_LOCAL)
+				i->first->received++;
+		}
+	}
+};
+
+/** A hash map for lookups plus a dense array of local members, as Channel keeps them */
+class DenseUserList
+{
+	typedef TR1NS::unordered_map<BenchUser*, Membership*, TR1NS::hash<BenchUser*>, std::equal_to<BenchUser*>, CountingAllocator<std::pair<BenchUser* const, Membership*> > > MemberMap;
+	typedef std::vector<std::pair<BenchUser*, Membership*>, CountingAllocator<std::pair<BenchUser*, Membership*> > > LocalList;
+	MemberMap members;
+	LocalList localmembers;
+
+ public:
+	void Add(BenchUser* user)
+	{
+		members.insert(std::make_pair(user, (Membership*)NULL));
+		if (user->usertype == USERTYPE_LOCAL)
+			localmembers.push_back(std::make_pair(user, (Membership*)NULL));
+	}
+
+	void Broadcast()
+	{
+		for (LocalList::const_iterator i = localmembers.begin(); i != localmembers.end(); ++i)
+			i->first->received++;
+	}
+};
+
+template <typename List>
+static bool RunChannelBenchmark(const char* name, const std::vector<BenchUser*>& users, size_t locals, unsigned int rounds)
+{
+	for (std::vector<BenchUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+		(*i)->received = 0;
+
+	const size_t before = bench_bytes;
+	bool passed = true;
+	{
+		List list;
+		for (std::vector<BenchUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			list.Add(*i);
+		const size_t used = bench_bytes - before;
+
+		clock_t start = clock();
+		for (unsigned int i = 0; i < rounds; i++)
+			list.Broadcast();
+		clock_t end = clock();
+
+		size_t delivered = 0;
+		for (std::vector<BenchUser*>::const_iterator i = users.begin(); i != users.end(); ++i)
+			delivered += (*i)->received;
+		passed = (delivered == locals * rounds);
+
+		std::cout << "  " << name << ": " << (double)(end - start) / CLOCKS_PER_SEC * 1000000 / rounds << "us per broadcast, "
+			<< used / 1024 << "KiB" << (passed ? "" : " (WRONG RESULTS)") << std::endl;
+	}
+	return passed;
+}
+
+bool TestSuite::DoChannelBenchmark()
+{
+	const size_t count = 10000;
+	const unsigned int rounds = 1000;
+	std::cout << "\nBroadcasting " << rounds << " times to channels with " << count << " members, memory is userlist overhead only\n";
+
+	// Allocate the users with other allocations in between, like on a busy server
+	std::vector<BenchUser*> users;
+	std::vector<std::string*> filler;
+	for (size_t i = 0; i < count; i++)
+	{
+		users.push_back(new BenchUser);
+		filler.push_back(new std::string(ServerInstance->GenRandomInt(200), 'x'));
+	}
+
+	bool passed = true;
+	const unsigned int percentages[] = { 100, 50, 10 };
+	for (size_t p = 0; p < sizeof(percentages) / sizeof(percentages[0]); p++)
+	{
+		size_t locals = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			bool local = (i * 100 / count) < percentages[p];
+			users[i]->usertype = local ? USERTYPE_LOCAL : USERTYPE_REMOTE;
+			if (local)
+				locals++;
+		}
+		// Join order should not follow allocation order
+		for (size_t i = count - 1; i > 0; i--)
+			std::swap(users[i], users[ServerInstance->GenRandomInt(i + 1)]);
+
+		std::cout << "\n" << percentages[p] << "% local members:\n";
+		passed &= RunChannelBenchmark<LegacyUserList>("std::map", users, locals, rounds);
+		passed &= RunChannelBenchmark<DenseUserList>("local member array", users, locals, rounds);
+	}
+
+	stdalgo::delete_all(users);
+	stdalgo::delete_all(filler);
+	return passed;
+}
+
+bool TestSuite::DoSmallContainerTests()
+{
+	// Go well past the inline capacity so both the linear scan and the index are used
+	const size_t count = 100;
+	SmallSet<size_t, 8> set;
+	SmallMap<size_t, size_t, 8> map;
+
+	for (size_t round = 0; round < 2; round++)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			if (!set.insert(i).second || set.insert(i).second)
+			{
+				std::cout << "SMALLSET: Insert of " << i << " gave the wrong result\n";
+				return false;
+			}
+			map[i] = i * 2;
+			map.insert(std::make_pair(i, (size_t)0));
+		}
+
+		// Erase the even elements, the odd ones are moved around
+		for (size_t i = 0; i < count; i += 2)
+		{
+			if (set.erase(i) != 1 || map.erase(i) != 1 || set.erase(i) != 0)
+			{
+				std::cout << "SMALLSET: Erase of " << i << " gave the wrong result\n";
+				return false;
+			}
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			bool odd = (i % 2);
+			SmallMap<size_t, size_t, 8>::const_iterator it = map.find(i);
+			if (set.count(i) != (odd ? 1u : 0u) || (it != map.end()) != odd || (odd && it->second != i * 2))
+			{
+				std::cout << "SMALLSET: Lookup of " << i << " gave the wrong result\n";
+				return false;
+			}
+		}
+
+		if (set.size() != count / 2 || map.size() != count / 2)
+		{
+			std::cout << "SMALLSET: Size is " << set.size() << " and " << map.size() << " instead of " << count / 2 << std::endl;
+			return false;
+		}
+
+		// The second round checks that the containers work after being cleared
+		set.clear();
+		map.clear();
+		if (!set.empty() || !map.empty() || set.find(1) != set.end())
+		{
+			std::cout << "SMALLSET: Not empty after clear()\n";
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static std::string RandomString(const char* chars, size_t maxlength)
+{
+	std::string ret(ServerInstance->GenRandomInt(maxlength + 1), ' ');
+	const size_t count = strlen(chars);
+	for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+		*i = chars[ServerInstance->GenRandomInt(count)];
+	return ret;
+}
+
+static std::string RandomHost()
+{
+	static const char* const domains[] = { "example.com", "dsl.isp.net", "cable.example.org", "users.irc.example", "a.b.c.d.example.net" };
+	std::string host;
+	switch (ServerInstance->GenRandomInt(3))
+	{
+		case 0:
+			host = "host-" + ConvToStr(ServerInstance->GenRandomInt(256)) + "-" + ConvToStr(ServerInstance->GenRandomInt(256)) + ".";
+			break;
+		case 1:
+			host = RandomString("abcdefghijklmnopqrstuvwxyz0123456789", 12) + ".";
+			break;
+		case 2:
+			return "10." + ConvToStr(ServerInstance->GenRandomInt(256)) + "." + ConvToStr(ServerInstance->GenRandomInt(256)) + "." + ConvToStr(ServerInstance->GenRandomInt(256));
+	}
+	return host + domains[ServerInstance->GenRandomInt(sizeof(domains) / sizeof(domains[0]))];
+}
+
+static bool RunMaskBenchmark(const char* name, const std::vector<std::string>& masks, const std::vector<std::string>& strs, unsigned const char* map)
+{
+	std::vector<WildcardMask> compiled;
+	for (std::vector<std::string>::const_iterator i = masks.begin(); i != masks.end(); ++i)
+		compiled.push_back(WildcardMask(*i, map));
+
+	size_t plainmatches = 0;
+	clock_t start = clock();
+	for (std::vector<std::string>::const_iterator m = masks.begin(); m != masks.end(); ++m)
+		for (std::vector<std::string>::const_iterator i = strs.begin(); i != strs.end(); ++i)
+			plainmatches += InspIRCd::Match(*i, *m, map);
+	clock_t middle = clock();
+
+	size_t compiledmatches = 0;
+	for (std::vector<WildcardMask>::const_iterator m = compiled.begin(); m != compiled.end(); ++m)
+		for (std::vector<std::string>::const_iterator i = strs.begin(); i != strs.end(); ++i)
+			compiledmatches += m->Match(*i);
+	clock_t end = clock();
+
+	const double count = masks.size() * strs.size();
+	std::cout << "  " << name << ": " << (double)(middle - start) / CLOCKS_PER_SEC * 1000000000 / count << "ns with InspIRCd::Match(), "
+		<< (double)(end - middle) / CLOCKS_PER_SEC * 1000000000 / count << "ns compiled, " << compiledmatches << " matches"
+		<< (plainmatches == compiledmatches ? "" : " (WRONG RESULTS)") << std::endl;
+	return (plainmatches == compiledmatches);
+}
+
+bool TestSuite::DoWildcardMaskTests()
+{
+	// Compare against InspIRCd::Match() on random masks made of few characters, so
+	// there are many partial matches and backtracking
+	const unsigned char* const maps[] = { ascii_case_insensitive_map, national_case_insensitive_map };
+	for (size_t m = 0; m < sizeof(maps) / sizeof(maps[0]); m++)
+	{
+		for (unsigned int i = 0; i < 20000; i++)
+		{
+			WildcardMask mask(RandomString("aAb[{.*?", 8), maps[m]);
+			for (unsigned int j = 0; j < 10; j++)
+			{
+				const std::string str = RandomString("aAbB[{.", 10);
+				if (mask.Match(str) != InspIRCd::Match(str, mask.GetMask(), maps[m]))
+				{
+					std::cout << "WILDCARDMASK: \"" << str << "\" against \"" << mask.GetMask() << "\" differs from InspIRCd::Match()\n";
+					return false;
+				}
+			}
+		}
+	}
+
+	const char* const cidrs[][2] = {
+		{ "10.1.2.3", "10.0.0.0/8" }, { "10.1.2.3", "10.1.3.0/24" }, { "10.1.2.3", "10.1.*" },
+		{ "user@10.1.2.3", "u*@10.1.0.0/16" }, { "::1", "::/0" }, { "10.1.2.3", "10.1.2.3/" }
+	};
+	for (size_t i = 0; i < sizeof(cidrs) / sizeof(cidrs[0]); i++)
+	{
+		if (WildcardMask(cidrs[i][1], NULL, true).Match(cidrs[i][0]) != InspIRCd::MatchCIDR(cidrs[i][0], cidrs[i][1]))
+		{
+			std::cout << "WILDCARDMASK: \"" << cidrs[i][0] << "\" against CIDR mask \"" << cidrs[i][1] << "\" differs from InspIRCd::MatchCIDR()\n";
+			return false;
+		}
+	}
+
+	std::vector<std::string> hosts;
+	for (unsigned int i = 0; i < 10000; i++)
+		hosts.push_back(RandomHost());
+
+	// Host parts of bans and X-lines as they are usually set
+	std::vector<std::string> suffixes, prefixes, literals, infixes;
+	for (unsigned int i = 0; i < 50; i++)
+	{
+		const std::string host = RandomHost();
+		const std::string::size_type dot = host.find('.');
+		suffixes.push_back("*" + host.substr(dot));
+		prefixes.push_back(host.substr(0, dot + 1) + "*");
+		literals.push_back(host);
+		infixes.push_back("*" + host.substr(dot, 4) + "*" + host.substr(host.length() - 3));
+	}
+
+	std::cout << "\nMatching " << hosts.size() << " hosts against 50 masks of each kind:\n";
+	bool passed = RunMaskBenchmark("*.suffix", suffixes, hosts, ascii_case_insensitive_map);
+	passed &= RunMaskBenchmark("prefix.*", prefixes, hosts, ascii_case_insensitive_map);
+	passed &= RunMaskBenchmark("literal", literals, hosts, ascii_case_insensitive_map);
+	passed &= RunMaskBenchmark("*infix*suffix", infixes, hosts, ascii_case_insensitive_map);
+	return passed;
+}
+
+static std::string RandomIPv4()
+{
+	// Few distinct values per octet so ranges nest and share prefixes
+	return ConvToStr(10 + ServerInstance->GenRandomInt(2)) + "." + ConvToStr(ServerInstance->GenRandomInt(4)) + "."
+		+ ConvToStr(ServerInstance->GenRandomInt(4) * 64) + "." + ConvToStr(ServerInstance->GenRandomInt(256));
+}
+
+bool TestSuite::DoCIDRTreeTests()
+{
+	CIDRTree<int> tree;
+	std::map<irc::sockets::cidr_mask, int> ranges;
+
+	for (unsigned int round = 0; round < 4000; round++)
+	{
+		irc::sockets::cidr_mask mask(RandomIPv4() + "/" + ConvToStr(ServerInstance->GenRandomInt(33)));
+		if (round % 3 == 2)
+		{
+			// Remove a range that exists most of the time
+			if (!ranges.empty())
+			{
+				std::map<irc::sockets::cidr_mask, int>::iterator it = ranges.begin();
+				std::advance(it, ServerInstance->GenRandomInt(ranges.size()));
+				mask = it->first;
+			}
+			if (tree.Erase(mask) != (ranges.erase(mask) == 1))
+			{
+				std::cout << "CIDRTREE: Erase of " << mask.str() << " gave the wrong result\n";
+				return false;
+			}
+		}
+		else
+		{
+			*tree.Insert(mask) = round;
+			ranges[mask] = round;
+		}
+
+		if (tree.size() != ranges.size())
+		{
+			std::cout << "CIDRTREE: Size is " << tree.size() << " instead of " << ranges.size() << std::endl;
+			return false;
+		}
+
+		irc::sockets::sockaddrs sa;
+		irc::sockets::aptosa(RandomIPv4(), 0, sa);
+		std::vector<int*> found;
+		tree.FindAll(irc::sockets::cidr_mask(sa, 128), found);
+
+		std::set<int> expected, got;
+		for (std::map<irc::sockets::cidr_mask, int>::const_iterator i = ranges.begin(); i != ranges.end(); ++i)
+			if (i->first.match(sa))
+				expected.insert(i->second);
+		for (std::vector<int*>::const_iterator i = found.begin(); i != found.end(); ++i)
+			got.insert(**i);
+
+		if (expected != got || found.size() != got.size())
+		{
+			std::cout << "CIDRTREE: Lookup of " << sa.addr() << " found " << found.size() << " ranges instead of " << expected.size() << std::endl;
+			return false;
+		}
+	}
+
+	std::map<irc::sockets::cidr_mask, int> iterated;
+	for (CIDRTree<int>::const_iterator i = tree.begin(); i != tree.end(); ++i)
+		iterated.insert(*i);
+	if (iterated != ranges)
+	{
+		std::cout << "CIDRTREE: Iterating gave " << iterated.size() << " ranges instead of " << ranges.size() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+static void SetBanModes(Channel* chan, const std::string& modes, const std::string& mask)
+{
+	std::vector<std::string> parameters;
+	parameters.push_back(chan->name);
+	parameters.push_back(modes);
+	parameters.push_back(mask);
+	ServerInstance->Modes->Process(parameters, ServerInstance->FakeClient, ModeParser::MODE_LOCALONLY);
+}
+
+/** Check the cached and the uncached verdicts of IsBanned() and GetExtBanStatus() against the expected ones */
+static bool CheckBanCache(Channel* chan, User* user, const char* step, bool banned, bool listmatch)
+{
+	Membership* memb = chan->GetUser(user);
+	const bool cached = chan->IsBanned(user);
+	const bool cachedlist = (chan->GetExtBanStatus(user, 'Z') == MOD_RES_DENY);
+	const bool filled = ((memb->banned != -1) && (memb->banlistmatch != -1));
+
+	memb->banned = memb->banlistmatch = -1;
+	const bool fresh = chan->IsBanned(user);
+	memb->banned = memb->banlistmatch = -1;
+	const bool freshlist = (chan->GetExtBanStatus(user, 'Z') == MOD_RES_DENY);
+
+	const bool passed = ((cached == banned) && (fresh == banned) && (cachedlist == listmatch) && (freshlist == listmatch) && (filled));
+	std::cout << "BANCACHE: " << step << ": banned " << cached << "/" << fresh << ", list match " << cachedlist << "/" << freshlist
+		<< (filled ? "" : ", not cached") << (passed ? " SUCCESS!\n" : " FAILURE\n");
+	return passed;
+}
+
+bool TestSuite::DoBanCacheTests()
+{
+	if (!ServerInstance->Modes->FindMode('e', MODETYPE_CHANNEL))
+	{
+		std::cout << "BANCACHE: m_banexception must be loaded\n";
+		return false;
+	}
+
+	RemoteUser* user = new RemoteUser(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server);
+	user->nick = "bancachetest";
+	user->ident = "ident";
+	user->host = user->dhost = "host.example.com";
+	user->SetClientIP("10.1.2.3");
+	user->registered = REG_ALL;
+	ServerInstance->Users->clientlist[user->nick] = user;
+
+	Channel* chan = new Channel("#bancachetest", ServerInstance->Time());
+	chan->ForceJoin(user);
+
+	// Every step changes the verdict of the step before it unless noted, so a stale cache is noticed
+	bool passed = CheckBanCache(chan, user, "no bans", false, false);
+	SetBanModes(chan, "+b", "*!*@host.example.com");
+	passed &= CheckBanCache(chan, user, "+b host", true, true);
+	SetBanModes(chan, "+e", "*!ident@*");
+	passed &= CheckBanCache(chan, user, "+e ident", false, true);
+	user->ChangeIdent("other");
+	passed &= CheckBanCache(chan, user, "ident change", true, true);
+	SetBanModes(chan, "-b", "*!*@host.example.com");
+	passed &= CheckBanCache(chan, user, "-b host", false, false);
+	SetBanModes(chan, "+b", "*!*@10.1.0.0/16");
+	passed &= CheckBanCache(chan, user, "+b CIDR", true, true);
+	user->SetClientIP("10.2.2.3");
+	passed &= CheckBanCache(chan, user, "IP change", false, false);
+	// Adding a ban which does not match yet leaves the verdicts as they were
+	SetBanModes(chan, "+b", "bancachenick!*@*");
+	passed &= CheckBanCache(chan, user, "+b nick", false, false);
+	user->ChangeNick("bancachenick", true);
+	passed &= CheckBanCache(chan, user, "nick change", true, true);
+	SetBanModes(chan, "+e", "*!*@cloak.example.net");
+	passed &= CheckBanCache(chan, user, "+e cloak", true, true);
+	user->ChangeDisplayedHost("cloak.example.net");
+	passed &= CheckBanCache(chan, user, "host change", false, true);
+
+	// Masks prepared once and matched part by part agree with the whole hostmask
+	static const struct { const char* mask; bool match; } masks[] = {
+		{ "bancache*!oth?r@*", true },
+		{ "bancachenick!x*@*", false },
+		{ "bancache*other@*", true },
+		{ "*!*@host.example.*", true },
+		{ "*!*@*.example.net", true },
+		{ "*!*@10.2.0.0/16", true },
+		{ "*!*@10.1.0.0/16", false },
+		{ "*!*@10.2.2.*", true },
+	};
+	for (size_t i = 0; i < sizeof(masks) / sizeof(*masks); ++i)
+	{
+		reference<BanMask> banmask = new BanMask(masks[i].mask);
+		const bool match = chan->CheckBan(user, *banmask);
+		std::cout << "BANCACHE: mask " << masks[i].mask << ": " << match << (match == masks[i].match ? " SUCCESS!\n" : " FAILURE\n");
+		passed &= (match == masks[i].match);
+	}
+
+	ServerInstance->Users->QuitUser(user, "Ban cache test finished");
+	ServerInstance->GlobalCulls.Apply();
+	return passed;
+}
+
+bool TestSuite::DoRegexLiteralTests()
+{
+	// Pattern, whether it is a POSIX basic regex, a text it matches and the literal expected from it
+	struct LiteralTest
+	{
+		const char* rx;
+		bool basic;
+		const char* text;
+		const char* literal;
+	};
+
+	const LiteralTest tests[] = {
+		{ "x\\(ab\\)*y", true, "xy", "x" },
+		{ "ab\\{0,1\\}", true, "a", "a" },
+		{ "x(ab)*y", true, "x(aby", "x(ab" },
+		{ "a+b?c{2}", true, "a+b?c{2}", "a+b?c{2}" },
+		{ "spam\\+s", true, "spammms", "spam" },
+		{ "x(ab)*y", false, "xy", "x" },
+		{ "ab{0,1}", false, "a", "a" },
+		{ "foo[0-9]+barbaz", false, "foo1barbaz", "barbaz" },
+		{ "a|spam", false, "a", "" },
+		{ "\\x73pam", false, "spam", "" },
+		{ "\\163pam", false, "spam", "" },
+		{ "spa\\u006d", false, "spam", "" },
+		{ "\\cAfoo", false, "\001foo", "" },
+		{ "(a)\\1bc", false, "aabc", "" },
+		{ "\\$5\\.00", false, "$5.00", "$5.00" },
+		{ "a\\\\b", true, "a\\b", "a\\b" }
+	};
+
+	bool passed = true;
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+	{
+		const std::string literal = Regex::ExtractLiteral(tests[i].rx, tests[i].basic);
+		const bool ok = ((literal == tests[i].literal) && (std::string(tests[i].text).find(literal) != std::string::npos));
+		std::cout << "literal(\"" << tests[i].rx << "\", " << (tests[i].basic ? "basic" : "extended") << ") == \"" << literal << "\" " << (ok ? "SUCCESS\n" : "FAILURE\n");
+		passed &= ok;
+	}
+	return passed;
+}
+
 TestSuite::~TestSuite()
 {
 	std::cout << "\n\n*** END OF TEST SUITE ***\n";
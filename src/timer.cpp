@@ -26,52 +26,205 @@
 void Timer::SetInterval(time_t newinterval)
 {
 	ServerInstance->Timers.DelTimer(this);
-	secs = newinterval;
+	interval = newinterval * 1000;
 	SetTrigger(ServerInstance->Time() + newinterval);
 	ServerInstance->Timers.AddTimer(this);
 }
 
+void Timer::SetIntervalMS(unsigned long newinterval)
+{
+	ServerInstance->Timers.DelTimer(this);
+	interval = newinterval;
+	trigger = TimerManager::Now() + newinterval;
+	ServerInstance->Timers.AddTimer(this);
+}
+
 Timer::~Timer()
 {
 	ServerInstance->Timers.DelTimer(this);
 }
 
-void TimerManager::TickTimers(time_t TIME)
+uint64_t TimerManager::Now()
+{
+	return (uint64_t)ServerInstance->Time() * 1000 + ServerInstance->Time_ns() / 1000000;
+}
+
+TimerManager::TimerManager()
+	: next(0)
+	, count(0)
+{
+	for (unsigned int i = 0; i < WHEEL_COUNT; i++)
+		wheelcount[i] = 0;
+}
+
+void TimerManager::Schedule(Timer* t)
 {
-	for (TimerMap::iterator i = Timers.begin(); i != Timers.end(); )
+	// Anything which is already due goes into the next slot to be processed
+	uint64_t expiry = std::max(t->trigger, next);
+	uint64_t delta = expiry - next;
+
+	unsigned int wheel = 0;
+	while (wheel < WHEEL_COUNT - 1 && delta >= (uint64_t(1) << (WHEEL_BITS * (wheel + 1))))
+		wheel++;
+
+	// Timers beyond the range of the coarsest wheel are parked at its far end
+	// and get placed again whenever they are cascaded
+	const uint64_t range = uint64_t(1) << (WHEEL_BITS * WHEEL_COUNT);
+	if (delta >= range)
+		expiry = next + range - 1;
+
+	TimerList& list = slots[wheel * WHEEL_SIZE + ((expiry >> (WHEEL_BITS * wheel)) & (WHEEL_SIZE - 1))];
+	list.push_front(t);
+	t->slot = &list;
+	wheelcount[wheel]++;
+}
+
+void TimerManager::Unlink(Timer* t)
+{
+	wheelcount[(t->slot - slots) / WHEEL_SIZE]--;
+	t->slot->erase(t);
+	t->slot = NULL;
+}
+
+unsigned int TimerManager::Cascade(unsigned int wheel)
+{
+	unsigned int index = (next >> (WHEEL_BITS * wheel)) & (WHEEL_SIZE - 1);
+	TimerList& list = slots[wheel * WHEEL_SIZE + index];
+	while (!list.empty())
 	{
-		Timer* t = i->second;
-		if (t->GetTrigger() > TIME)
+		Timer* t = list.front();
+		Unlink(t);
+		Schedule(t);
+	}
+	return index;
+}
+
+void TimerManager::Rebase(uint64_t now)
+{
+	std::vector<Timer*> timers;
+	timers.reserve(count);
+	for (unsigned int i = 0; i < WHEEL_COUNT * WHEEL_SIZE; i++)
+	{
+		while (!slots[i].empty())
+		{
+			Timer* t = slots[i].front();
+			Unlink(t);
+			timers.push_back(t);
+		}
+	}
+
+	// Timers are due relative to the wall clock, those added before the step
+	// now fire later by the amount it went back just like they always did
+	next = now;
+	for (std::vector<Timer*>::const_iterator i = timers.begin(); i != timers.end(); ++i)
+		Schedule(*i);
+}
+
+void TimerManager::TickTimers(uint64_t now)
+{
+	const time_t TIME = now / 1000;
+	if (now + 1 < next)
+		Rebase(now);
+
+	while (next <= now)
+	{
+		if (!count)
+		{
+			// Nothing to do, skip straight to the present
+			next = now + 1;
 			break;
+		}
+
+		// If the finest wheels are all empty nothing can trigger before the
+		// coarsest of them wraps around, so jump straight there
+		unsigned int empty = 0;
+		while (!wheelcount[empty])
+			empty++;
+		if (empty)
+		{
+			const uint64_t mask = (uint64_t(1) << (WHEEL_BITS * empty)) - 1;
+			if (next & mask)
+			{
+				next = std::min((next | mask) + 1, now + 1);
+				continue;
+			}
+		}
 
-		Timers.erase(i++);
+		// When the finest wheel wraps around, refill it from the coarser ones
+		unsigned int index = next & (WHEEL_SIZE - 1);
+		for (unsigned int wheel = 1; !index && wheel < WHEEL_COUNT; wheel++)
+			index = Cascade(wheel);
 
-		if (!t->Tick(TIME))
-			continue;
+		TimerList& list = slots[next & (WHEEL_SIZE - 1)];
+		next++;
 
-		if (t->GetRepeat())
+		while (!list.empty())
 		{
-			t->SetTrigger(TIME + t->GetInterval());
-			AddTimer(t);
+			Timer* t = list.front();
+			Unlink(t);
+			count--;
+
+			if (!t->Tick(TIME))
+				continue;
+
+			if (t->GetRepeat())
+			{
+				t->trigger = now + t->interval;
+				AddTimer(t);
+			}
 		}
 	}
 }
 
-void TimerManager::DelTimer(Timer* t)
+unsigned long TimerManager::GetTimeout(uint64_t now, unsigned long max) const
 {
-	std::pair<TimerMap::iterator, TimerMap::iterator> itpair = Timers.equal_range(t->GetTrigger());
+	if (!count)
+		return max;
+	// Also covers the clock going back, TickTimers() then places the timers again
+	if ((next <= now) || (now + 1 < next))
+		return 0;
 
-	for (TimerMap::iterator i = itpair.first; i != itpair.second; ++i)
+	// Look for the first occupied slot of the finest wheel before it wraps
+	// around; if there is none, the next cascade is the earliest point where
+	// a timer can become due
+	uint64_t due = (next | (WHEEL_SIZE - 1)) + 1;
+	if (wheelcount[0])
 	{
-		if (i->second == t)
+		for (uint64_t ms = next; ms < due; ms++)
 		{
-			Timers.erase(i);
-			break;
+			if (!slots[ms & (WHEEL_SIZE - 1)].empty())
+			{
+				due = ms;
+				break;
+			}
 		}
 	}
+
+	return std::min<uint64_t>(due - now, max);
+}
+
+void TimerManager::DelTimer(Timer* t)
+{
+	if (!t->slot)
+		return;
+
+	Unlink(t);
+	count--;
 }
 
 void TimerManager::AddTimer(Timer* t)
 {
-	Timers.insert(std::make_pair(t->GetTrigger(), t));
+	// Never link a timer into two slots at once
+	DelTimer(t);
+
+	if (!count)
+	{
+		// The wheels were idle; start counting from the present so the first
+		// tick does not have to walk through all the time that passed, or
+		// wait for the clock if it went back
+		next = Now();
+	}
+
+	Schedule(t);
+	count++;
 }
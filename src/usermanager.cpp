@@ -105,7 +105,7 @@ void UserManager::AddUser(int socket, ListenSocket* via, irc::sockets::sockaddrs
 	 */
 	New->exempt = (ServerInstance->XLines->MatchesLine("E",New) != NULL);
 
-	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->GetIPString()))
+	if (BanCacheHit *b = ServerInstance->BanCache->GetHit(New->client_sa))
 	{
 		if (!b->Type.empty() && !New->exempt)
 		{
@@ -204,36 +204,39 @@ void UserManager::QuitUser(User* user, const std::string& quitreason, const std:
 
 void UserManager::AddClone(User* user)
 {
-	CloneCounts& counts = clonemap[user->GetCIDRMask()];
-	counts.global++;
+	CloneCounts* counts = clonemap.Insert(user->GetCIDRMask());
+	if (!counts)
+		return;
+
+	counts->global++;
 	if (IS_LOCAL(user))
-		counts.local++;
+		counts->local++;
 }
 
 void UserManager::RemoveCloneCounts(User *user)
 {
-	CloneMap::iterator it = clonemap.find(user->GetCIDRMask());
-	if (it != clonemap.end())
+	const irc::sockets::cidr_mask mask = user->GetCIDRMask();
+	CloneCounts* counts = clonemap.Find(mask);
+	if (counts)
 	{
-		CloneCounts& counts = it->second;
-		counts.global--;
-		if (counts.global == 0)
+		counts->global--;
+		if (counts->global == 0)
 		{
 			// No more users from this IP, remove entry from the map
-			clonemap.erase(it);
+			clonemap.Erase(mask);
 			return;
 		}
 
 		if (IS_LOCAL(user))
-			counts.local--;
+			counts->local--;
 	}
 }
 
 const UserManager::CloneCounts& UserManager::GetCloneCounts(User* user) const
 {
-	CloneMap::const_iterator it = clonemap.find(user->GetCIDRMask());
-	if (it != clonemap.end())
-		return it->second;
+	const CloneCounts* counts = clonemap.Find(user->GetCIDRMask());
+	if (counts)
+		return *counts;
 	else
 		return zeroclonecounts;
 }
@@ -275,68 +278,114 @@ bool UserManager::AllModulesReportReady(LocalUser* user)
 
 /**
  * This function is called once a second from the mainloop.
- * It is intended to do background checking on all the user structs, e.g.
- * stuff like ping checks, registration timeouts, etc.
+ * Only the users with command flood penalty or a sendq are looked at here,
+ * ping checks and registration timeouts are done by the housekeeping timer
+ * of each user when they are due.
  */
 void UserManager::DoBackgroundUserStuff()
 {
-	/*
-	 * loop over all local users..
-	 */
-	for (LocalUserList::iterator i = local_users.begin(); i != local_users.end(); ++i)
+	// Take everyone off the list first, OnDataReady() puts the users who still
+	// have penalty or a sendq back on it
+	std::vector<LocalUser*> pending(fakelag_users.begin(), fakelag_users.end());
+	for (std::vector<LocalUser*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
 	{
-		LocalUser* curr = *i;
+		fakelag_users.erase(*i);
+		(*i)->fakelagged = false;
+	}
 
+	for (std::vector<LocalUser*>::const_iterator i = pending.begin(); i != pending.end(); ++i)
+	{
+		LocalUser* curr = *i;
 		if (curr->quitting)
 			continue;
 
-		if (curr->CommandFloodPenalty || curr->eh.getSendQSize())
-		{
-			unsigned int rate = curr->MyClass->GetCommandRate();
-			if (curr->CommandFloodPenalty > rate)
-				curr->CommandFloodPenalty -= rate;
-			else
-				curr->CommandFloodPenalty = 0;
-			curr->eh.OnDataReady();
-		}
+		unsigned int rate = curr->MyClass->GetCommandRate();
+		if (curr->CommandFloodPenalty > rate)
+			curr->CommandFloodPenalty -= rate;
+		else
+			curr->CommandFloodPenalty = 0;
+		curr->eh.OnDataReady();
+	}
+}
 
-		switch (curr->registered)
-		{
-			case REG_ALL:
-				if (ServerInstance->Time() > curr->nping)
-				{
-					// This user didn't answer the last ping, remove them
-					if (!curr->lastping)
-					{
-						time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
-						const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
-						this->QuitUser(curr, message);
-						continue;
-					}
-
-					curr->Write("PING :" + ServerInstance->Config->ServerName);
-					curr->lastping = 0;
-					curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
-				}
-				break;
-			case REG_NICKUSER:
-				if (AllModulesReportReady(curr))
+void UserManager::CheckFakeLag(LocalUser* user)
+{
+	if ((user->fakelagged) || (user->quitting))
+		return;
+
+	if (user->CommandFloodPenalty || user->eh.getSendQSize())
+	{
+		fakelag_users.push_front(user);
+		user->fakelagged = true;
+	}
+}
+
+void UserManager::DoHousekeeping(LocalUser* curr)
+{
+	if (curr->quitting)
+		return;
+
+	switch (curr->registered)
+	{
+		case REG_ALL:
+			if (ServerInstance->Time() > curr->nping)
+			{
+				// This user didn't answer the last ping, remove them
+				if (!curr->lastping)
 				{
-					/* User has sent NICK/USER, modules are okay, DNS finished. */
-					curr->FullConnect();
-					continue;
+					time_t time = ServerInstance->Time() - (curr->nping - curr->MyClass->GetPingTime());
+					const std::string message = "Ping timeout: " + ConvToStr(time) + (time != 1 ? " seconds" : " second");
+					this->QuitUser(curr, message);
+					return;
 				}
-				break;
-		}
 
-		if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
-		{
-			/*
-			 * registration timeout -- didnt send USER/NICK/HOST
-			 * in the time specified in their connection class.
-			 */
-			this->QuitUser(curr, "Registration timeout");
-			continue;
-		}
+				curr->Write("PING :" + ServerInstance->Config->ServerName);
+				curr->lastping = 0;
+				curr->nping = ServerInstance->Time() + curr->MyClass->GetPingTime();
+			}
+			break;
+		case REG_NICKUSER:
+			if (AllModulesReportReady(curr))
+			{
+				/* User has sent NICK/USER, modules are okay, DNS finished. */
+				curr->FullConnect();
+			}
+			break;
 	}
+
+	// A module or FullConnect() may have removed the user
+	if (curr->quitting)
+		return;
+
+	if (curr->registered != REG_ALL && (ServerInstance->Time() > (curr->age + curr->MyClass->GetRegTimeout())))
+	{
+		/*
+		 * registration timeout -- didnt send USER/NICK/HOST
+		 * in the time specified in their connection class.
+		 */
+		this->QuitUser(curr, "Registration timeout");
+		return;
+	}
+
+	ScheduleHousekeeping(curr);
+}
+
+void UserManager::ScheduleHousekeeping(LocalUser* user)
+{
+	time_t due;
+	if (user->registered == REG_ALL)
+		due = user->nping;
+	else if (user->registered == REG_NICKUSER)
+		due = ServerInstance->Time();
+	else
+		due = user->age + user->MyClass->GetRegTimeout();
+
+	// The checks are for the time being past these, so tick a second later
+	user->housekeeping.Schedule(due + 1);
+}
+
+void UserManager::CheckReady(LocalUser* user)
+{
+	if ((user->registered == REG_NICKUSER) && (!user->quitting))
+		user->housekeeping.Schedule(ServerInstance->Time());
 }
@@ -69,7 +69,7 @@ const char* User::FormatModes(bool showparameters)
 }
 
 User::User(const std::string& uid, Server* srv, int type)
-	: uuid(uid), server(srv), usertype(type)
+	: bangeneration(0), uuid(uid), server(srv), usertype(type)
 {
 	age = ServerInstance->Time();
 	signon = 0;
@@ -84,11 +84,11 @@ User::User(const std::string& uid, Server* srv, int type)
 }
 
 LocalUser::LocalUser(int myfd, irc::sockets::sockaddrs* client, irc::sockets::sockaddrs* servaddr)
-	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this),
+	: User(ServerInstance->UIDGen.GetUID(), ServerInstance->FakeClient->server, USERTYPE_LOCAL), eh(this), housekeeping(this),
 	bytes_in(0), bytes_out(0), cmds_in(0), cmds_out(0), nping(0), CommandFloodPenalty(0),
 	already_sent(0)
 {
-	exempt = quitting_sendq = false;
+	exempt = quitting_sendq = fakelagged = false;
 	idle_lastmsg = 0;
 	ident = "unknown";
 	lastping = 0;
@@ -134,6 +134,17 @@ const std::string& User::GetFullHost()
 	return this->cached_fullhost;
 }
 
+const std::string& User::GetMessagePrefix()
+{
+	if (!this->cached_prefix.empty())
+		return this->cached_prefix;
+
+	const std::string& fullhost = GetFullHost();
+	this->cached_prefix.reserve(fullhost.length() + 2);
+	this->cached_prefix.append(1, ':').append(fullhost).append(1, ' ');
+	return this->cached_prefix;
+}
+
 const std::string& User::GetFullRealHost()
 {
 	if (!this->cached_fullrealhost.empty())
@@ -238,16 +249,27 @@ bool LocalUser::HasPrivPermission(const std::string &privstr, bool noisy)
 	return false;
 }
 
+void UserIOHandler::DoWrite()
+{
+	StreamSocket::DoWrite();
+
+	if (drainnotify && !user->quitting && getError().empty() && getSendQSize() < user->MyClass->GetSendqSoftMax())
+	{
+		drainnotify = false;
+		FOREACH_MOD(OnSendQDrained, (user));
+	}
+}
+
 void UserIOHandler::OnDataReady()
 {
 	if (user->quitting)
 		return;
 
-	if (recvq.length() > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
+	if (recvq.length() - recvq_head > user->MyClass->GetRecvqMax() && !user->HasPrivPermission("users/flood/increased-buffers"))
 	{
 		ServerInstance->Users->QuitUser(user, "RecvQ exceeded");
 		ServerInstance->SNO->WriteToSnoMask('a', "User %s RecvQ of %lu exceeds connect class maximum of %lu",
-			user->nick.c_str(), (unsigned long)recvq.length(), user->MyClass->GetRecvqMax());
+			user->nick.c_str(), (unsigned long)(recvq.length() - recvq_head), user->MyClass->GetRecvqMax());
 		return;
 	}
 	unsigned long sendqmax = ULONG_MAX;
@@ -257,32 +279,45 @@ void UserIOHandler::OnDataReady()
 	if (!user->HasPrivPermission("users/flood/no-fakelag"))
 		penaltymax = user->MyClass->GetPenaltyThreshold() * 1000;
 
+	const std::string::size_type maxline = ServerInstance->Config->Limits.MaxLine - 2;
+	std::string line;
+	line.reserve(ServerInstance->Config->Limits.MaxLine);
 	while (user->CommandFloodPenalty < penaltymax && getSendQSize() < sendqmax)
 	{
-		std::string line;
-		line.reserve(ServerInstance->Config->Limits.MaxLine);
-		std::string::size_type qpos = 0;
-		while (qpos < recvq.length())
+		// Find the end of the line with memchr() which scans a whole block at a
+		// time rather than looking at every character individually
+		const char* start = recvq.data() + recvq_head;
+		const char* eol = NULL;
+		if (recvq_head < recvq.length())
+			eol = static_cast<const char*>(memchr(start, '\n', recvq.length() - recvq_head));
+
+		// if the recvq ran out before we found a newline, wait for more data
+		if (!eol)
+			break;
+
+		std::string::size_type qpos = eol - start + 1;
+		std::string::size_type len = qpos - 1;
+		if (len && start[len - 1] == '\r')
+			len--;
+
+		if (!memchr(start, '\r', len) && !memchr(start, '\0', len))
+		{
+			// The common case, a line without any stray CR or NUL characters
+			line.assign(start, std::min(len, maxline));
+		}
+		else
 		{
-			char c = recvq[qpos++];
-			switch (c)
+			line.clear();
+			for (std::string::size_type i = 0; i < len && line.length() < maxline; i++)
 			{
-			case '\0':
-				c = ' ';
-				break;
-			case '\r':
-				continue;
-			case '\n':
-				goto eol_found;
+				if (start[i] == '\r')
+					continue;
+				line.push_back(start[i] ? start[i] : ' ');
 			}
-			if (line.length() < ServerInstance->Config->Limits.MaxLine - 2)
-				line.push_back(c);
 		}
-		// if we got here, the recvq ran out before we found a newline
-		return;
-eol_found:
-		// just found a newline. Terminate the string, and pull it out of recvq
-		recvq = recvq.substr(qpos);
+
+		// Pull the line out of the recvq; the consumed data is removed in one go later
+		recvq_head += qpos;
 
 		// TODO should this be moved to when it was inserted in recvq?
 		ServerInstance->stats->statsRecv += qpos;
@@ -293,8 +328,19 @@ eol_found:
 		if (user->quitting)
 			return;
 	}
+	CompactRecvQ();
+
 	if (user->CommandFloodPenalty >= penaltymax && !user->MyClass->fakelag)
 		ServerInstance->Users->QuitUser(user, "Excess Flood");
+	else
+		ServerInstance->Users->CheckFakeLag(user);
+}
+
+void LocalUser::AddPenalty(unsigned int penalty)
+{
+	CommandFloodPenalty += penalty;
+	// Penalty added outside of OnDataReady() would otherwise only decay once the user sends something
+	ServerInstance->Users->CheckFakeLag(this);
 }
 
 void UserIOHandler::AddWriteBuf(const std::string &data)
@@ -315,11 +361,44 @@ void UserIOHandler::AddWriteBuf(const std::string &data)
 	WriteData(data);
 }
 
+void UserIOHandler::AddWriteBuf(const reference<SendBuffer>& data)
+{
+	if (user->quitting_sendq)
+		return;
+	if (!user->quitting && getSendQSize() + data->length() > user->MyClass->GetSendqHardMax() &&
+		!user->HasPrivPermission("users/flood/increased-buffers"))
+	{
+		user->quitting_sendq = true;
+		ServerInstance->GlobalCulls.AddSQItem(user);
+		return;
+	}
+
+	WriteData(data);
+}
+
 void UserIOHandler::OnError(BufferedSocketError)
 {
 	ServerInstance->Users->QuitUser(user, getError());
 }
 
+UserHousekeepingTimer::UserHousekeepingTimer(LocalUser* me)
+	: Timer(0, 0)
+	, user(me)
+{
+}
+
+bool UserHousekeepingTimer::Tick(time_t)
+{
+	ServerInstance->Users->DoHousekeeping(user);
+	return true;
+}
+
+void UserHousekeepingTimer::Schedule(time_t when)
+{
+	SetTrigger(when);
+	ServerInstance->Timers.AddTimer(this);
+}
+
 CullResult User::cull()
 {
 	if (!quitting)
@@ -334,6 +413,9 @@ CullResult User::cull()
 CullResult LocalUser::cull()
 {
 	ServerInstance->Users->local_users.erase(this);
+	if (fakelagged)
+		ServerInstance->Users->fakelag_users.erase(this);
+	ServerInstance->Timers.DelTimer(&housekeeping);
 	ClearInvites();
 	eh.cull();
 	return User::cull();
@@ -356,6 +438,7 @@ void User::Oper(OperInfo* info)
 
 	this->SetMode(opermh, true);
 	this->oper = info;
+	InvalidateBanCache();
 	this->WriteCommand("MODE", "+o");
 	FOREACH_MOD(OnOper, (this, info->name));
 
@@ -452,7 +535,7 @@ void User::UnOper()
 	 * to call UnOper. -- w00t
 	 */
 	oper = NULL;
-
+	InvalidateBanCache();
 
 	/* Remove all oper only modes from the user when the deoper - Bug #466*/
 	std::string moderemove("-");
@@ -515,6 +598,7 @@ void LocalUser::CheckClass(bool clone_count)
 	}
 
 	this->nping = ServerInstance->Time() + a->GetPingTime() + ServerInstance->Config->dns_timeout;
+	ServerInstance->Users->ScheduleHousekeeping(this);
 }
 
 bool LocalUser::CheckLines(bool doZline)
@@ -600,7 +684,7 @@ void LocalUser::FullConnect()
 	ServerInstance->SNO->WriteToSnoMask('c',"Client connecting on port %d (class %s): %s (%s) [%s]",
 		this->GetServerPort(), this->MyClass->name.c_str(), GetFullRealHost().c_str(), this->GetIPString().c_str(), this->fullname.c_str());
 	ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding NEGATIVE hit for " + this->GetIPString());
-	ServerInstance->BanCache->AddHit(this->GetIPString(), "", "");
+	ServerInstance->BanCache->AddHit(this->client_sa, "", "");
 	// reset the flood penalty (which could have been raised due to things like auto +x)
 	CommandFloodPenalty = 0;
 }
@@ -612,6 +696,8 @@ void User::InvalidateCache()
 	cached_hostip.clear();
 	cached_makehost.clear();
 	cached_fullrealhost.clear();
+	cached_prefix.clear();
+	InvalidateBanCache();
 }
 
 bool User::ChangeNick(const std::string& newnick, bool force, time_t newts)
@@ -776,6 +862,7 @@ bool User::SetClientIP(const char* sip, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	InvalidateBanCache();
 	return irc::sockets::aptosa(sip, 0, client_sa);
 }
 
@@ -783,6 +870,7 @@ void User::SetClientIP(const irc::sockets::sockaddrs& sa, bool recheck_eline)
 {
 	cachedip.clear();
 	cached_hostip.clear();
+	InvalidateBanCache();
 	memcpy(&client_sa, &sa, sizeof(irc::sockets::sockaddrs));
 }
 
@@ -819,6 +907,89 @@ void User::Write(const char *text, ...)
 {
 }
 
+void User::Write(const reference<SendBuffer>& line)
+{
+	// Hand the line without its CR/LF to the string version, for classes which only override that
+	const std::string& data = line->GetData();
+	this->Write(data.substr(0, data.length() - wide_newline.length()));
+}
+
+MessageBuilder::MessageBuilder()
+	: buffer(new SendBuffer), needspace(false)
+{
+	buffer->data.reserve(ServerInstance->Config->Limits.MaxLine);
+}
+
+void MessageBuilder::Separate()
+{
+	if (needspace)
+		buffer->data.push_back(' ');
+	needspace = true;
+}
+
+MessageBuilder& MessageBuilder::Prefix(const std::string& prefix)
+{
+	buffer->data.append(prefix);
+	needspace = false;
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::Source(const std::string& source)
+{
+	buffer->data.append(1, ':').append(source).append(1, ' ');
+	needspace = false;
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::Add(const std::string& token)
+{
+	Separate();
+	buffer->data.append(token);
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::Add(const char* token)
+{
+	Separate();
+	buffer->data.append(token);
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::AddNumeric(unsigned int numeric)
+{
+	Separate();
+	char digits[3] = { char('0' + (numeric / 100) % 10), char('0' + (numeric / 10) % 10), char('0' + numeric % 10) };
+	buffer->data.append(digits, sizeof(digits));
+	return *this;
+}
+
+MessageBuilder& MessageBuilder::AddTrailing(const std::string& text)
+{
+	Separate();
+	buffer->data.append(1, ':').append(text);
+	return *this;
+}
+
+reference<SendBuffer> MessageBuilder::Finish()
+{
+	std::string& data = buffer->data;
+	if (data.length() > ServerInstance->Config->Limits.MaxLine - 2)
+		data.erase(ServerInstance->Config->Limits.MaxLine - 2);
+	data.append(wide_newline);
+	return buffer;
+}
+
+reference<SendBuffer> LocalUser::PrepareLine(const std::string& text)
+{
+	if (text.length() > ServerInstance->Config->Limits.MaxLine - 2)
+	{
+		// this should happen rarely or never. Crop the string at 512.
+		return new SendBuffer(text.substr(0, ServerInstance->Config->Limits.MaxLine - 2), wide_newline);
+	}
+
+	return new SendBuffer(text, wide_newline);
+}
+
 void LocalUser::Write(const std::string& text)
 {
 	if (!SocketEngine::BoundsCheckFd(&eh))
@@ -834,6 +1005,7 @@ void LocalUser::Write(const std::string& text)
 
 	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %s", uuid.c_str(), text.c_str());
 
+	// Both parts usually end up in the same contiguous write buffer
 	eh.AddWriteBuf(text);
 	eh.AddWriteBuf(wide_newline);
 
@@ -842,6 +1014,22 @@ void LocalUser::Write(const std::string& text)
 	this->cmds_out++;
 }
 
+void LocalUser::Write(const reference<SendBuffer>& line)
+{
+	if (!SocketEngine::BoundsCheckFd(&eh))
+		return;
+
+	// The log message does not include the CR/LF at the end of the line
+	const std::string& data = line->GetData();
+	ServerInstance->Logs->Log("USEROUTPUT", LOG_RAWIO, "C[%s] O %.*s", uuid.c_str(), (int)data.length() - 2, data.c_str());
+
+	eh.AddWriteBuf(line);
+
+	ServerInstance->stats->statsSent += data.length();
+	this->bytes_out += data.length();
+	this->cmds_out++;
+}
+
 /** Write()
  */
 void LocalUser::Write(const char *text, ...)
@@ -853,7 +1041,9 @@ void LocalUser::Write(const char *text, ...)
 
 void User::WriteServ(const std::string& text)
 {
-	this->Write(":%s %s",ServerInstance->Config->ServerName.c_str(),text.c_str());
+	MessageBuilder msg;
+	msg.Source(ServerInstance->Config->ServerName).Add(text);
+	this->Write(msg.Finish());
 }
 
 /** WriteServ()
@@ -887,15 +1077,21 @@ void User::WriteNumeric(unsigned int numeric, const std::string &text)
 	if (MOD_RESULT == MOD_RES_DENY)
 		return;
 
-	const std::string message = InspIRCd::Format(":%s %03u %s %s", ServerInstance->Config->ServerName.c_str(),
-		numeric, this->registered & REG_NICK ? this->nick.c_str() : "*", text.c_str());
-	this->Write(message);
+	MessageBuilder msg;
+	msg.Source(ServerInstance->Config->ServerName).AddNumeric(numeric);
+	if (this->registered & REG_NICK)
+		msg.Add(this->nick);
+	else
+		msg.Add("*");
+	msg.Add(text);
+	this->Write(msg.Finish());
 }
 
 void User::WriteFrom(User *user, const std::string &text)
 {
-	const std::string message = ":" + user->GetFullHost() + " " + text;
-	this->Write(message);
+	MessageBuilder msg;
+	msg.Prefix(user->GetMessagePrefix()).Add(text);
+	this->Write(msg.Finish());
 }
 
 
@@ -915,45 +1111,93 @@ void User::WriteCommon(const char* text, ...)
 
 	std::string textbuffer;
 	VAFORMAT(textbuffer, text, text);
-	textbuffer = ":" + this->GetFullHost() + " " + textbuffer;
-	this->WriteCommonRaw(textbuffer, true);
+	MessageBuilder msg;
+	msg.Prefix(this->GetMessagePrefix()).Add(textbuffer);
+	this->WriteCommonRaw(msg.Finish(), true);
+}
+
+namespace
+{
+	/** The channel list handed to OnBuildNeighborList by WriteCommonRaw() and
+	 * WriteCommonQuit(). A shared list is reused so building a neighbor list does
+	 * not allocate once it has grown; if it is already in use further up the
+	 * stack a private list is used instead.
+	 */
+	class NeighborChanList
+	{
+		static IncludeChanList shared;
+		static bool sharedused;
+
+		IncludeChanList own;
+		const bool usingshared;
+
+	 public:
+		IncludeChanList& list;
+
+		NeighborChanList(const UserChanList& chans)
+			: usingshared(!sharedused), list(usingshared ? shared : own)
+		{
+			sharedused = true;
+			list.assign(chans.begin(), chans.end());
+		}
+
+		~NeighborChanList()
+		{
+			if (usingshared)
+			{
+				shared.clear();
+				sharedused = false;
+			}
+		}
+	};
+
+	IncludeChanList NeighborChanList::shared;
+	bool NeighborChanList::sharedused = false;
 }
 
 void User::WriteCommonRaw(const std::string &line, bool include_self)
+{
+	if (this->registered != REG_ALL || quitting)
+		return;
+
+	this->WriteCommonRaw(LocalUser::PrepareLine(line), include_self);
+}
+
+void User::WriteCommonRaw(const reference<SendBuffer>& message, bool include_self)
 {
 	if (this->registered != REG_ALL || quitting)
 		return;
 
 	LocalUser::already_sent_id++;
 
-	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+	NeighborChanList neighborchans(chans);
+	IncludeChanList& include_c = neighborchans.list;
+	NeighborExceptions exceptions;
 
 	exceptions[this] = include_self;
 
 	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
 		if (u && !u->quitting)
 		{
 			u->already_sent = LocalUser::already_sent_id;
 			if (i->second)
-				u->Write(line);
+				u->Write(message);
 		}
 	}
 	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
 	{
-		Channel* c = (*v)->chan;
-		const UserMembList* ulist = c->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const Channel::LocalMemberList& members = (*v)->chan->GetLocalMembers();
+		for (Channel::LocalMemberList::const_iterator i = members.begin(); i != members.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && u->already_sent != LocalUser::already_sent_id)
+			LocalUser* u = i->user;
+			if (u->already_sent != LocalUser::already_sent_id)
 			{
 				u->already_sent = LocalUser::already_sent_id;
-				u->Write(line);
+				u->Write(message);
 			}
 		}
 	}
@@ -966,15 +1210,21 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 
 	already_sent_t uniq_id = ++LocalUser::already_sent_id;
 
-	const std::string normalMessage = ":" + this->GetFullHost() + " QUIT :" + normal_text;
-	const std::string operMessage = ":" + this->GetFullHost() + " QUIT :" + oper_text;
+	MessageBuilder normalBuilder;
+	normalBuilder.Prefix(this->GetMessagePrefix()).Add("QUIT").AddTrailing(normal_text);
+	const reference<SendBuffer> normalMessage = normalBuilder.Finish();
+
+	MessageBuilder operBuilder;
+	operBuilder.Prefix(this->GetMessagePrefix()).Add("QUIT").AddTrailing(oper_text);
+	const reference<SendBuffer> operMessage = operBuilder.Finish();
 
-	IncludeChanList include_c(chans.begin(), chans.end());
-	std::map<User*,bool> exceptions;
+	NeighborChanList neighborchans(chans);
+	IncludeChanList& include_c = neighborchans.list;
+	NeighborExceptions exceptions;
 
 	FOREACH_MOD(OnBuildNeighborList, (this, include_c, exceptions));
 
-	for (std::map<User*,bool>::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
+	for (NeighborExceptions::iterator i = exceptions.begin(); i != exceptions.end(); ++i)
 	{
 		LocalUser* u = IS_LOCAL(i->first);
 		if (u && !u->quitting)
@@ -986,11 +1236,11 @@ void User::WriteCommonQuit(const std::string &normal_text, const std::string &op
 	}
 	for (IncludeChanList::const_iterator v = include_c.begin(); v != include_c.end(); ++v)
 	{
-		const UserMembList* ulist = (*v)->chan->GetUsers();
-		for (UserMembList::const_iterator i = ulist->begin(); i != ulist->end(); i++)
+		const Channel::LocalMemberList& members = (*v)->chan->GetLocalMembers();
+		for (Channel::LocalMemberList::const_iterator i = members.begin(); i != members.end(); ++i)
 		{
-			LocalUser* u = IS_LOCAL(i->first);
-			if (u && (u->already_sent != uniq_id))
+			LocalUser* u = i->user;
+			if (u->already_sent != uniq_id)
 			{
 				u->already_sent = uniq_id;
 				u->Write(u->IsOper() ? operMessage : normalMessage);
@@ -1044,10 +1294,9 @@ void User::SendText(const std::string& linePrefix, std::stringstream& textStream
  * the first users channels then the second users channels within the outer loop,
  * therefore it was a maximum of x*y iterations (upon returning 0 and checking
  * all possible iterations). However this new function instead checks against the
- * channel's userlist in the inner loop which is a std::map<User*,User*>
+ * channel's userlist in the inner loop which is a hash map keyed by User*
  * and saves us time as we already know what pointer value we are after.
- * Don't quote me on the maths as i am not a mathematician or computer scientist,
- * but i believe this algorithm is now x+(log y) maximum iterations instead.
+ * This makes it x iterations with a constant time lookup in each.
  */
 bool User::SharesChannelWith(User *other)
 {
@@ -1055,7 +1304,7 @@ bool User::SharesChannelWith(User *other)
 	for (UCListIter i = this->chans.begin(); i != this->chans.end(); i++)
 	{
 		/* Eliminate the inner loop (which used to be ~equal in size to the outer loop)
-		 * by replacing it with a map::find which *should* be more efficient
+		 * by replacing it with a hash lookup
 		 */
 		if ((*i)->chan->HasUser(other))
 			return true;
@@ -1074,9 +1323,12 @@ bool User::ChangeName(const std::string& gecos)
 		FIRST_MOD_RESULT(OnChangeLocalUserGECOS, MOD_RESULT, (IS_LOCAL(this),gecos));
 		if (MOD_RESULT == MOD_RES_DENY)
 			return false;
-		FOREACH_MOD(OnChangeName, (this,gecos));
 	}
+
+	FOREACH_MOD(OnChangeName, (this,gecos));
+
 	this->fullname.assign(gecos, 0, ServerInstance->Config->Limits.MaxGecos);
+	InvalidateBanCache();
 
 	return true;
 }
@@ -1105,6 +1357,16 @@ bool User::ChangeDisplayedHost(const std::string& shost)
 	return true;
 }
 
+void User::ChangeRealHost(const std::string& newhost, bool resetdisplay)
+{
+	this->host.assign(newhost, 0, ServerInstance->Config->Limits.MaxHost);
+	if (resetdisplay)
+		this->dhost = this->host;
+	this->InvalidateCache();
+
+	FOREACH_MOD(OnChangeRealHost, (this,this->host));
+}
+
 bool User::ChangeIdent(const std::string& newident)
 {
 	if (this->ident == newident)
@@ -1242,6 +1504,19 @@ const std::string& FakeUser::GetFullHost()
 	return server->GetName();
 }
 
+const std::string& FakeUser::GetMessagePrefix()
+{
+	// Only rebuild the prefix if the name shown for the server has changed
+	const std::string& fullhost = GetFullHost();
+	if ((messageprefix.length() != fullhost.length() + 2) || (messageprefix.compare(1, fullhost.length(), fullhost) != 0))
+	{
+		messageprefix.clear();
+		messageprefix.reserve(fullhost.length() + 2);
+		messageprefix.append(1, ':').append(fullhost).append(1, ' ');
+	}
+	return messageprefix;
+}
+
 const std::string& FakeUser::GetFullRealHost()
 {
 	if (!ServerInstance->Config->HideWhoisServer.empty())
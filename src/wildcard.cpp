@@ -109,6 +109,211 @@ bool InspIRCd::MatchCIDR(const char* str, const char* mask, unsigned const char*
 	return InspIRCd::Match(str, mask, map);
 }
 
+WildcardMask::WildcardMask()
+	: requestedmap(NULL)
+	, map(NULL)
+	, minlength(0)
+	, anchorstart(true)
+	, anchorend(true)
+	, trycidr(false)
+{
+}
+
+WildcardMask::WildcardMask(const std::string& Mask, unsigned const char* Map, bool cidr)
+	: mask(Mask)
+	, requestedmap(Map)
+	, map(NULL)
+	, minlength(0)
+	, trycidr(false)
+{
+	// Like Match(), the mask ends at the first NUL
+	const std::string pattern(mask, 0, mask.find('\0'));
+	anchorstart = (pattern.empty() || pattern[0] != '*');
+	anchorend = (pattern.empty() || pattern[pattern.length() - 1] != '*');
+
+	for (size_t pos = 0; pos < pattern.length(); )
+	{
+		size_t end = pattern.find('*', pos);
+		if (end == std::string::npos)
+			end = pattern.length();
+
+		if (end > pos)
+		{
+			Segment seg;
+			seg.pos = pos;
+			seg.length = end - pos;
+			seg.literal = pattern.find_first_not_of('?', pos) - pos;
+			if (seg.literal > seg.length)
+				seg.literal = seg.length;
+			seg.wild = (pattern.find('?', pos) < end);
+			seg.firstcount = 0;
+			segments.push_back(seg);
+			minlength += seg.length;
+		}
+		pos = end + 1;
+	}
+
+	if (cidr)
+	{
+		// irc::sockets::MatchCIDR() never matches a mask without a '/' in its host part
+		std::string::size_type at = pattern.rfind('@');
+		trycidr = (pattern.find('/', (at == std::string::npos ? 0 : at + 1)) != std::string::npos);
+	}
+
+	folded = pattern;
+	Fold();
+}
+
+void WildcardMask::Fold() const
+{
+	map = (requestedmap ? requestedmap : national_case_insensitive_map);
+	for (std::string::iterator i = folded.begin(); i != folded.end(); ++i)
+		*i = map[(unsigned char)mask[i - folded.begin()]];
+
+	for (std::vector<Segment>::iterator i = segments.begin(); i != segments.end(); ++i)
+	{
+		Segment& seg = *i;
+		seg.firstcount = 0;
+		if (seg.literal == seg.length)
+			continue;
+
+		const unsigned char wanted = folded[seg.pos + seg.literal];
+		unsigned int found = 0;
+		for (unsigned int c = 1; c < 256; c++)
+		{
+			if (map[c] != wanted)
+				continue;
+			if (found < 2)
+				seg.first[found] = c;
+			found++;
+		}
+		if (found <= 2)
+			seg.firstcount = found;
+	}
+}
+
+bool WildcardMask::SegmentMatches(const Segment& seg, const unsigned char* str) const
+{
+	const unsigned char* const want = reinterpret_cast<const unsigned char*>(folded.data()) + seg.pos;
+	if (!seg.wild)
+	{
+		for (size_t i = 0; i < seg.length; i++)
+		{
+			if (want[i] != map[str[i]])
+				return false;
+		}
+		return true;
+	}
+
+	for (size_t i = 0; i < seg.length; i++)
+	{
+		if ((want[i] != map[str[i]]) && (mask[seg.pos + i] != '?'))
+			return false;
+	}
+	return true;
+}
+
+size_t WildcardMask::FindSegment(const Segment& seg, const unsigned char* str, size_t pos, size_t len) const
+{
+	if (len - pos < seg.length)
+		return std::string::npos;
+
+	// Positions of the first literal character which leave room for the whole segment
+	const size_t skip = seg.literal;
+	const unsigned char* const end = str + len - seg.length + skip + 1;
+	const unsigned char* cur = str + pos + skip;
+	if (skip == seg.length)
+		return pos;
+
+	if (!seg.firstcount)
+	{
+		const unsigned char wanted = folded[seg.pos + skip];
+		for (; cur < end; cur++)
+		{
+			if ((map[*cur] == wanted) && (SegmentMatches(seg, cur - skip)))
+				return cur - skip - str;
+		}
+		return std::string::npos;
+	}
+
+	// Let memchr() find the candidates, remembering where each byte was seen last
+	const unsigned char* next[2] = { NULL, NULL };
+	while (cur < end)
+	{
+		const unsigned char* candidate = end;
+		for (unsigned int i = 0; i < seg.firstcount; i++)
+		{
+			if ((!next[i]) || (next[i] < cur))
+			{
+				next[i] = static_cast<const unsigned char*>(memchr(cur, seg.first[i], end - cur));
+				if (!next[i])
+					next[i] = end;
+			}
+			if (next[i] < candidate)
+				candidate = next[i];
+		}
+
+		if (candidate == end)
+			break;
+		if (SegmentMatches(seg, candidate - skip))
+			return candidate - skip - str;
+		cur = candidate + 1;
+	}
+	return std::string::npos;
+}
+
+bool WildcardMask::Match(const std::string& str) const
+{
+	if ((trycidr) && (irc::sockets::MatchCIDR(str, mask, true)))
+		return true;
+
+	if ((!requestedmap) && (map != national_case_insensitive_map))
+		Fold();
+
+	const unsigned char* const data = reinterpret_cast<const unsigned char*>(str.data());
+	size_t len = str.length();
+
+	if (len < minlength)
+		return false;
+
+	if (segments.empty())
+		return ((!anchorstart) || (len == 0));
+
+	std::vector<Segment>::const_iterator first = segments.begin();
+	std::vector<Segment>::const_iterator last = segments.end();
+
+	// A mask without any '*' has to match the whole string
+	if ((anchorstart) && (anchorend) && (segments.size() == 1))
+		return ((len == first->length) && (SegmentMatches(*first, data)));
+
+	size_t pos = 0;
+	if (anchorstart)
+	{
+		if (!SegmentMatches(*first, data))
+			return false;
+		pos = first->length;
+		++first;
+	}
+
+	if (anchorend)
+	{
+		--last;
+		len -= last->length;
+		if (!SegmentMatches(*last, data + len))
+			return false;
+	}
+
+	// The segments in between are matched leftmost first, which is enough as each is followed by a '*'
+	for (; first != last; ++first)
+	{
+		pos = FindSegment(*first, data, pos, len);
+		if (pos == std::string::npos)
+			return false;
+		pos += first->length;
+	}
+	return true;
+}
+
 bool InspIRCd::MatchMask(const std::string& masks, const std::string& hostname, const std::string& ipaddr)
 {
 	std::stringstream masklist(masks);
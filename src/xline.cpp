@@ -134,7 +134,303 @@ class ZLineFactory : public XLineFactory
  *  added since the previous application are applied. This keeps S2S ADDLINE during burst nice and fast,
  *  while at the same time not slowing things the fuck down when we try adding a ban with lots of preexisting
  *  bans. :)
+ *
+ *  Since then, lines of the built in types are looked up through an XLineIndex rather than
+ *  matched one by one, and lines with a duration are queued by expiry time. The queue is
+ *  checked once a second and before lines are looked up, so expiring lines costs nothing
+ *  while none are due.
+ */
+
+/** Finds the lines of one type which may match a user without checking every line.
+ * Lines are filed by the mask they match against the host, IP or nick: valid CIDR
+ * ranges in a radix tree, masks without wildcards in a hash map and other masks by
+ * their longest literal prefix or suffix in an ordered map. Masks with neither are
+ * candidates for every user. Candidates still have to be checked with XLine::Matches().
  */
+class XLineIndex
+{
+ public:
+	enum Key
+	{
+		/** The mask is matched against the host and the IP, also as a CIDR range (G, K and E-lines) */
+		KEY_HOST,
+		/** The mask is matched against the IP, also as a CIDR range (Z-lines) */
+		KEY_IP,
+		/** The mask is matched against the nick (Q-lines) */
+		KEY_NICK
+	};
+
+ private:
+	typedef std::vector<XLine*> LineList;
+	typedef TR1NS::unordered_multimap<std::string, XLine*> ExactMap;
+	typedef std::multimap<std::string, XLine*> PrefixMap;
+
+	enum Place
+	{
+		PLACE_EXACT,
+		PLACE_PREFIX,
+		PLACE_SUFFIX,
+		PLACE_RANGE,
+		PLACE_OTHER
+	};
+
+	const Key key;
+
+	/** The case map the masks are compared with, NULL for the national case map */
+	unsigned const char* const requestedmap;
+
+	/** The map the index was built with */
+	unsigned const char* map;
+
+	ExactMap exact;
+	PrefixMap prefixes;
+
+	/** Reversed literal suffixes */
+	PrefixMap suffixes;
+
+	CIDRTree<LineList> ranges;
+	LineList others;
+
+	/** Get the mask of a line which is matched against the user data this index looks up */
+	static const std::string& GetMask(XLine* line)
+	{
+		switch (line->type[0])
+		{
+			case 'G':
+				return static_cast<GLine*>(line)->hostmask;
+			case 'K':
+				return static_cast<KLine*>(line)->hostmask;
+			case 'E':
+				return static_cast<ELine*>(line)->hostmask;
+			case 'Z':
+				return static_cast<ZLine*>(line)->ipaddr;
+			default:
+				return static_cast<QLine*>(line)->nick;
+		}
+	}
+
+	std::string Fold(const std::string& str) const
+	{
+		std::string ret(str);
+		for (std::string::iterator i = ret.begin(); i != ret.end(); ++i)
+			*i = map[(unsigned char)*i];
+		return ret;
+	}
+
+	/** Work out where a mask is filed
+	 * @param mask The mask
+	 * @param folded Receives the key for the exact, prefix or suffix map
+	 * @param range Receives the range for the radix tree
+	 */
+	Place Classify(const std::string& mask, std::string& folded, irc::sockets::cidr_mask& range) const
+	{
+		if (key != KEY_NICK)
+		{
+			// irc::sockets::MatchCIDR() treats anything before an '@' as a username
+			if (mask.find('@') != std::string::npos)
+				return PLACE_OTHER;
+
+			// Same validity check as irc::sockets::MatchCIDR(); a valid CIDR mask has no
+			// wildcards and its '/' can not be in a host or an IP, so it never matches as a glob
+			const std::string::size_type per_pos = mask.rfind('/');
+			if ((per_pos != std::string::npos) && (per_pos != mask.length() - 1)
+				&& (mask.find_first_not_of("0123456789", per_pos + 1) == std::string::npos)
+				&& (mask.find_first_not_of("0123456789abcdef.:") >= per_pos))
+			{
+				range = irc::sockets::cidr_mask(mask);
+				return (((range.type == AF_INET) || (range.type == AF_INET6)) ? PLACE_RANGE : PLACE_OTHER);
+			}
+		}
+
+		folded = Fold(mask);
+		const std::string::size_type first = folded.find_first_of("*?");
+		if (first == std::string::npos)
+			return PLACE_EXACT;
+
+		const std::string::size_type suffixlen = folded.length() - folded.find_last_of("*?") - 1;
+		if (std::max<size_t>(first, suffixlen) == 0)
+			return PLACE_OTHER;
+
+		if (first >= suffixlen)
+		{
+			folded.erase(first);
+			return PLACE_PREFIX;
+		}
+
+		folded.erase(0, folded.length() - suffixlen);
+		std::reverse(folded.begin(), folded.end());
+		return PLACE_SUFFIX;
+	}
+
+	/** Find the lines whose key is a prefix of probe */
+	static void FindPrefixes(const PrefixMap& keys, std::string probe, LineList& out)
+	{
+		while (!probe.empty())
+		{
+			// The greatest key not after the probe is either a prefix of it, or
+			// shares fewer characters with it than any prefix which is not found yet
+			PrefixMap::const_iterator it = keys.upper_bound(probe);
+			if (it == keys.begin())
+				return;
+			--it;
+
+			const std::string& found = it->first;
+			const size_t limit = std::min(found.length(), probe.length());
+			size_t common = 0;
+			while ((common < limit) && (found[common] == probe[common]))
+				common++;
+
+			if (common == found.length())
+			{
+				std::pair<PrefixMap::const_iterator, PrefixMap::const_iterator> lines = keys.equal_range(found);
+				for (PrefixMap::const_iterator i = lines.first; i != lines.second; ++i)
+					out.push_back(i->second);
+				common--;
+			}
+			probe.erase(common);
+		}
+	}
+
+	template <typename Map>
+	static void EraseLine(Map& lines, const std::string& mapkey, XLine* line)
+	{
+		std::pair<typename Map::iterator, typename Map::iterator> range = lines.equal_range(mapkey);
+		for (typename Map::iterator i = range.first; i != range.second; ++i)
+		{
+			if (i->second == line)
+			{
+				lines.erase(i);
+				return;
+			}
+		}
+	}
+
+	void FindString(const std::string& str, LineList& out) const
+	{
+		const std::string folded = Fold(str);
+		std::pair<ExactMap::const_iterator, ExactMap::const_iterator> lines = exact.equal_range(folded);
+		for (ExactMap::const_iterator i = lines.first; i != lines.second; ++i)
+			out.push_back(i->second);
+
+		FindPrefixes(prefixes, folded, out);
+		FindPrefixes(suffixes, std::string(folded.rbegin(), folded.rend()), out);
+
+		irc::sockets::sockaddrs sa;
+		if ((key != KEY_NICK) && (!ranges.empty()) && (irc::sockets::aptosa(str, 0, sa)))
+		{
+			std::vector<LineList*> found;
+			ranges.FindAll(irc::sockets::cidr_mask(sa, 128), found);
+			for (std::vector<LineList*>::const_iterator i = found.begin(); i != found.end(); ++i)
+				out.insert(out.end(), (*i)->begin(), (*i)->end());
+		}
+	}
+
+ public:
+	XLineIndex(Key k)
+		: key(k)
+		, requestedmap(k == KEY_HOST ? ascii_case_insensitive_map : NULL)
+		, map(requestedmap ? requestedmap : national_case_insensitive_map)
+	{
+	}
+
+	/** Check whether the index has to be rebuilt because the national case map has changed */
+	bool IsStale() const
+	{
+		return ((!requestedmap) && (map != national_case_insensitive_map));
+	}
+
+	/** Rebuild the index using the current case map */
+	void Rebuild(const XLineLookup& lines)
+	{
+		map = (requestedmap ? requestedmap : national_case_insensitive_map);
+		exact.clear();
+		prefixes.clear();
+		suffixes.clear();
+		ranges.clear();
+		others.clear();
+		for (XLineLookup::const_iterator i = lines.begin(); i != lines.end(); ++i)
+			Add(i->second);
+	}
+
+	void Add(XLine* line)
+	{
+		std::string folded;
+		irc::sockets::cidr_mask range;
+		switch (Classify(GetMask(line), folded, range))
+		{
+			case PLACE_EXACT:
+				exact.insert(std::make_pair(folded, line));
+				break;
+			case PLACE_PREFIX:
+				prefixes.insert(std::make_pair(folded, line));
+				break;
+			case PLACE_SUFFIX:
+				suffixes.insert(std::make_pair(folded, line));
+				break;
+			case PLACE_RANGE:
+				ranges.Insert(range)->push_back(line);
+				break;
+			case PLACE_OTHER:
+				others.push_back(line);
+				break;
+		}
+	}
+
+	void Remove(XLine* line)
+	{
+		std::string folded;
+		irc::sockets::cidr_mask range;
+		switch (Classify(GetMask(line), folded, range))
+		{
+			case PLACE_EXACT:
+				EraseLine(exact, folded, line);
+				break;
+			case PLACE_PREFIX:
+				EraseLine(prefixes, folded, line);
+				break;
+			case PLACE_SUFFIX:
+				EraseLine(suffixes, folded, line);
+				break;
+			case PLACE_RANGE:
+			{
+				LineList* lines = ranges.Find(range);
+				if (lines)
+				{
+					stdalgo::vector::swaperase(*lines, line);
+					if (lines->empty())
+						ranges.Erase(range);
+				}
+				break;
+			}
+			case PLACE_OTHER:
+				stdalgo::vector::swaperase(others, line);
+				break;
+		}
+	}
+
+	/** Get the lines which may match a user, a line may be returned more than once */
+	void Find(User* user, LineList& out) const
+	{
+		if (key == KEY_NICK)
+		{
+			FindString(user->nick, out);
+		}
+		else
+		{
+			FindString(user->GetIPString(), out);
+			if (key == KEY_HOST)
+				FindString(user->host, out);
+		}
+		out.insert(out.end(), others.begin(), others.end());
+	}
+
+	/** Get the lines which may match a string, which is compared with what the lines match against in a user */
+	void Find(const std::string& str, LineList& out) const
+	{
+		FindString(str, out);
+		out.insert(out.end(), others.begin(), others.end());
+	}
+};
 
 bool XLine::Matches(User *u)
 {
@@ -179,26 +475,14 @@ void XLineManager::CheckELines()
 
 XLineLookup* XLineManager::GetAll(const std::string &type)
 {
+	/* Expire any dead ones, before sending */
+	ExpireLines();
+
 	ContainerIter n = lookup_lines.find(type);
 
 	if (n == lookup_lines.end())
 		return NULL;
 
-	LookupIter safei;
-	const time_t current = ServerInstance->Time();
-
-	/* Expire any dead ones, before sending */
-	for (LookupIter x = n->second.begin(); x != n->second.end(); )
-	{
-		safei = x;
-		safei++;
-		if (x->second->duration && current > x->second->expiry)
-		{
-			ExpireLine(n, x);
-		}
-		x = safei;
-	}
-
 	return &(n->second);
 }
 
@@ -281,7 +565,14 @@ bool XLineManager::AddLine(XLine* line, User* user)
 	if (xlf->AutoApplyToUserList(line))
 		pending_lines.push_back(line);
 
+	// Get the index first, rebuilding a stale one from lookup_lines must not pick up the new line
+	XLineIndex* index = GetIndex(line->type);
 	lookup_lines[line->type][line->Displayable().c_str()] = line;
+	if (index)
+		index->Add(line);
+	if (line->duration)
+		expiry_queue.insert(std::make_pair(line->expiry, line));
+
 	line->OnAdd();
 
 	FOREACH_MOD(OnAddLine, (user, line));
@@ -316,6 +607,7 @@ bool XLineManager::DelLine(const char* hostmask, const std::string &type, User*
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	Unindex(y->second);
 	delete y->second;
 	x->second.erase(y);
 
@@ -339,71 +631,70 @@ void ELine::Unset()
 
 XLine* XLineManager::MatchesLine(const std::string &type, User* user)
 {
+	ExpireLines();
+
 	ContainerIter x = lookup_lines.find(type);
 
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	XLineIndex* index = GetIndex(type);
+	if (!index)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->duration && current > i->second->expiry)
+		for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
 		{
-			/* Expire the line, proceed to next one */
-			ExpireLine(x, i);
-			i = safei;
-			continue;
+			if (i->second->Matches(user))
+				return i->second;
 		}
+		return NULL;
+	}
 
-		if (i->second->Matches(user))
-		{
-			return i->second;
-		}
+	std::vector<XLine*> candidates;
+	index->Find(user, candidates);
 
-		i = safei;
+	// Return the same line as checking every line in order would
+	XLine* found = NULL;
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* line = *i;
+		if ((!found || irc::string(line->Displayable().c_str()) < irc::string(found->Displayable().c_str())) && (line->Matches(user)))
+			found = line;
 	}
-	return NULL;
+	return found;
 }
 
 XLine* XLineManager::MatchesLine(const std::string &type, const std::string &pattern)
 {
+	ExpireLines();
+
 	ContainerIter x = lookup_lines.find(type);
 
 	if (x == lookup_lines.end())
 		return NULL;
 
-	const time_t current = ServerInstance->Time();
-
-	 LookupIter safei;
-
-	for (LookupIter i = x->second.begin(); i != x->second.end(); )
+	// Only Q-lines match a string against what they match in a user
+	XLineIndex* index = (type == "Q" ? GetIndex(type) : NULL);
+	if (!index)
 	{
-		safei = i;
-		safei++;
-
-		if (i->second->Matches(pattern))
+		for (LookupIter i = x->second.begin(); i != x->second.end(); ++i)
 		{
-			if (i->second->duration && current > i->second->expiry)
-			{
-				/* Expire the line, return nothing */
-				ExpireLine(x, i);
-				/* See above */
-				i = safei;
-				continue;
-			}
-			else
+			if (i->second->Matches(pattern))
 				return i->second;
 		}
+		return NULL;
+	}
+
+	std::vector<XLine*> candidates;
+	index->Find(pattern, candidates);
 
-		i = safei;
+	XLine* found = NULL;
+	for (std::vector<XLine*>::const_iterator i = candidates.begin(); i != candidates.end(); ++i)
+	{
+		XLine* line = *i;
+		if ((!found || irc::string(line->Displayable().c_str()) < irc::string(found->Displayable().c_str())) && (line->Matches(pattern)))
+			found = line;
 	}
-	return NULL;
+	return found;
 }
 
 // removes lines that have expired
@@ -422,10 +713,82 @@ void XLineManager::ExpireLine(ContainerIter container, LookupIter item)
 	if (pptr != pending_lines.end())
 		pending_lines.erase(pptr);
 
+	Unindex(item->second);
 	delete item->second;
 	container->second.erase(item);
 }
 
+void XLineManager::ExpireLines()
+{
+	const time_t current = ServerInstance->Time();
+	while ((!expiry_queue.empty()) && (expiry_queue.begin()->first < current))
+	{
+		XLine* line = expiry_queue.begin()->second;
+		ContainerIter x = lookup_lines.find(line->type);
+		LookupIter i;
+		if ((x == lookup_lines.end()) || ((i = x->second.find(line->Displayable().c_str())) == x->second.end()) || (i->second != line))
+		{
+			// Not in the lists anymore, should never happen
+			expiry_queue.erase(expiry_queue.begin());
+			continue;
+		}
+		ExpireLine(x, i);
+	}
+}
+
+XLineIndex* XLineManager::GetIndex(const std::string& type)
+{
+	std::map<std::string, XLineIndex*>::iterator i = indexes.find(type);
+	if (i == indexes.end())
+	{
+		XLineIndex* index;
+		if ((type == "G") || (type == "K") || (type == "E"))
+			index = new XLineIndex(XLineIndex::KEY_HOST);
+		else if (type == "Z")
+			index = new XLineIndex(XLineIndex::KEY_IP);
+		else if (type == "Q")
+			index = new XLineIndex(XLineIndex::KEY_NICK);
+		else
+			index = NULL;
+		i = indexes.insert(std::make_pair(type, index)).first;
+	}
+
+	XLineIndex* index = i->second;
+	if (index && index->IsStale())
+		index->Rebuild(lookup_lines[type]);
+	return index;
+}
+
+void XLineManager::Unindex(XLine* line)
+{
+	XLineIndex* index = GetIndex(line->type);
+	if (index)
+		index->Remove(line);
+
+	if (!line->duration)
+		return;
+
+	std::pair<std::multimap<time_t, XLine*>::iterator, std::multimap<time_t, XLine*>::iterator> range = expiry_queue.equal_range(line->expiry);
+	for (std::multimap<time_t, XLine*>::iterator i = range.first; i != range.second; ++i)
+	{
+		if (i->second == line)
+		{
+			expiry_queue.erase(i);
+			return;
+		}
+	}
+
+	// The expiry time was changed after the line was added
+	for (std::multimap<time_t, XLine*>::iterator i = expiry_queue.begin(); i != expiry_queue.end(); ++i)
+	{
+		if (i->second == line)
+		{
+			expiry_queue.erase(i);
+			return;
+		}
+	}
+}
+
 
 // applies lines, removing clients and changing nicks etc as applicable
 void XLineManager::ApplyLines()
@@ -452,28 +815,17 @@ void XLineManager::ApplyLines()
 
 void XLineManager::InvokeStats(const std::string &type, int numeric, User* user, string_list &results)
 {
-	ContainerIter n = lookup_lines.find(type);
-
-	time_t current = ServerInstance->Time();
+	ExpireLines();
 
-	LookupIter safei;
+	ContainerIter n = lookup_lines.find(type);
 
 	if (n != lookup_lines.end())
 	{
 		XLineLookup& list = n->second;
-		for (LookupIter i = list.begin(); i != list.end(); )
+		for (LookupIter i = list.begin(); i != list.end(); ++i)
 		{
-			safei = i;
-			safei++;
-
-			if (i->second->duration && current > i->second->expiry)
-			{
-				ExpireLine(n, i);
-			}
-			else
-				results.push_back(ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
-					ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
-			i = safei;
+			results.push_back(ConvToStr(numeric)+" "+user->nick+" :"+i->second->Displayable()+" "+
+				ConvToStr(i->second->set_time)+" "+ConvToStr(i->second->duration)+" "+i->second->source+" :"+i->second->reason);
 		}
 	}
 }
@@ -518,6 +870,9 @@ XLineManager::~XLineManager()
 			delete j->second;
 		}
 	}
+
+	for (std::map<std::string, XLineIndex*>::iterator i = indexes.begin(); i != indexes.end(); ++i)
+		delete i->second;
 }
 
 void XLine::Apply(User* u)
@@ -545,7 +900,7 @@ void XLine::DefaultApply(User* u, const std::string &line, bool bancache)
 	if (bancache)
 	{
 		ServerInstance->Logs->Log("BANCACHE", LOG_DEBUG, "BanCache: Adding positive hit (" + line + ") for " + u->GetIPString());
-		ServerInstance->BanCache->AddHit(u->GetIPString(), this->type, banReason, this->duration);
+		ServerInstance->BanCache->AddHit(u->client_sa, this->type, banReason, this->duration);
 	}
 }
 
@@ -555,10 +910,9 @@ bool KLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.Match(u->host) || hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -578,10 +932,9 @@ bool GLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.Match(u->host) || hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -601,10 +954,9 @@ bool ELine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::Match(u->ident, this->identmask, ascii_case_insensitive_map))
+	if (identmatch.Match(u->ident))
 	{
-		if (InspIRCd::MatchCIDR(u->host, this->hostmask, ascii_case_insensitive_map) ||
-		    InspIRCd::MatchCIDR(u->GetIPString(), this->hostmask, ascii_case_insensitive_map))
+		if (hostmatch.Match(u->host) || hostmatch.Match(u->GetIPString()))
 		{
 			return true;
 		}
@@ -619,7 +971,7 @@ bool ZLine::Matches(User *u)
 	if (lu && lu->exempt)
 		return false;
 
-	if (InspIRCd::MatchCIDR(u->GetIPString(), this->ipaddr))
+	if (ipmatch.Match(u->GetIPString()))
 		return true;
 	else
 		return false;
@@ -633,7 +985,7 @@ void ZLine::Apply(User* u)
 
 bool QLine::Matches(User *u)
 {
-	if (InspIRCd::Match(u->nick, this->nick))
+	if (nickmatch.Match(u->nick))
 		return true;
 
 	return false;